@@ -1,307 +1,1085 @@
+// Подсчет уникальных IPv6 адресов в файле: командная строка над libdistinct_counter
+#include "distinct_counter.h"
+
 #include <iostream>
+#include <iomanip>
 #include <fstream>
-#include <vector>
+#include <sstream>
 #include <string>
+#include <vector>
 #include <cstdint>
 #include <algorithm>
-#include <cstdio>
-#include <atomic>
-#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <optional>
+#include <stdexcept>
 #include <thread>
-#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <set>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-// Структура для хранения IPv6 как 128-битного числа (2 x 64 бита)
-struct uint128_t {
-    uint64_t hi;
-    uint64_t lo;
+namespace {
 
-    // Операторы сравнения для сортировки и уникальности
-    bool operator<(const uint128_t& other) const {
-        if (hi != other.hi) return hi < other.hi;
-        return lo < other.lo;
-    }
+// Границы --fanout; сама библиотека проверяет их еще раз
+const unsigned long MIN_FANOUT = 16;
+const unsigned long MAX_FANOUT = 65536;
 
-    bool operator==(const uint128_t& other) const {
-        return hi == other.hi && lo == other.lo;
-    }
+const unsigned DEFAULT_FOLLOW_SECONDS = 10;
+const uint64_t SLIDING_STEPS = 12; // --sliding без шага сдвигается на 1/12 окна
+
+struct Options {
+    std::string inputPath;
+    std::string outputPath;
+    std::string socketPath; // --serve: режим сервера вместо подсчета по файлу
+    unsigned followSeconds = 0; // --follow: следить за растущим файлом и публиковать счет с этим интервалом
+    bool windowed = false;      // --window или --sliding: ряд счетов по окнам времени вместо одного числа
+    WindowOptions windows;
+    std::vector<Aggregation> aggregations; // --agg: несколько подсчетов по всем входным файлам за один проход
+    std::vector<std::string> inputPaths;
+    bool checkpoint = false;    // --checkpoint без файла: манифест рядом с выходным файлом
+    std::string lookupPath;     // --lookup: поиск адресов входного файла по индексу вместо подсчета
+    DistinctCounterOptions counter;
 };
 
-// Константы
-const size_t NUM_BUCKETS = 256;
-const size_t WRITE_BUFFER_SIZE = 1024 * 64; // Буфер записи для каждого бакета (в элементах)
+// Разбор значения вида "F" или "F1xF2", где F - степень двойки от 16 до 65536
+bool parseFanoutSpec(const std::string& spec, DistinctCounterOptions& opts) {
+    auto toFanout = [](const std::string& text, unsigned& fanout) {
+        char* endp;
+        unsigned long value = std::strtoul(text.c_str(), &endp, 10);
+        if (text.empty() || *endp != '\0' || (value & (value - 1)) != 0) return false;
+        fanout = unsigned(value);
+        return value >= MIN_FANOUT && value <= MAX_FANOUT;
+    };
+    unsigned fanout = 0, subFanout = 0;
+    size_t x = spec.find('x');
+    if (x == std::string::npos) {
+        if (!toFanout(spec, fanout)) return false;
+    } else if (!toFanout(spec.substr(0, x), fanout) || !toFanout(spec.substr(x + 1), subFanout)) {
+        return false;
+    }
+    opts.fanout = fanout;
+    opts.subFanout = subFanout;
+    return true;
+}
 
-// Глобальный счетчик уникальных адресов
-std::atomic<uint64_t> total_unique_count{0};
+// Длительность "90", "90s", "15m", "1h" или "1d" в секундах
+bool parseDuration(const std::string& text, uint64_t& seconds) {
+    char* endp;
+    unsigned long long value = std::strtoull(text.c_str(), &endp, 10);
+    if (endp == text.c_str() || value == 0) return false;
+    std::string unit = endp;
+    if (unit.empty() || unit == "s") seconds = value;
+    else if (unit == "m") seconds = value * 60;
+    else if (unit == "h") seconds = value * 3600;
+    else if (unit == "d") seconds = value * 86400;
+    else return false;
+    return true;
+}
 
-// --- ПАРСЕР IP АДРЕСОВ ---
+// Разбор значения вида "W" или "W/S" для --sliding
+bool parseSlidingSpec(const std::string& spec, WindowOptions& windows) {
+    size_t slash = spec.find('/');
+    if (!parseDuration(spec.substr(0, slash), windows.windowSeconds)) return false;
+    if (slash != std::string::npos) return parseDuration(spec.substr(slash + 1), windows.stepSeconds);
+    if (windows.windowSeconds % SLIDING_STEPS != 0) return false;
+    windows.stepSeconds = windows.windowSeconds / SLIDING_STEPS;
+    return true;
+}
 
-// Вспомогательная функция для конвертации hex-символа в число
-inline int hexDigitToInt(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    return -1;
+bool parseFieldNumber(const std::string& text, unsigned& field) {
+    char* endp;
+    unsigned long value = std::strtoul(text.c_str(), &endp, 10);
+    if (text.empty() || *endp != '\0' || value == 0 || value > 1000) return false;
+    field = unsigned(value);
+    return true;
 }
 
-// Ручной парсер IPv6.
-// Преобразует строку в uint128_t. Автоматически приводит к каноническому бинарному виду.
-bool parseIPv6(const std::string& line, uint128_t& result) {
-    uint16_t parts[8] = {0};
-    int current_part = 0;
-    int double_colon_index = -1; // Индекс, где встретилось ::
-    
-    size_t i = 0;
-    size_t len = line.length();
-    
-    // Пропускаем возможные пробелы в начале
-    while (i < len && isspace(line[i])) i++;
-
-    if (i == len) return false;
-
-    // Особая обработка, если адрес начинается с ::
-    if (line[i] == ':') {
-        if (i + 1 < len && line[i+1] == ':') {
-            double_colon_index = 0;
-            i += 2;
-            // Если строка просто "::", то это 0
-            if (i >= len || isspace(line[i])) {
-                 result.hi = 0; result.lo = 0;
-                 return true;
+// Элементы списка через запятую; элемент "@FILE" - файл с элементом на строку (строки с '#' пропускаются)
+bool parseListValue(const std::string& value, std::vector<std::string>& items, std::string& error) {
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        if (item[0] != '@') {
+            items.push_back(item);
+            continue;
+        }
+        std::ifstream listFile(item.substr(1));
+        if (!listFile.is_open()) {
+            error = "could not open list file " + item.substr(1);
+            return false;
+        }
+        std::string line;
+        while (std::getline(listFile, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == std::string::npos || line[begin] == '#') continue;
+            size_t end = line.find_last_not_of(" \t\r");
+            items.push_back(line.substr(begin, end - begin + 1));
+        }
+    }
+    return true;
+}
+
+// Подсчет вида "NAME [prefix=LIST] [exclude=LIST] [source=LIST] [granularity=N]"
+bool parseAggregationSpec(const std::string& spec, Aggregation& agg, std::string& error) {
+    std::stringstream ss(spec);
+    if (!(ss >> agg.name) || agg.name.find('=') != std::string::npos) {
+        error = "expected a name first";
+        return false;
+    }
+    std::string item;
+    while (ss >> item) {
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        std::string value = eq == std::string::npos ? std::string() : item.substr(eq + 1);
+        if (value.empty()) {
+            error = "expected KEY=VALUE, got " + item;
+            return false;
+        }
+        if (key == "prefix") {
+            if (!parseListValue(value, agg.prefixes, error)) return false;
+        } else if (key == "exclude") {
+            if (!parseListValue(value, agg.excluded, error)) return false;
+        } else if (key == "source") {
+            if (!parseListValue(value, agg.sources, error)) return false;
+        } else if (key == "granularity") {
+            char* endp;
+            unsigned long bits = std::strtoul(value.c_str() + (value[0] == '/'), &endp, 10);
+            if (*endp != '\0' || bits == 0 || bits > 128) {
+                error = "granularity must be a prefix length from 1 to 128";
+                return false;
             }
+            agg.granularity = unsigned(bits);
         } else {
-            // Невалидный адрес (начался с одиночного :)
+            error = "unknown key " + key;
             return false;
         }
     }
+    return true;
+}
+
+bool addAggregation(const std::string& spec, Options& opts) {
+    Aggregation agg;
+    std::string error;
+    if (!parseAggregationSpec(spec, agg, error)) {
+        std::cerr << "Error: Bad aggregation \"" << spec << "\": " << error << std::endl;
+        return false;
+    }
+    opts.aggregations.push_back(agg);
+    return true;
+}
 
-    while (i < len && current_part < 8) {
-        // Читаем hex число
-        uint32_t val = 0;
-        bool has_digits = false;
-        
-        while (i < len) {
-            int digit = hexDigitToInt(line[i]);
-            if (digit == -1) break;
-            val = (val << 4) | digit;
-            has_digits = true;
-            i++;
+// source= задает входные файлы так, как они указаны в командной строке, или по имени без каталога
+bool resolveSources(Options& opts) {
+    for (Aggregation& agg : opts.aggregations) {
+        std::vector<std::string> paths;
+        for (const std::string& source : agg.sources) {
+            size_t before = paths.size();
+            for (const std::string& path : opts.inputPaths) {
+                size_t slash = path.rfind('/');
+                std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+                if (path == source || base == source) paths.push_back(path);
+            }
+            if (paths.size() == before) {
+                std::cerr << "Error: Aggregation " << agg.name << ": source " << source << " is not an input file"
+                          << std::endl;
+                return false;
+            }
         }
+        agg.sources = paths;
+    }
+    return true;
+}
 
-        if (has_digits) {
-            parts[current_part++] = static_cast<uint16_t>(val);
-        }
+// Размер в байтах, можно с суффиксом K, M, G или T (степени 1024)
+bool parseByteSize(const std::string& text, uint64_t& bytes) {
+    char* endp;
+    unsigned long long value = std::strtoull(text.c_str(), &endp, 10);
+    if (endp == text.c_str() || value == 0) return false;
+    std::string unit = endp;
+    unsigned shift = 0;
+    if (unit == "K") shift = 10;
+    else if (unit == "M") shift = 20;
+    else if (unit == "G") shift = 30;
+    else if (unit == "T") shift = 40;
+    else if (!unit.empty()) return false;
+    if (value > (UINT64_MAX >> shift)) return false;
+    bytes = uint64_t(value) << shift;
+    return true;
+}
 
-        if (i >= len || isspace(line[i])) break;
+// Разбор значения вида "R,P,W"
+bool parsePipelineSpec(const std::string& spec, DistinctCounterOptions::Pipeline& cfg) {
+    size_t values[3];
+    std::stringstream ss(spec);
+    std::string item;
+    for (int i = 0; i < 3; ++i) {
+        if (!std::getline(ss, item, ',') || item.empty()) return false;
+        char* endp;
+        values[i] = std::strtoul(item.c_str(), &endp, 10);
+        if (*endp != '\0' || values[i] == 0) return false;
+    }
+    if (std::getline(ss, item, ',')) return false;
+    cfg.readers = values[0];
+    cfg.parsers = values[1];
+    cfg.partitioners = values[2];
+    return true;
+}
 
-        if (line[i] == ':') {
-            i++;
-            if (i < len && line[i] == ':') {
-                if (double_colon_index != -1) return false; // Второе :: запрещено
-                double_colon_index = current_part;
-                i++;
+bool parseOptions(int argc, char* argv[], Options& opts) {
+    DistinctCounterOptions& counter = opts.counter;
+    std::vector<std::string> positional;
+    bool windowFormat = false; // --addr-field, --time-field и --lateness имеют смысл только с окнами
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--hugepages") {
+            counter.hugePages = true;
+        } else if (arg == "--async-io") {
+            counter.asyncIo = true;
+        } else if (arg.compare(0, 9, "--fanout=") == 0) {
+            if (!parseFanoutSpec(arg.substr(9), counter)) {
+                std::cerr << "Error: Expected --fanout=F or --fanout=F1xF2 with powers of two from "
+                          << MIN_FANOUT << " to " << MAX_FANOUT << std::endl;
+                return false;
+            }
+        } else if (arg.compare(0, 9, "--engine=") == 0) {
+            counter.engine = arg.substr(9);
+        } else if (arg == "--sort=std" || arg == "--sort=vector") {
+            counter.sortKernel = arg.substr(7);
+        } else if (arg == "--prefilter") {
+            counter.prefilterBytes = DistinctCounterOptions::PREFILTER_DEFAULT;
+        } else if (arg.compare(0, 12, "--prefilter=") == 0) {
+            char* endp;
+            unsigned long kb = std::strtoul(arg.c_str() + 12, &endp, 10);
+            if (arg.size() == 12 || *endp != '\0' || kb == 0) {
+                std::cerr << "Error: Expected --prefilter=KB with a positive size" << std::endl;
+                return false;
+            }
+            counter.prefilterBytes = kb * 1024;
+        } else if (arg == "--no-prefilter") {
+            counter.prefilterBytes = 0;
+        } else if (arg == "--no-sorted-check") {
+            counter.sortedCheck = false;
+        } else if (arg.compare(0, 9, "--memory=") == 0) {
+            char* endp;
+            unsigned long long mb = std::strtoull(arg.c_str() + 9, &endp, 10);
+            if (arg.size() == 9 || *endp != '\0') {
+                std::cerr << "Error: Expected --memory=MB" << std::endl;
+                return false;
+            }
+            counter.memoryBytes = mb * 1024 * 1024;
+        } else if (arg.compare(0, 17, "--max-temp-bytes=") == 0) {
+            if (!parseByteSize(arg.substr(17), counter.maxTempBytes)) {
+                std::cerr << "Error: Expected --max-temp-bytes=SIZE such as 500G, 64M or a byte count" << std::endl;
+                return false;
+            }
+        } else if (arg == "--no-plan") {
+            counter.plan = false;
+        } else if (arg == "--pipeline") {
+            counter.pipeline.enabled = true;
+        } else if (arg.compare(0, 11, "--pipeline=") == 0) {
+            counter.pipeline.enabled = true;
+            if (!parsePipelineSpec(arg.substr(11), counter.pipeline)) {
+                std::cerr << "Error: Expected --pipeline=READERS,PARSERS,PARTITIONERS" << std::endl;
+                return false;
+            }
+        } else if (arg == "--follow") {
+            opts.followSeconds = DEFAULT_FOLLOW_SECONDS;
+        } else if (arg.compare(0, 9, "--follow=") == 0) {
+            char* endp;
+            unsigned long seconds = std::strtoul(arg.c_str() + 9, &endp, 10);
+            if (arg.size() == 9 || *endp != '\0' || seconds == 0) {
+                std::cerr << "Error: Expected --follow=SECONDS with a positive interval" << std::endl;
+                return false;
+            }
+            opts.followSeconds = unsigned(seconds);
+        } else if (arg.compare(0, 8, "--serve=") == 0 && arg.size() > 8) {
+            opts.socketPath = arg.substr(8);
+        } else if (arg.compare(0, 9, "--window=") == 0) {
+            opts.windowed = true;
+            opts.windows.stepSeconds = 0;
+            if (!parseDuration(arg.substr(9), opts.windows.windowSeconds)) {
+                std::cerr << "Error: Expected --window=DURATION such as 300, 90s, 5m, 1h or 1d" << std::endl;
+                return false;
+            }
+        } else if (arg.compare(0, 10, "--sliding=") == 0) {
+            opts.windowed = true;
+            if (!parseSlidingSpec(arg.substr(10), opts.windows)) {
+                std::cerr << "Error: Expected --sliding=DURATION[/STEP]; without STEP the duration must split"
+                          << " into " << SLIDING_STEPS << " whole seconds" << std::endl;
+                return false;
+            }
+        } else if (arg.compare(0, 11, "--lateness=") == 0) {
+            std::string value = arg.substr(11);
+            uint64_t seconds = 0;
+            if (value != "0" && !parseDuration(value, seconds)) {
+                std::cerr << "Error: Expected --lateness=DURATION" << std::endl;
+                return false;
             }
+            opts.windows.latenessSeconds = seconds;
+            windowFormat = true;
+        } else if (arg == "--checkpoint" || arg == "--resume") {
+            opts.checkpoint = true;
+            if (arg == "--resume") counter.resume = true;
+        } else if (arg.compare(0, 13, "--checkpoint=") == 0 && arg.size() > 13) {
+            opts.checkpoint = true;
+            counter.checkpoint = arg.substr(13);
+        } else if (arg.compare(0, 22, "--checkpoint-interval=") == 0) {
+            char* endp;
+            unsigned long seconds = std::strtoul(arg.c_str() + 22, &endp, 10);
+            if (arg.size() == 22 || *endp != '\0' || seconds == 0) {
+                std::cerr << "Error: Expected --checkpoint-interval=SECONDS with a positive interval" << std::endl;
+                return false;
+            }
+            counter.checkpointSeconds = unsigned(seconds);
+        } else if (arg.compare(0, 8, "--index=") == 0 && arg.size() > 8) {
+            counter.indexPath = arg.substr(8);
+        } else if (arg.compare(0, 9, "--lookup=") == 0 && arg.size() > 9) {
+            opts.lookupPath = arg.substr(9);
+        } else if (arg.compare(0, 6, "--agg=") == 0) {
+            if (!addAggregation(arg.substr(6), opts)) return false;
+        } else if (arg.compare(0, 15, "--aggregations=") == 0) {
+            std::ifstream specFile(arg.substr(15));
+            if (!specFile.is_open()) {
+                std::cerr << "Error: Could not open aggregations file " << arg.substr(15) << std::endl;
+                return false;
+            }
+            std::string line;
+            while (std::getline(specFile, line)) {
+                size_t begin = line.find_first_not_of(" \t\r");
+                if (begin == std::string::npos || line[begin] == '#') continue;
+                if (!addAggregation(line, opts)) return false;
+            }
+        } else if (arg.compare(0, 13, "--time-field=") == 0) {
+            if (!parseFieldNumber(arg.substr(13), opts.windows.timeField)) {
+                std::cerr << "Error: Expected --time-field=N with a field number from 1" << std::endl;
+                return false;
+            }
+            windowFormat = true;
+        } else if (arg.compare(0, 13, "--addr-field=") == 0) {
+            if (!parseFieldNumber(arg.substr(13), opts.windows.addressField)) {
+                std::cerr << "Error: Expected --addr-field=N with a field number from 1" << std::endl;
+                return false;
+            }
+            windowFormat = true;
+        } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Error: Unknown option " << arg << std::endl;
+            return false;
         } else {
-            return false; // Некорректный символ
+            positional.push_back(arg);
         }
     }
-
-    // Раскрытие :: (double colon)
-    if (double_colon_index != -1) {
-        int parts_parsed = current_part;
-        int parts_to_shift = parts_parsed - double_colon_index;
-        int shift_amount = 8 - parts_parsed;
-        
-        for (int k = 0; k < parts_to_shift; ++k) {
-            parts[7 - k] = parts[parts_parsed - 1 - k];
-            parts[parts_parsed - 1 - k] = 0;
+    // Бюджет временного диска и индекс есть только у обычного подсчета
+    bool countOnly = counter.maxTempBytes > 0 || !counter.indexPath.empty();
+    if (!opts.lookupPath.empty()) {
+        // Поиск по готовому индексу ничего не считает
+        if (!opts.socketPath.empty() || opts.followSeconds > 0 || opts.windowed || windowFormat ||
+            !opts.aggregations.empty() || opts.checkpoint || countOnly || positional.size() != 2) {
+            return false;
         }
-    } else if (current_part != 8) {
-        return false; // Не полный адрес и нет ::
+        opts.inputPath = positional[0];
+        opts.outputPath = positional[1];
+        return true;
+    }
+    if (!opts.socketPath.empty()) {
+        return positional.empty() && opts.followSeconds == 0 && !opts.windowed && !opts.checkpoint && !countOnly;
+    }
+    if ((opts.windowed && opts.followSeconds > 0) || (windowFormat && !opts.windowed)) return false;
+    if (countOnly && (opts.windowed || opts.followSeconds > 0 || !opts.aggregations.empty())) return false;
+    if (!opts.aggregations.empty()) {
+        // Несколько входных файлов, выходной - последним
+        if (opts.windowed || opts.followSeconds > 0 || opts.checkpoint || positional.size() < 2) return false;
+        opts.outputPath = positional.back();
+        opts.inputPaths.assign(positional.begin(), positional.end() - 1);
+        opts.inputPath = opts.inputPaths[0];
+        return resolveSources(opts);
+    }
+    if (positional.size() != 2) return false;
+    opts.inputPath = positional[0];
+    opts.outputPath = positional[1];
+    if (opts.checkpoint) {
+        // Контрольные точки есть только у обычного подсчета одного файла
+        if (opts.windowed || opts.followSeconds > 0) return false;
+        if (counter.checkpoint.empty()) counter.checkpoint = opts.outputPath + ".checkpoint";
     }
+    return true;
+}
 
-    // Упаковка в 2 uint64
-    result.hi = ((uint64_t)parts[0] << 48) | ((uint64_t)parts[1] << 32) | 
-                ((uint64_t)parts[2] << 16) | ((uint64_t)parts[3]);
-    result.lo = ((uint64_t)parts[4] << 48) | ((uint64_t)parts[5] << 32) | 
-                ((uint64_t)parts[6] << 16) | ((uint64_t)parts[7]);
+void printUsage(const char* prog) {
+    std::cerr << "Usage in format: " << prog << " <input_file> <output_file> [options]" << std::endl
+              << "             or: " << prog << " --serve=SOCKET [options]" << std::endl
+              << "             or: " << prog << " <log_file> <output_file> --window=DURATION | --sliding=DURATION[/STEP]"
+              << " [options]" << std::endl
+              << "             or: " << prog << " <input_file>... <output_file> --agg=SPEC [--agg=SPEC...] [options]"
+              << std::endl
+              << "             or: " << prog << " --lookup=INDEX <queries_file> <output_file>" << std::endl
+              << "Options:" << std::endl
+              << "  --hugepages    back bucket arrays and write buffers with 2 MB pages" << std::endl
+              << "  --async-io     read and write bucket files from coroutines (C++20 build only)" << std::endl
+              << "  --fanout=F[xF2] split keys into F buckets (default 256); with F2, buckets over 64 MB" << std::endl
+              << "                 are split again into F2 sub-buckets in phase 2" << std::endl
+              << "  --engine=NAME  phase 2 dedup engine: auto (default, chosen per bucket), sort, radix," << std::endl
+              << "                 hash, partitioned-hash, roaring (containers per /112 for dense ranges)," << std::endl
+              << "                 columnar (low halves sorted per /64) or network (buckets of up to 16 keys)" << std::endl
+              << "  --sort=KERNEL  bucket sort used by the sort and radix engines: std (default) or" << std::endl
+              << "                 vector (AVX-512 or AVX2 bitonic networks, chosen by CPUID)" << std::endl
+              << "  --prefilter[=KB] drop repeats of recently seen addresses before they are written;" << std::endl
+              << "                 KB is the per-thread cache size (default: half of L2)" << std::endl
+              << "  --memory=MB    keep phase 1 buckets in memory up to MB in total and spill the largest" << std::endl
+              << "                 ones to disk beyond that (default: a quarter of RAM, 0: all to disk)" << std::endl
+              << "  --max-temp-bytes=SIZE" << std::endl
+              << "                 keep phase 1 temp files near SIZE (K, M, G or T suffix) by compacting the" << std::endl
+              << "                 largest bucket files into sorted runs of distinct addresses while reading" << std::endl
+              << "  --no-sorted-check" << std::endl
+              << "                 always partition, skipping the streaming count for input already in address order" << std::endl
+              << "  --no-prefilter keep the prefilter off even if the planner would turn it on" << std::endl
+              << "  --no-plan      skip the input pre-sample and use the defaults for everything not set" << std::endl
+              << "                 explicitly (explicit options always override the plan)" << std::endl
+              << "  --pipeline[=R,P,W]" << std::endl
+              << "                 run phase 1 as a reader -> parser -> partitioner pipeline" << std::endl
+              << "                 with R, P and W threads per stage" << std::endl
+              << "  --serve=SOCKET run as a daemon: count address lines sent to a Unix socket and answer" << std::endl
+              << "                 !count, !stats and !shutdown commands while ingesting" << std::endl
+              << "  --follow[=SEC] keep reading the input as it grows (following rotation) and rewrite" << std::endl
+              << "                 the output with the exact count every SEC seconds (default 10)" << std::endl
+              << "  --window=DURATION" << std::endl
+              << "                 count distinct addresses of a timestamped log per tumbling window (exact)" << std::endl
+              << "                 and write one START END DISTINCT line per window; DURATION is 90, 90s, 5m, 1h or 1d" << std::endl
+              << "  --sliding=DURATION[/STEP]" << std::endl
+              << "                 the same for a window sliding by STEP (default 1/12 of the window)," << std::endl
+              << "                 estimated with HyperLogLog per step" << std::endl
+              << "  --addr-field=N, --time-field=N" << std::endl
+              << "                 whitespace-separated fields with the address and the timestamp (default 1 and 4," << std::endl
+              << "                 nginx/Apache access logs); timestamps may be [dd/Mon/yyyy:HH:MM:SS zone]," << std::endl
+              << "                 ISO 8601 or Unix seconds" << std::endl
+              << "  --lateness=DURATION" << std::endl
+              << "                 accept lines this much out of order (default one step); later ones are dropped" << std::endl
+              << "  --agg=\"NAME [prefix=LIST] [exclude=LIST] [source=LIST] [granularity=N]\"" << std::endl
+              << "                 one of up to 64 named distinct counts over all inputs, produced in one pass:" << std::endl
+              << "                 addresses in the prefix list and not in the exclude list, from the given input" << std::endl
+              << "                 files, counted as distinct /N prefixes (default 128); LIST is comma-separated," << std::endl
+              << "                 @FILE reads one item per line; the output gets one NAME COUNT line per count" << std::endl
+              << "  --aggregations=FILE" << std::endl
+              << "                 read --agg specs from FILE, one per line" << std::endl
+              << "  --checkpoint[=FILE]" << std::endl
+              << "                 save a resumable manifest (default <output_file>.checkpoint) every" << std::endl
+              << "                 --checkpoint-interval=SEC seconds (default 60); buckets always go to disk" << std::endl
+              << "  --resume       continue an interrupted run from its checkpoint (implies --checkpoint)" << std::endl
+              << "  --index=FILE   also write the distinct addresses to FILE as an index for --lookup" << std::endl
+              << "  --lookup=INDEX look up every line of the input in an index written with --index; the output" << std::endl
+              << "                 gets one LINE<TAB>1 or LINE<TAB>0 per line (- if the line is not an address)" << std::endl;
+}
 
+bool writeResult(const std::string& outputPath, uint64_t count) {
+    std::ofstream outFile(outputPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Could not write output file." << std::endl;
+        return false;
+    }
+    outFile << count << std::endl;
     return true;
 }
 
-// --- УПРАВЛЕНИЕ ФАЙЛАМИ ---
-std::string getBucketFileName(size_t bucket_id) {
-    return "temp_bucket_" + std::to_string(bucket_id) + ".bin";
-}
+// --- РЕЖИМ СЕРВЕРА ---
 
-// Класс для буферизированной записи в бакеты
-class BucketWriter {
-    std::vector<std::ofstream> streams;
-    std::vector<std::vector<uint128_t>> buffers;
+const size_t CLIENT_BUFFER_BYTES = 1024 * 1024;
 
-public:
-    BucketWriter() {
-        streams.resize(NUM_BUCKETS);
-        buffers.resize(NUM_BUCKETS);
-        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
-            buffers[i].reserve(WRITE_BUFFER_SIZE);
+// Сервер принимает соединения на Unix-сокете, по потоку на соединение. Соединение присылает строки
+// адресов; строка, начинающаяся с '!', - команда, она выполняется после всех строк, присланных до нее.
+class Server {
+    LiveDistinctCounter& counter;
+    int listenFd = -1;
+    std::atomic<bool> stopping{false};
+    std::mutex lock;
+    std::condition_variable idle;
+    std::set<int> clients;
+
+    void reply(int fd, const std::string& text) {
+        const char* p = text.data();
+        size_t left = text.size();
+        while (left > 0) {
+            ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+            if (n <= 0) return; // Клиент ушел, не дождавшись ответа
+            p += n;
+            left -= n;
+        }
+    }
+
+    void command(int fd, std::string cmd) {
+        if (!cmd.empty() && cmd.back() == '\r') cmd.pop_back();
+        if (cmd == "!count") {
+            reply(fd, std::to_string(counter.count()) + "\n");
+        } else if (cmd == "!stats") {
+            std::ostringstream out;
+            counter.print_stats(out);
+            reply(fd, out.str() + "\n");
+        } else if (cmd == "!shutdown") {
+            reply(fd, std::to_string(counter.count()) + "\n");
+            stop();
+        } else {
+            reply(fd, "error: unknown command " + cmd + "\n");
         }
     }
 
-    void openAll() {
-        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
-            std::string file_name = getBucketFileName(i);
-            streams[i].open(file_name, std::ios::binary | std::ios::out | std::ios::trunc);
-            if (!streams[i].is_open()) {
-                std::cerr << "Error: Could not open temp file " << file_name << std::endl;
-                exit(1);
+    // Целые строки из data уходят в счетчик, команды выполняются по порядку. Возвращает, сколько
+    // байт разобрано; незавершенная строка остается до следующего чтения, если это не конец потока.
+    size_t consume(int fd, const char* data, size_t length, bool last) {
+        const char* end = data + length;
+        const char* batch = data;
+        const char* p = data;
+        while (p < end) {
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            if (!eol) {
+                if (!last) break;
+                eol = end;
+            }
+            if (*p == '!') {
+                counter.add_text_buffer(batch, p - batch);
+                command(fd, std::string(p, eol));
+                batch = std::min(eol + 1, end);
             }
+            p = std::min(eol + 1, end);
         }
+        counter.add_text_buffer(batch, p - batch);
+        return p - data;
     }
 
-    void add(uint8_t bucket_idx, const uint128_t& ip) {
-        buffers[bucket_idx].push_back(ip);
-        if (buffers[bucket_idx].size() >= WRITE_BUFFER_SIZE) {
-            flush(bucket_idx);
+    void handleClient(int fd) {
+        std::vector<char> buffer(CLIENT_BUFFER_BYTES);
+        size_t filled = 0;
+        bool skipping = false; // Остаток слишком длинной строки отбрасывается до перевода строки
+        try {
+            while (true) {
+                ssize_t n = read(fd, buffer.data() + filled, buffer.size() - filled);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                filled += n;
+                size_t start = 0;
+                if (skipping) {
+                    const char* eol = static_cast<const char*>(std::memchr(buffer.data(), '\n', filled));
+                    if (!eol) {
+                        filled = 0;
+                        continue;
+                    }
+                    start = eol - buffer.data() + 1;
+                    skipping = false;
+                }
+                size_t done = start + consume(fd, buffer.data() + start, filled - start, false);
+                std::memmove(buffer.data(), buffer.data() + done, filled - done);
+                filled -= done;
+                // Строка длиннее буфера ни адресом, ни командой быть не может
+                if (filled == buffer.size()) {
+                    filled = 0;
+                    skipping = true;
+                }
+            }
+            consume(fd, buffer.data(), filled, true);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            reply(fd, std::string("error: ") + e.what() + "\n");
         }
+        // Номер закрывается под замком вместе с удалением из clients: иначе accept может выдать его
+        // новому соединению раньше, и erase уберет из учета уже чужое соединение
+        std::lock_guard<std::mutex> guard(lock);
+        clients.erase(fd);
+        close(fd);
+        if (clients.empty()) idle.notify_all();
     }
 
-    void flush(size_t bucket_idx) {
-        if (buffers[bucket_idx].empty()) return;
-        streams[bucket_idx].write(reinterpret_cast<char*>(buffers[bucket_idx].data()), 
-                                  buffers[bucket_idx].size() * sizeof(uint128_t));
-        buffers[bucket_idx].clear();
+public:
+    explicit Server(LiveDistinctCounter& counter) : counter(counter) {}
+
+    // Прекратить прием соединений и дочитать уже открытые: их чтение получит конец потока
+    void stop() {
+        stopping = true;
+        std::lock_guard<std::mutex> guard(lock);
+        if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);
+        for (int fd : clients) shutdown(fd, SHUT_RD);
     }
 
-    void flushAllAndClose() {
-        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
-            flush(i);
-            streams[i].close();
+    void run(const std::string& socketPath) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long");
+        std::strcpy(addr.sun_path, socketPath.c_str());
+
+        // Удаляется только оставшийся от прошлого запуска сокет, а не файл, на который ошиблись путем
+        struct stat existing;
+        if (lstat(socketPath.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) throw std::runtime_error(socketPath + " exists and is not a socket");
+            unlink(socketPath.c_str());
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Could not create socket");
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not listen on " + socketPath + ": " + std::strerror(errno));
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            listenFd = fd;
+        }
+        std::cout << "Listening on " << socketPath << std::endl;
+
+        while (!stopping) {
+            int client = accept(fd, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (stopping) shutdown(client, SHUT_RD);
+            clients.insert(client);
+            std::thread(&Server::handleClient, this, client).detach();
         }
+
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [&]() { return clients.empty(); });
+        close(fd);
+        listenFd = -1;
+        unlink(socketPath.c_str());
     }
 };
 
-// --- ОБРАБОТКА БАКЕТОВ ---
-void processBucket(size_t bucket_idx) {
-    std::string fname = getBucketFileName(bucket_idx);
-    std::ifstream infile(fname, std::ios::binary | std::ios::ate);
-    
-    if (!infile.is_open()) return;
+// SIGINT и SIGTERM останавливают сервер так же, как команда !shutdown
+int serve(const std::string& socketPath, const DistinctCounterOptions& options) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    LiveDistinctCounter counter(options);
+    Server server(counter);
+    std::thread watcher([signals, &server]() {
+        int sig;
+        if (sigwait(&signals, &sig) == 0) server.stop();
+    });
+    try {
+        server.run(socketPath);
+    } catch (...) {
+        pthread_kill(watcher.native_handle(), SIGTERM);
+        watcher.join();
+        throw;
+    }
+    // Сигнал будит ожидающий поток: остановка уже идет, повторный stop безвреден
+    pthread_kill(watcher.native_handle(), SIGTERM);
+    watcher.join();
+
+    uint64_t unique = counter.count();
+    counter.print_stats(std::cout);
+    std::cout << "Done. Found " << unique << " unique IPv6 addresses." << std::endl;
+    return 0;
+}
+
+// --- СЛЕЖЕНИЕ ЗА РАСТУЩИМ ФАЙЛОМ ---
 
-    std::streamsize size = infile.tellg();
-    infile.seekg(0, std::ios::beg);
+const size_t FOLLOW_READ_BYTES = 1024 * 1024;
+const int FOLLOW_RECHECK_MS = 1000; // Проверка ротации на случай пропущенного события inotify
 
-    if (size == 0) {
-        std::remove(fname.c_str());
-        return;
+// Результат пишется во временный файл и переименовывается, чтобы читатель не увидел его недописанным
+bool publishResult(const std::string& outputPath, uint64_t count) {
+    std::string tmpPath = outputPath + ".tmp";
+    if (!writeResult(tmpPath, count)) return false;
+    if (std::rename(tmpPath.c_str(), outputPath.c_str()) != 0) {
+        std::cerr << "Error: Could not write output file." << std::endl;
+        return false;
     }
+    return true;
+}
 
-    size_t count = size / sizeof(uint128_t);
-    std::vector<uint128_t> ips(count);
+// Читает только новые байты файла: прочитанный сдвиг хранится между пробуждениями, незавершенная
+// последняя строка ждет продолжения. Ротация (файл переименован или удален и создан заново) видна
+// по смене inode за путем: старый файл дочитывается до конца, затем новый читается с начала.
+// Усечение на месте (copytruncate) видно по размеру меньше прочитанного - чтение начинается сначала.
+class FileFollower {
+    std::string path;
+    LiveDistinctCounter& counter;
+    int fd = -1;
+    dev_t device = 0;
+    ino_t inode = 0;
+    uint64_t offset = 0;
+    std::string carry;
+    std::vector<char> buffer;
 
-    infile.read(reinterpret_cast<char*>(ips.data()), size);
-    infile.close();
+    bool reopen() {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        fstat(fd, &st);
+        device = st.st_dev;
+        inode = st.st_ino;
+        offset = 0;
+        return true;
+    }
 
-    // Сортировка и подсчет уникальных значений
-    std::sort(ips.begin(), ips.end());
-    
-    // std::unique перемещает уникальные элементы в начало и возвращает итератор на новый конец
-    auto last = std::unique(ips.begin(), ips.end());
-    
-    // Количество уникальных элементов
-    size_t unique_in_bucket = std::distance(ips.begin(), last);
-    
-    total_unique_count += unique_in_bucket;
+    void consume(const char* data, size_t length) {
+        const char* end = data + length;
+        if (!carry.empty()) {
+            const char* eol = static_cast<const char*>(std::memchr(data, '\n', length));
+            if (!eol) {
+                carry.append(data, length);
+                return;
+            }
+            carry.append(data, eol - data);
+            counter.add_text_buffer(carry.data(), carry.size());
+            carry.clear();
+            data = eol + 1;
+        }
+        const char* last = end;
+        while (last > data && last[-1] != '\n') --last;
+        counter.add_text_buffer(data, last - data);
+        carry.assign(last, end);
+    }
+
+    void drain() {
+        while (true) {
+            ssize_t n = pread(fd, buffer.data(), buffer.size(), offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            offset += n;
+            bytesRead += n;
+            consume(buffer.data(), n);
+        }
+    }
+
+public:
+    uint64_t bytesRead = 0;
+    uint64_t rotations = 0;
+    uint64_t truncations = 0;
+
+    FileFollower(const std::string& path, LiveDistinctCounter& counter)
+        : path(path), counter(counter), buffer(FOLLOW_READ_BYTES) {
+        if (!reopen()) throw std::runtime_error("Could not open input file " + path);
+    }
 
-    // Удаляем временный файл
-    std::remove(fname.c_str());
+    ~FileFollower() {
+        if (fd >= 0) close(fd);
+    }
+
+    void readNew() {
+        if (fd < 0 && !reopen()) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && uint64_t(st.st_size) < offset) {
+            truncations++;
+            offset = 0;
+            carry.clear();
+        }
+        drain();
+        struct stat named;
+        if (stat(path.c_str(), &named) == 0 && (named.st_ino != inode || named.st_dev != device)) {
+            // Старый файл дочитан: все, что в него успели дописать до ротации, уже учтено
+            finish();
+            close(fd);
+            fd = -1;
+            rotations++;
+            if (reopen()) drain();
+        }
+    }
+
+    // Незавершенная строка в конце считается целой
+    void finish() {
+        if (carry.empty()) return;
+        counter.add_text_buffer(carry.data(), carry.size());
+        carry.clear();
+    }
+};
+
+// Файл отслеживается через inotify: события самого файла будят чтение новых байт, события каталога
+// замечают появление нового файла с тем же именем после ротации. SIGINT и SIGTERM завершают слежение.
+int follow(const Options& opts) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    LiveDistinctCounter counter(opts.counter);
+    FileFollower follower(opts.inputPath, counter);
+
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0 || signalFd < 0) throw std::runtime_error("Could not set up file watching");
+    size_t slash = opts.inputPath.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : opts.inputPath.substr(0, slash + 1);
+    inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+    const uint32_t FILE_EVENTS = IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB;
+    inotify_add_watch(inotifyFd, opts.inputPath.c_str(), FILE_EVENTS);
+    std::cout << "Following " << opts.inputPath << ", publishing every " << opts.followSeconds << " s to "
+              << opts.outputPath << std::endl;
+
+    const auto interval = std::chrono::seconds(opts.followSeconds);
+    auto nextPublish = std::chrono::steady_clock::now();
+    uint64_t published = UINT64_MAX;
+    uint64_t watchedRotations = 0;
+    std::vector<char> events(64 * 1024);
+    while (true) {
+        follower.readNew();
+        if (follower.rotations != watchedRotations) {
+            inotify_add_watch(inotifyFd, opts.inputPath.c_str(), FILE_EVENTS);
+            watchedRotations = follower.rotations;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextPublish) {
+            uint64_t unique = counter.count();
+            if (unique != published) {
+                if (!publishResult(opts.outputPath, unique)) return 1;
+                std::cout << "Follow: " << unique << " unique IPv6 addresses, "
+                          << follower.bytesRead / (1024 * 1024) << " MB read, " << follower.rotations
+                          << " rotation(s)" << std::endl;
+                published = unique;
+            }
+            while (nextPublish <= now) nextPublish += interval;
+        }
+
+        auto untilPublish = std::chrono::duration_cast<std::chrono::milliseconds>(nextPublish - now).count();
+        pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {signalFd, POLLIN, 0}};
+        if (poll(fds, 2, int(std::min<long long>(untilPublish + 1, FOLLOW_RECHECK_MS))) < 0 && errno != EINTR) {
+            throw std::runtime_error("Could not wait for file events");
+        }
+        if (fds[1].revents & POLLIN) break;
+        // Сами события не разбираются: после любого из них проверяется все сразу
+        while (read(inotifyFd, events.data(), events.size()) > 0) {
+        }
+    }
+    close(inotifyFd);
+    close(signalFd);
+
+    follower.readNew();
+    follower.finish();
+    uint64_t unique = counter.count();
+    counter.print_stats(std::cout);
+    std::cout << "Follow: " << follower.rotations << " rotation(s), " << follower.truncations
+              << " truncation(s), " << follower.bytesRead << " byte(s) read" << std::endl;
+    if (!publishResult(opts.outputPath, unique)) return 1;
+    std::cout << "Done. Found " << unique << " unique IPv6 addresses." << std::endl;
+    return 0;
 }
 
-// --- MAIN ---
-int main(int argc, char* argv[]) {
-    std::ios_base::sync_with_stdio(false);
-    std::cin.tie(NULL);
+// --- ПОДСЧЕТ ПО ОКНАМ ВРЕМЕНИ ---
+
+std::string formatUtc(int64_t seconds) {
+    time_t time = time_t(seconds);
+    struct tm parts;
+    char text[32];
+    if (!gmtime_r(&time, &parts) || !std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &parts)) {
+        return std::to_string(seconds);
+    }
+    return text;
+}
 
-    if (argc != 3) {
-        std::cerr << "Usage in format: " << argv[0] << " <input_file> <output_file>" << std::endl;
+// Выходной файл получает по строке "начало<TAB>конец<TAB>число различных" на окно, по порядку времени
+int windowed(const Options& opts) {
+    std::ofstream outFile(opts.outputPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Could not write output file." << std::endl;
+        return 1;
+    }
+    uint64_t windows = 0, peak = 0;
+    WindowedDistinctCounter counter(opts.counter, opts.windows, [&](const WindowCount& window) {
+        outFile << formatUtc(window.start) << '\t' << formatUtc(window.end) << '\t' << window.distinct << '\n';
+        windows++;
+        peak = std::max(peak, window.distinct);
+    });
+    counter.add_file(opts.inputPath);
+    counter.finish();
+    counter.print_stats(std::cout);
+    outFile.flush();
+    if (!outFile) {
+        std::cerr << "Error: Could not write output file." << std::endl;
         return 1;
     }
+    std::cout << "Done. Wrote " << windows << " window(s), at most " << peak << " unique IPv6 addresses per window."
+              << std::endl;
+    return 0;
+}
+
+// --- НЕСКОЛЬКО ПОДСЧЕТОВ ЗА ПРОХОД ---
 
-    std::string inputPath = argv[1];
-    std::string outputPath = argv[2];
+// Выходной файл получает по строке "имя<TAB>число" на подсчет, в порядке их задания
+int aggregate(const Options& opts) {
+    MultiDistinctCounter counter(opts.counter, opts.aggregations);
+    for (const std::string& path : opts.inputPaths) counter.add_file(path, path);
+    std::vector<uint64_t> counts = counter.finalize();
+    counter.print_stats(std::cout);
 
-    // Фаза 1: Чтение и разделение
-    std::cout << "Phase 1: Reading file and partitioning..." << std::endl;
-    
-    std::ifstream inFile(inputPath);
-    if (!inFile.is_open()) {
-        std::cerr << "Error: Could not open input file." << std::endl;
+    std::ofstream outFile(opts.outputPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Could not write output file." << std::endl;
         return 1;
     }
+    std::cout << "Done. Counted " << counts.size() << " aggregation(s):" << std::endl;
+    for (size_t a = 0; a < counts.size(); ++a) {
+        const Aggregation& agg = opts.aggregations[a];
+        outFile << agg.name << '\t' << counts[a] << '\n';
+        std::cout << "  " << agg.name << ": " << counts[a] << " unique IPv6 "
+                  << (agg.granularity < 128 ? "/" + std::to_string(agg.granularity) + " prefixes" : "addresses")
+                  << std::endl;
+    }
+    return 0;
+}
 
-    BucketWriter writer;
-    writer.openAll();
+// --- ПОИСК ПО ИНДЕКСУ ---
 
-    std::string line;
-    uint128_t ipVal;
-    uint64_t processedLines = 0;
+const size_t LOOKUP_READ_BYTES = 4 * 1024 * 1024;
 
-    while (std::getline(inFile, line)) {
-        if (line.empty()) continue;
-        
-        // Удаляем CR в конце, если они есть
-        if (line.back() == '\r') line.pop_back(); 
+// Выходной файл получает по строке "строка<TAB>1" или "строка<TAB>0" на строку запросов, по порядку;
+// строка, которая не адрес (в том числе длиннее блока чтения), получает "-". Запросы ищутся пачками по блоку чтения.
+int lookup(const Options& opts) {
+    DistinctIndex index(opts.lookupPath);
+    std::ifstream queries(opts.inputPath, std::ios::binary);
+    if (!queries.is_open()) throw std::runtime_error("Could not open input file " + opts.inputPath);
+    std::ofstream outFile(opts.outputPath, std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Could not write output file." << std::endl;
+        return 1;
+    }
 
-        if (parseIPv6(line, ipVal)) {
-            // Используем старший байт как индекс корзины (0-255)
-            uint8_t bucketIdx = (ipVal.hi >> 56) & 0xFF;
-            writer.add(bucketIdx, ipVal);
+    std::vector<char> buffer(LOOKUP_READ_BYTES);
+    size_t filled = 0;
+    std::vector<std::pair<size_t, size_t>> lines; // Начало и длина строки в буфере
+    std::vector<dc_key> keys;
+    std::vector<int64_t> keyOf;                   // Номер ключа строки, -1 - не адрес
+    std::vector<uint8_t> found;
+    std::string out;
+    uint64_t total = 0, addresses = 0, hits = 0;
+    double searchSeconds = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    bool eof = false;
+    bool overlong = false; // Строка длиннее буфера: ее текст переписывается кусками до перевода строки
+    while (!eof) {
+        queries.read(buffer.data() + filled, buffer.size() - filled);
+        filled += queries.gcount();
+        eof = queries.gcount() == 0;
+        size_t done = 0;
+        lines.clear();
+        keys.clear();
+        keyOf.clear();
+        // Строка длиннее буфера адресом быть не может: она получает один "-", а ее хвост не разбирается
+        if (!overlong && filled == buffer.size() && !std::memchr(buffer.data(), '\n', filled)) overlong = true;
+        if (overlong) {
+            const char* eol = static_cast<const char*>(std::memchr(buffer.data(), '\n', filled));
+            size_t end = eol ? eol - buffer.data() : filled;
+            size_t length = end;
+            if (length > 0 && buffer[length - 1] == '\r') {
+                length--;
+                // '\r' в конце куска может оказаться концом строки, поэтому ждет следующего чтения
+                if (!eol && !eof) end--;
+            }
+            outFile.write(buffer.data(), length);
+            if (eol || eof) {
+                outFile.write("\t-\n", 3);
+                overlong = false;
+                total++;
+            }
+            done = eol ? end + 1 : end;
         }
-        
-        processedLines++;
-        if (processedLines % 10000000 == 0) {
-            std::cout << "Processed over " << processedLines << " lines..." << std::endl;
+        // Незавершенная строка ждет следующего чтения, если это не конец файла
+        for (size_t p = done; p < filled;) {
+            const char* eol = static_cast<const char*>(std::memchr(buffer.data() + p, '\n', filled - p));
+            if (!eol && !eof) break;
+            size_t end = eol ? eol - buffer.data() : filled;
+            size_t length = end - p;
+            if (length > 0 && buffer[p + length - 1] == '\r') length--;
+            dc_key key;
+            bool valid = parse_ipv6(std::string_view(buffer.data() + p, length), key);
+            lines.emplace_back(p, length);
+            keyOf.push_back(valid ? int64_t(keys.size()) : -1);
+            if (valid) keys.push_back(key);
+            p = end + 1;
+            done = std::min(p, filled);
         }
+
+        auto searchStart = std::chrono::steady_clock::now();
+        found.resize(keys.size());
+        hits += index.contains_batch(keys.data(), keys.size(), found.data());
+        searchSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - searchStart).count();
+
+        out.clear();
+        for (size_t i = 0; i < lines.size(); ++i) {
+            out.append(buffer.data() + lines[i].first, lines[i].second);
+            out += '\t';
+            out += keyOf[i] < 0 ? '-' : found[keyOf[i]] ? '1' : '0';
+            out += '\n';
+        }
+        outFile.write(out.data(), out.size());
+        total += lines.size();
+        addresses += keys.size();
+        std::memmove(buffer.data(), buffer.data() + done, filled - done);
+        filled -= done;
+    }
+    outFile.flush();
+    if (!outFile) {
+        std::cerr << "Error: Could not write output file." << std::endl;
+        return 1;
     }
-    
-    writer.flushAllAndClose();
-    inFile.close();
 
-    // Фаза 2: Параллельная обработка бакетов
-    std::cout << "Phase 2: Counting uniques in buckets..." << std::endl;
+    index.print_stats(std::cout);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << std::fixed << std::setprecision(3) << "Lookup: " << addresses << " address(es) in " << seconds
+              << " s, index search " << searchSeconds << " s (" << std::setprecision(1)
+              << (searchSeconds > 0 ? addresses / searchSeconds / 1e6 : 0.0) << " M/s), "
+              << total - addresses << " line(s) not addresses" << std::endl;
+    std::cout << "Done. Found " << hits << " of " << addresses << " queried addresses in the index." << std::endl;
+    return 0;
+}
 
-    unsigned int nThreads = std::thread::hardware_concurrency();
-    if (nThreads == 0) nThreads = 4;
-    
-    std::vector<std::thread> threads;
-    std::atomic<size_t> currentBucket{0};
+}  // namespace
 
-    // Функция-воркер для потоков
-    auto worker = [&]() {
-        while (true) {
-            size_t b = currentBucket.fetch_add(1);
-            if (b >= NUM_BUCKETS) break;
-            processBucket(b);
-        }
-    };
+// --- MAIN ---
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+    std::cin.tie(NULL);
 
-    for (unsigned int i = 0; i < nThreads; ++i) {
-        threads.emplace_back(worker);
+    Options opts;
+    if (!parseOptions(argc, argv, opts)) {
+        printUsage(argv[0]);
+        return 1;
     }
+    opts.counter.log = &std::cout;
+
+    uint64_t unique = 0;
+    try {
+        if (!opts.lookupPath.empty()) return lookup(opts);
+        if (!opts.socketPath.empty()) return serve(opts.socketPath, opts.counter);
+        if (opts.followSeconds > 0) return follow(opts);
+        if (opts.windowed) return windowed(opts);
+        if (!opts.aggregations.empty()) return aggregate(opts);
 
-    for (auto& t : threads) {
-        t.join();
+        DistinctCounter counter(opts.counter);
+        counter.add_file(opts.inputPath);
+        unique = counter.finalize();
+        counter.print_stats(std::cout);
+    } catch (const std::invalid_argument& e) {
+        // Неверные настройки, которые проверяет библиотека: движок, fanout, --async-io без корутин
+        std::cerr << "Error: " << e.what() << std::endl;
+        printUsage(argv[0]);
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
 
     // Вывод результата
-    std::ofstream outFile(outputPath);
-    if (outFile.is_open()) {
-        outFile << total_unique_count.load() << std::endl;
-        outFile.close();
-    } else {
-        std::cerr << "Error: Could not write output file." << std::endl;
-    }
+    if (!writeResult(opts.outputPath, unique)) return 1;
 
-    std::cout << "Done. Found " << total_unique_count.load() << " unique IPv6 addresses." << std::endl;
+    std::cout << "Done. Found " << unique << " unique IPv6 addresses." << std::endl;
 
     return 0;
 }
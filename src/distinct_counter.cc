@@ -0,0 +1,6879 @@
+#include "distinct_counter.h"
+#include "distinct_counter_c.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <numeric>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <iomanip>
+#include <sstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <new>
+#include <type_traits>
+#include <sys/resource.h>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <stdexcept>
+#include <exception>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Векторная сортировка ключей: ядра AVX2/AVX-512 собираются с атрибутом target и выбираются по CPUID
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_VECTOR_SORT 1
+#else
+#define HAVE_VECTOR_SORT 0
+#endif
+
+// Корутины доступны при сборке в режиме C++20; сборка C++17 обходится без них
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define HAVE_COROUTINES 1
+#else
+#define HAVE_COROUTINES 0
+#endif
+
+// Внутри библиотеки ключ по-прежнему называется uint128_t; псевдоним не выходит за эту единицу трансляции
+using uint128_t = dc_key;
+
+// Внутренности библиотеки не видны снаружи: наружу смотрят только DistinctCounter и функции dc_*
+namespace {
+
+// Константы
+const unsigned MIN_BUCKET_BITS = 4;      // 16 бакетов
+const unsigned MAX_BUCKET_BITS = 16;     // 65536 бакетов
+const size_t WRITE_BUFFER_SIZE = 1024 * 64; // Наибольший буфер записи для каждого бакета (в элементах, кратно 4)
+const size_t MIN_WRITE_BUFFER_SIZE = 256;
+const size_t WRITE_BUFFERS_BYTES = 256 * 1024 * 1024; // Буферы всех писателей счетчика вместе
+const size_t SECOND_LEVEL_MIN_KEYS = 4 * 1024 * 1024; // Бакеты меньше (64 МБ) второй уровень не делит
+const size_t SPARE_OPEN_FILES = 64;      // Дескрипторы сверх файлов бакетов: вход, манифест, индекс
+
+// Разбиение на бакеты, задается опцией --fanout. Первый уровень - старшие bits бит ключа;
+// если subBits > 0, крупные бакеты в фазе 2 еще раз делятся по следующим subBits битам.
+struct PartitionPlan {
+    unsigned bits = 8;
+    unsigned subBits = 0;
+
+    size_t buckets() const { return size_t(1) << bits; }
+    size_t subBuckets() const { return subBits ? size_t(1) << subBits : 0; }
+    // Файлы первого уровня плюс подбакеты, которые одновременно делят потоки пула
+    size_t openFiles(size_t threads) const { return buckets() + threads * subBuckets() + SPARE_OPEN_FILES; }
+};
+
+// Сортировка бакетов, задается опцией --sort
+enum SortKernel {
+    SORT_KERNEL_STD,
+    SORT_KERNEL_VECTOR
+};
+
+// Движки подсчета уникальных в бакете; ENGINE_AUTO - выбор по профилю бакета
+enum EngineKind {
+    ENGINE_NETWORK,
+    ENGINE_SORT,
+    ENGINE_RADIX,
+    ENGINE_HASH,
+    ENGINE_PARTITIONED_HASH,
+    ENGINE_ROARING,
+    ENGINE_COLUMNAR,
+    ENGINE_COUNT,
+    ENGINE_AUTO = ENGINE_COUNT
+};
+
+// Сколько бакетов и ключей досталось каждому движку и сколько времени он на них потратил
+struct EngineStats {
+    std::atomic<uint64_t> buckets{0};
+    std::atomic<uint64_t> keys{0};
+    std::atomic<uint64_t> nanoseconds{0};
+};
+
+// --- ВЫДЕЛЕНИЕ БОЛЬШИХ БЛОКОВ ПАМЯТИ ---
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+const size_t CACHE_LINE_SIZE = 64;
+
+// Выделение больших блоков одного счетчика: режим страниц задается до первого выделения
+// и дальше не меняется, статистика показывает, сколько байт удалось разместить на каждом виде страниц.
+class LargeAllocator {
+    bool hugePages = false;
+    std::atomic<uint64_t> explicitHugeBytes{0};
+    std::atomic<uint64_t> transparentHugeBytes{0};
+    std::atomic<uint64_t> normalPageBytes{0};
+
+    // Блоки меньше половины большой страницы выгоднее брать у malloc
+    bool wantsHugePages(size_t bytes) const {
+        return hugePages && bytes >= HUGE_PAGE_SIZE / 2;
+    }
+
+public:
+    explicit LargeAllocator(bool hugePages) : hugePages(hugePages) {}
+
+    // Выделение блока на страницах по 2 МБ: сначала из зарезервированного пула (MAP_HUGETLB),
+    // если он пуст - обычный mmap, выровненный по 2 МБ, с подсказкой MADV_HUGEPAGE для THP.
+    // Без больших страниц блок выравнивается по кэш-линии.
+    void* allocate(size_t bytes) {
+        if (!wantsHugePages(bytes)) {
+            void* p = nullptr;
+            if (posix_memalign(&p, CACHE_LINE_SIZE, bytes) != 0) throw std::bad_alloc();
+            normalPageBytes += bytes;
+            return p;
+        }
+
+        size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void* p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            explicitHugeBytes += rounded;
+            return p;
+        }
+
+        // Берем с запасом и обрезаем края, чтобы начало блока совпало с границей большой страницы
+        size_t padded = rounded + HUGE_PAGE_SIZE;
+        char* raw = static_cast<char*>(mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) throw std::bad_alloc();
+        uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+        char* aligned = reinterpret_cast<char*>((addr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        size_t head = aligned - raw;
+        if (head > 0) munmap(raw, head);
+        if (padded - head > rounded) munmap(aligned + rounded, padded - head - rounded);
+
+        if (madvise(aligned, rounded, MADV_HUGEPAGE) == 0) {
+            transparentHugeBytes += rounded;
+        } else {
+            normalPageBytes += rounded;
+        }
+        return aligned;
+    }
+
+    void release(void* p, size_t bytes) {
+        if (!p) return;
+        if (!wantsHugePages(bytes)) {
+            std::free(p);
+            return;
+        }
+        size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        munmap(p, rounded);
+    }
+
+    void printStats(std::ostream& out) const {
+        const double MB = 1024.0 * 1024.0;
+        out << "Memory: huge pages " << (hugePages ? "on" : "off")
+            << std::fixed << std::setprecision(1)
+            << ", explicit 2MB " << explicitHugeBytes.load() / MB << " MB"
+            << ", THP-advised " << transparentHugeBytes.load() / MB << " MB"
+            << ", regular " << normalPageBytes.load() / MB << " MB" << std::endl;
+    }
+};
+
+// Счет прочитанных строк с сообщениями о ходе работы в log (если он задан)
+struct LineProgress {
+    std::atomic<uint64_t> lines{0};
+    std::ostream* log = nullptr;
+
+    void add(uint64_t count) {
+        uint64_t before = lines.fetch_add(count);
+        if (log && (before + count) / 10000000 != before / 10000000) {
+            *log << "Processed over " << (before + count) / 10000000 * 10000000 << " lines..." << std::endl;
+        }
+    }
+};
+
+class IndexBuilder;
+
+// Настройки и счетчики одного подсчета. У каждого DistinctCounter свой контекст,
+// поэтому независимые счетчики в одном процессе не делят ни настроек, ни статистики.
+struct CounterContext {
+    PartitionPlan partition;
+    EngineKind engine = ENGINE_AUTO;
+    SortKernel sortKernel = SORT_KERNEL_STD;
+    size_t prefilterBytes = 0; // Фильтр недавних ключей на писателя, 0 - выключен
+    size_t writeBudgetBytes = WRITE_BUFFERS_BYTES; // Буферы всех писателей, включая писателей второго уровня
+    size_t writerSlots = 1;                        // Сколько писателей может жить одновременно
+    std::string tempPrefix;    // Начало имен временных файлов бакетов
+    IndexBuilder* index = nullptr; // Различные ключи бакетов собираются в индекс; nullptr - индекс не пишется
+    LargeAllocator memory;
+    LineProgress progress;
+
+    std::atomic<uint64_t> uniqueCount{0};
+    std::atomic<uint64_t> prefilterChecked{0};
+    std::atomic<uint64_t> prefilterDropped{0};
+    std::atomic<uint64_t> arenaBytes{0};    // Рабочие области фазы 2 (при освобождении не уменьшается)
+    std::atomic<uint64_t> hashFallbacks{0}; // Хэш-таблицы, переполненные из-за заниженной оценки
+    std::atomic<uint64_t> splitBuckets{0};  // Бакеты, поделенные вторым уровнем
+    std::atomic<uint64_t> roaringContainers{0}; // Контейнеры префиксов /112 движка roaring
+    std::atomic<uint64_t> roaringBitmaps{0};
+    std::atomic<uint64_t> columnarGroups{0};    // Группы старших половин движка columnar
+    EngineStats engineStats[ENGINE_COUNT];
+
+    explicit CounterContext(bool hugePages) : memory(hugePages) {}
+};
+
+// --- NUMA ТОПОЛОГИЯ ---
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus; // Только процессоры, доступные процессу
+};
+
+struct NumaTopology {
+    std::vector<NumaNode> nodes;
+
+    size_t cpuCount() const {
+        size_t n = 0;
+        for (const auto& node : nodes) n += node.cpus.size();
+        return n;
+    }
+
+    // Потоки раскладываются по узлам по кругу, чтобы нагрузка на узлы была равномерной
+    size_t nodeForThread(size_t thread_idx) const {
+        return thread_idx % nodes.size();
+    }
+};
+
+// Разбор списка вида "0-3,8,10-11" (формат sysfs)
+std::vector<int> parseCpuList(const std::string& text) {
+    std::vector<int> result;
+    std::stringstream ss(text);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int from = std::atoi(range.c_str());
+        int to = (dash == std::string::npos) ? from : std::atoi(range.c_str() + dash + 1);
+        for (int c = from; c <= to; ++c) result.push_back(c);
+    }
+    return result;
+}
+
+std::string formatCpuList(const std::vector<int>& cpus) {
+    std::string out;
+    for (size_t i = 0; i < cpus.size(); ) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+std::string readSysfsLine(const std::string& path) {
+    std::ifstream f(path);
+    std::string line;
+    std::getline(f, line);
+    return line;
+}
+
+// Размер L2 первого процессора из sysfs; 1 МБ, если сведений нет
+size_t detectL2CacheBytes() {
+    for (int index = 0; index < 8; ++index) {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::string level = readSysfsLine(dir + "level");
+        if (level.empty()) break;
+        if (level != "2" || readSysfsLine(dir + "type") == "Instruction") continue;
+        std::string size = readSysfsLine(dir + "size");
+        char* endp;
+        size_t value = std::strtoul(size.c_str(), &endp, 10);
+        if (*endp == 'K') value *= 1024;
+        if (*endp == 'M') value *= 1024 * 1024;
+        if (value > 0) return value;
+    }
+    return 1024 * 1024;
+}
+
+size_t l2CacheBytes() {
+    static const size_t bytes = detectL2CacheBytes();
+    return bytes;
+}
+
+// Определение топологии через sysfs. Если информации нет, считаем машину одним узлом.
+NumaTopology detectNumaTopology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool has_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    NumaTopology topo;
+    for (int node_id : parseCpuList(readSysfsLine("/sys/devices/system/node/online"))) {
+        NumaNode node{node_id, {}};
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node_id) + "/cpulist";
+        for (int cpu : parseCpuList(readSysfsLine(path))) {
+            if (!has_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) node.cpus.push_back(cpu);
+        }
+        // Узлы без доступных процессоров (например, только память) не используем
+        if (!node.cpus.empty()) topo.nodes.push_back(node);
+    }
+
+    if (topo.nodes.empty()) {
+        NumaNode node{0, {}};
+        unsigned int n = std::thread::hardware_concurrency();
+        if (n == 0) n = 4;
+        for (unsigned int c = 0; c < n; ++c) {
+            if (!has_mask || CPU_ISSET(c, &allowed)) node.cpus.push_back(c);
+        }
+        topo.nodes.push_back(node);
+    }
+    return topo;
+}
+
+// Привязка текущего потока к процессорам узла. Память, к которой поток
+// обратится первым (first-touch), ядро выделит на этом же узле.
+void pinCurrentThreadToNode(const NumaNode& node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : node.cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void printTopology(std::ostream& out, const NumaTopology& topo, size_t nThreads) {
+    out << "NUMA topology: " << topo.nodes.size() << " node(s), "
+        << nThreads << " worker thread(s)" << std::endl;
+    for (size_t n = 0; n < topo.nodes.size(); ++n) {
+        size_t threads_on_node = 0;
+        for (size_t t = 0; t < nThreads; ++t) {
+            if (topo.nodeForThread(t) == n) threads_on_node++;
+        }
+        out << "  node " << topo.nodes[n].id << ": cpus " << formatCpuList(topo.nodes[n].cpus)
+            << ", threads " << threads_on_node << std::endl;
+    }
+    out << "  L2 cache: " << l2CacheBytes() / 1024 << " KB" << std::endl;
+}
+
+// --- ПУЛ ПОТОКОВ С КРАЖЕЙ ЗАДАЧ ---
+
+class ThreadPool;
+
+// Группа задач, завершения которых можно дождаться. Задачи группы могут порождать новые задачи в ней же.
+// Первое исключение из задач группы запоминается и выбрасывается из ThreadPool::wait.
+class TaskGroup {
+    friend class ThreadPool;
+    std::atomic<size_t> pending{0};
+    size_t outerQueued = 0; // Внешние задачи группы в очереди пула (под замком пула outerLock)
+    std::mutex lock;
+    std::condition_variable done;
+    std::exception_ptr error;
+};
+
+struct Task {
+    std::function<void()> fn;
+    TaskGroup* group;
+    bool outer; // Начинает целый бакет: внутри ожидания чужой группы не выполняется
+};
+
+// Дек Чейза-Леви: владелец кладет и забирает задачи с нижнего конца без блокировок,
+// остальные потоки крадут с верхнего конца через CAS.
+class WorkStealingDeque {
+    struct Buffer {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<Task*>[]> slots;
+
+        explicit Buffer(int64_t capacity) : capacity(capacity), slots(new std::atomic<Task*>[capacity]) {}
+        Task* get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, Task* t) { slots[i & (capacity - 1)].store(t, std::memory_order_relaxed); }
+    };
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Buffer*> buffer;
+    // Старые буферы живут до конца: вор мог успеть прочитать указатель на них
+    std::vector<std::unique_ptr<Buffer>> retired;
+
+public:
+    WorkStealingDeque() {
+        retired.emplace_back(new Buffer(256));
+        buffer.store(retired.back().get(), std::memory_order_relaxed);
+    }
+
+    // Только поток-владелец
+    void push(Task* task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer* buf = buffer.load(std::memory_order_relaxed);
+        if (b - t >= buf->capacity) {
+            Buffer* bigger = new Buffer(buf->capacity * 2);
+            for (int64_t i = t; i < b; ++i) bigger->put(i, buf->get(i));
+            retired.emplace_back(bigger);
+            buffer.store(bigger, std::memory_order_release);
+            buf = bigger;
+        }
+        buf->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Только поток-владелец
+    Task* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buf = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task* task = buf->get(b);
+        if (t == b) {
+            // Последний элемент: соревнуемся с ворами
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Любой поток
+    Task* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        Buffer* buf = buffer.load(std::memory_order_acquire);
+        Task* task = buf->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+};
+
+// Пул с фиксированным числом потоков, привязанных к NUMA-узлам. Задачи, поставленные из потока пула,
+// попадают в его дек; задачи извне - в общую очередь. Свободные потоки крадут задачи сначала
+// у соседей по узлу, затем у остальных. Ожидание группы внутри задачи выполняет другие задачи,
+// поэтому вложенный параллелизм не создает лишних потоков. Внешние задачи (submitOuter) берут целый
+// бакет со своей рабочей областью и лежат в отдельной очереди: свободные потоки берут их с начала,
+// а ожидающий поток - только задачи своей группы, которые поставлены изнутри пула и потому стоят
+// в начале очереди. Так на поток приходится не больше двух рабочих областей. Ожидающий поток,
+// которому нечем помочь, спит на своей группе и лишь изредка заглядывает в очереди.
+class ThreadPool {
+    const NumaTopology& topo;
+    std::vector<std::unique_ptr<WorkStealingDeque>> deques;
+    std::vector<std::thread> workers;
+
+    std::mutex injectLock;
+    std::deque<Task*> injected;
+
+    std::mutex outerLock;
+    std::deque<Task*> outerTasks;
+
+    static constexpr std::chrono::microseconds HELP_RECHECK{200};
+
+    std::atomic<int64_t> queued{0}; // Поставленные, но еще не взятые задачи
+    std::atomic<int> sleepers{0};
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> stolen{0};
+
+    static inline thread_local ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+public:
+    ThreadPool(const NumaTopology& topo, size_t nThreads) : topo(topo) {
+        for (size_t i = 0; i < nThreads; ++i) deques.emplace_back(new WorkStealingDeque());
+        for (size_t i = 0; i < nThreads; ++i) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Номер потока пула, выполняющего текущую задачу (вне пула не вызывать)
+    static size_t currentWorker() { return current_index; }
+
+    void submit(TaskGroup& group, std::function<void()> fn) {
+        enqueue(new Task{std::move(fn), &group, false});
+    }
+
+    // Задача верхнего уровня, например целый бакет фазы 2
+    void submitOuter(TaskGroup& group, std::function<void()> fn) {
+        enqueue(new Task{std::move(fn), &group, true});
+    }
+
+    // Дождаться всех задач группы. Поток пула при этом выполняет другие задачи, внешний поток спит.
+    void wait(TaskGroup& group) {
+        if (current_pool == this) {
+            uint64_t rng = current_index * 0x9E3779B97F4A7C15ULL + 1;
+            while (group.pending.load(std::memory_order_acquire) != 0) {
+                Task* task = findTask(current_index, rng, &group);
+                if (task) {
+                    run(task);
+                    continue;
+                }
+                // Задачи группы выполняют другие потоки: ждем их, не перебирая очереди по кругу
+                std::unique_lock<std::mutex> guard(group.lock);
+                group.done.wait_for(guard, HELP_RECHECK, [&]() { return group.pending.load() == 0; });
+            }
+        }
+        // Захват мьютекса гарантирует, что завершивший группу поток уже отпустил ее
+        std::unique_lock<std::mutex> guard(group.lock);
+        group.done.wait(guard, [&]() { return group.pending.load() == 0; });
+        if (group.error) {
+            std::exception_ptr error = group.error;
+            group.error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    void printStats(std::ostream& out) const {
+        out << "Thread pool: " << workers.size() << " worker(s), " << executed.load()
+            << " task(s), " << stolen.load() << " stolen" << std::endl;
+    }
+
+private:
+    void enqueue(Task* task) {
+        task->group->pending.fetch_add(1);
+        if (task->outer) {
+            // Поставленные изнутри пула (подбакеты) ждет поток пула - они идут раньше бакетов фазы 2
+            std::lock_guard<std::mutex> guard(outerLock);
+            task->group->outerQueued++;
+            if (current_pool == this) outerTasks.push_front(task);
+            else outerTasks.push_back(task);
+        } else if (current_pool == this) {
+            deques[current_index]->push(task);
+        } else {
+            std::lock_guard<std::mutex> guard(injectLock);
+            injected.push_back(task);
+        }
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            wake.notify_one();
+        }
+    }
+
+    void run(Task* task) {
+        std::exception_ptr error;
+        try {
+            task->fn();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        TaskGroup* group = task->group;
+        delete task;
+        executed.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(group->lock);
+        if (error && !group->error) group->error = error;
+        if (group->pending.fetch_sub(1) == 1) group->done.notify_all();
+    }
+
+    // Внешняя задача: свободному потоку - первая в очереди, ожидающему - первая из его группы.
+    // Задачи группы, поставленные изнутри пула, стоят в начале, поэтому поиск короткий.
+    Task* takeOuter(TaskGroup* waiting) {
+        std::lock_guard<std::mutex> guard(outerLock);
+        if (waiting && waiting->outerQueued == 0) return nullptr;
+        auto it = outerTasks.begin();
+        while (it != outerTasks.end() && waiting && (*it)->group != waiting) ++it;
+        if (it == outerTasks.end()) return nullptr;
+        Task* task = *it;
+        outerTasks.erase(it);
+        task->group->outerQueued--;
+        return task;
+    }
+
+    // waiting - группа, которую ждет поток (nullptr - поток свободен)
+    Task* findTask(size_t self, uint64_t& rng, TaskGroup* waiting = nullptr) {
+        Task* task = deques[self]->pop();
+
+        if (!task) {
+            std::lock_guard<std::mutex> guard(injectLock);
+            if (!injected.empty()) {
+                task = injected.front();
+                injected.pop_front();
+            }
+        }
+
+        if (!task && deques.size() > 1) {
+            // Сначала жертвы с того же NUMA-узла, потом все остальные
+            size_t node = topo.nodeForThread(self);
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            size_t start = rng % deques.size();
+            for (int pass = 0; pass < 2 && !task; ++pass) {
+                for (size_t k = 0; k < deques.size() && !task; ++k) {
+                    size_t victim = (start + k) % deques.size();
+                    if (victim == self) continue;
+                    if ((topo.nodeForThread(victim) == node) != (pass == 0)) continue;
+                    task = deques[victim]->steal();
+                }
+            }
+            if (task) stolen.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Новый бакет берется, только когда доделывать уже начатые нечего
+        if (!task) task = takeOuter(waiting);
+
+        if (task) queued.fetch_sub(1);
+        return task;
+    }
+
+    void workerLoop(size_t idx) {
+        current_pool = this;
+        current_index = idx;
+        pinCurrentThreadToNode(topo.nodes[topo.nodeForThread(idx)]);
+
+        uint64_t rng = idx * 0x9E3779B97F4A7C15ULL + 1;
+        while (true) {
+            Task* task = findTask(idx, rng);
+            if (task) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            sleepers.fetch_add(1);
+            wake.wait(guard, [&]() { return stopping || queued.load() > 0; });
+            sleepers.fetch_sub(1);
+            if (stopping && queued.load() == 0) return;
+        }
+    }
+};
+
+#if HAVE_COROUTINES
+// --- АСИНХРОННЫЙ ВВОД-ВЫВОД НА КОРУТИНАХ ---
+
+// Ленивая корутина без результата. Запускается при co_await, по завершении
+// передает управление ожидающей корутине (symmetric transfer).
+class AsyncTask {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        AsyncTask get_return_object() {
+            return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                std::coroutine_handle<> next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    explicit AsyncTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+    AsyncTask(AsyncTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    AsyncTask(const AsyncTask&) = delete;
+    AsyncTask& operator=(const AsyncTask&) = delete;
+    ~AsyncTask() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    // Исключение корутины выбрасывается в ожидающей
+    void await_resume() {
+        if (handle.promise().error) std::rethrow_exception(handle.promise().error);
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Учет запущенных в фоне корутин: можно дождаться, пока все они завершатся.
+// Первое исключение из них выбрасывается из wait.
+class AsyncScope {
+    std::atomic<size_t> running{0};
+    std::mutex lock;
+    std::condition_variable done;
+    std::exception_ptr error;
+
+    // Корутина-обертка: стартует сразу, сама уничтожает себя по завершении
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    static Detached runDetached(AsyncScope& scope, AsyncTask task) {
+        std::exception_ptr failure;
+        try {
+            co_await task;
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(scope.lock);
+        if (failure && !scope.error) scope.error = failure;
+        if (scope.running.fetch_sub(1) == 1) scope.done.notify_all();
+    }
+
+public:
+    // Корутина начинает выполняться в вызывающем потоке до первой приостановки
+    void spawn(AsyncTask task) {
+        running.fetch_add(1);
+        runDetached(*this, std::move(task));
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]() { return running.load() == 0; });
+        if (error) {
+            std::exception_ptr failure = error;
+            error = nullptr;
+            std::rethrow_exception(failure);
+        }
+    }
+};
+
+// Чтение и запись файлов для корутин. Блокирующие pread/pwrite выполняет небольшой набор
+// потоков ввода-вывода, а корутина продолжает работу уже в пуле вычислений.
+// Так немногие потоки держат в полете много операций с разными бакетами.
+class IoService {
+    struct Request {
+        int fd;
+        char* data;
+        size_t length;
+        uint64_t offset;
+        bool isWrite;
+        ssize_t result;
+        std::coroutine_handle<> handle;
+    };
+
+    ThreadPool& pool;
+    TaskGroup resumptions;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Request*> queue;
+    bool stopping = false;
+
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> bytes{0};
+
+public:
+    class Awaiter {
+        IoService& io;
+        Request request;
+
+    public:
+        Awaiter(IoService& io, int fd, char* data, size_t length, uint64_t offset, bool isWrite)
+            : io(io), request{fd, data, length, offset, isWrite, 0, nullptr} {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            request.handle = h;
+            io.enqueue(&request);
+        }
+        // Число переданных байт или -1 при ошибке
+        ssize_t await_resume() const noexcept { return request.result; }
+    };
+
+    IoService(ThreadPool& pool, size_t nThreads) : pool(pool) {
+        for (size_t i = 0; i < nThreads; ++i) threads.emplace_back(&IoService::ioLoop, this);
+    }
+
+    ~IoService() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& t : threads) t.join();
+        pool.wait(resumptions);
+    }
+
+    IoService(const IoService&) = delete;
+    IoService& operator=(const IoService&) = delete;
+
+    Awaiter read(int fd, void* data, size_t length, uint64_t offset) {
+        return Awaiter(*this, fd, static_cast<char*>(data), length, offset, false);
+    }
+
+    Awaiter write(int fd, const void* data, size_t length, uint64_t offset) {
+        return Awaiter(*this, fd, static_cast<char*>(const_cast<void*>(data)), length, offset, true);
+    }
+
+    void printStats(std::ostream& out) const {
+        out << "Async I/O: " << threads.size() << " I/O thread(s), " << reads.load() << " read(s), "
+            << writes.load() << " write(s), " << std::fixed << std::setprecision(1)
+            << bytes.load() / (1024.0 * 1024.0) << " MB" << std::endl;
+    }
+
+private:
+    void enqueue(Request* request) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(request);
+        }
+        ready.notify_one();
+    }
+
+    void ioLoop() {
+        while (true) {
+            Request* request;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [&]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                request = queue.front();
+                queue.pop_front();
+            }
+
+            size_t done = 0;
+            while (done < request->length) {
+                ssize_t n = request->isWrite
+                    ? pwrite(request->fd, request->data + done, request->length - done, request->offset + done)
+                    : pread(request->fd, request->data + done, request->length - done, request->offset + done);
+                if (n <= 0) break;
+                done += n;
+            }
+            request->result = (done == request->length) ? (ssize_t)done : -1;
+            (request->isWrite ? writes : reads).fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(done, std::memory_order_relaxed);
+
+            std::coroutine_handle<> h = request->handle;
+            pool.submit(resumptions, [h]() { h.resume(); });
+        }
+    }
+};
+
+// Семафор для корутин: ограничивает число одновременно загруженных бакетов.
+// Ожидающая корутина продолжается в пуле, когда место освобождается.
+class AsyncSemaphore {
+    ThreadPool& pool;
+    TaskGroup& resumptions;
+    std::mutex lock;
+    size_t available;
+    std::deque<std::coroutine_handle<>> waiters;
+
+public:
+    AsyncSemaphore(ThreadPool& pool, TaskGroup& resumptions, size_t count)
+        : pool(pool), resumptions(resumptions), available(count) {}
+
+    struct Awaiter {
+        AsyncSemaphore& sem;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> guard(sem.lock);
+            if (sem.available > 0) {
+                sem.available--;
+                return false;
+            }
+            sem.waiters.push_back(h);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    Awaiter acquire() { return Awaiter{*this}; }
+
+    void release() {
+        std::coroutine_handle<> next;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (waiters.empty()) {
+                available++;
+                return;
+            }
+            next = waiters.front();
+            waiters.pop_front();
+        }
+        // Продолжение берет рабочую область под новый бакет, поэтому внутри ожидания его не выполняют
+        pool.submitOuter(resumptions, [next]() { next.resume(); });
+    }
+};
+
+#endif // HAVE_COROUTINES
+
+// --- ПАРСЕР IP АДРЕСОВ ---
+
+// Вспомогательная функция для конвертации hex-символа в число
+inline int hexDigitToInt(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Ручной парсер IPv6.
+// Преобразует строку в uint128_t. Автоматически приводит к каноническому бинарному виду.
+bool parseIPv6(const char* line, size_t len, uint128_t& result) {
+    uint16_t parts[8] = {0};
+    int current_part = 0;
+    int double_colon_index = -1; // Индекс, где встретилось ::
+    
+    size_t i = 0;
+    
+    // Пропускаем возможные пробелы в начале
+    while (i < len && isspace(line[i])) i++;
+
+    if (i == len) return false;
+
+    // Особая обработка, если адрес начинается с ::
+    if (line[i] == ':') {
+        if (i + 1 < len && line[i+1] == ':') {
+            double_colon_index = 0;
+            i += 2;
+            // Если строка просто "::", то это 0
+            if (i >= len || isspace(line[i])) {
+                 result.hi = 0; result.lo = 0;
+                 return true;
+            }
+        } else {
+            // Невалидный адрес (начался с одиночного :)
+            return false;
+        }
+    }
+
+    while (i < len && current_part < 8) {
+        // Читаем hex число
+        uint32_t val = 0;
+        bool has_digits = false;
+        
+        while (i < len) {
+            int digit = hexDigitToInt(line[i]);
+            if (digit == -1) break;
+            val = (val << 4) | digit;
+            has_digits = true;
+            i++;
+        }
+
+        if (has_digits) {
+            parts[current_part++] = static_cast<uint16_t>(val);
+        }
+
+        if (i >= len || isspace(line[i])) break;
+
+        if (line[i] == ':') {
+            i++;
+            if (i < len && line[i] == ':') {
+                if (double_colon_index != -1) return false; // Второе :: запрещено
+                double_colon_index = current_part;
+                i++;
+            }
+        } else {
+            return false; // Некорректный символ
+        }
+    }
+
+    // Раскрытие :: (double colon)
+    if (double_colon_index != -1) {
+        int parts_parsed = current_part;
+        int parts_to_shift = parts_parsed - double_colon_index;
+        int shift_amount = 8 - parts_parsed;
+        
+        for (int k = 0; k < parts_to_shift; ++k) {
+            parts[7 - k] = parts[parts_parsed - 1 - k];
+            parts[parts_parsed - 1 - k] = 0;
+        }
+    } else if (current_part != 8) {
+        return false; // Не полный адрес и нет ::
+    }
+
+    // Упаковка в 2 uint64
+    result.hi = ((uint64_t)parts[0] << 48) | ((uint64_t)parts[1] << 32) | 
+                ((uint64_t)parts[2] << 16) | ((uint64_t)parts[3]);
+    result.lo = ((uint64_t)parts[4] << 48) | ((uint64_t)parts[5] << 32) | 
+                ((uint64_t)parts[6] << 16) | ((uint64_t)parts[7]);
+
+    return true;
+}
+
+inline bool parseIPv6(const std::string& line, uint128_t& result) {
+    return parseIPv6(line.data(), line.length(), result);
+}
+
+// --- ИНДЕКС БАКЕТА ---
+
+// Номер бакета по BITS старшим битам ключа (после пропуска skip бит, уже использованных
+// первым уровнем). BITS известен при компиляции, поэтому сдвиги в горячих циклах - константы.
+template <unsigned BITS>
+struct BucketIndex {
+    static_assert(BITS >= MIN_BUCKET_BITS && BITS <= MAX_BUCKET_BITS, "unsupported fan-out");
+
+    static size_t top(const uint128_t& key) { return key.hi >> (64 - BITS); }
+    static size_t after(const uint128_t& key, unsigned skip) { return (key.hi << skip) >> (64 - BITS); }
+};
+
+// Вызывает f(std::integral_constant<unsigned, BITS>()) для bits, известного только во время работы
+template <typename F>
+void dispatchBucketBits(unsigned bits, F&& f) {
+    switch (bits) {
+        case 4: f(std::integral_constant<unsigned, 4>()); break;
+        case 5: f(std::integral_constant<unsigned, 5>()); break;
+        case 6: f(std::integral_constant<unsigned, 6>()); break;
+        case 7: f(std::integral_constant<unsigned, 7>()); break;
+        case 8: f(std::integral_constant<unsigned, 8>()); break;
+        case 9: f(std::integral_constant<unsigned, 9>()); break;
+        case 10: f(std::integral_constant<unsigned, 10>()); break;
+        case 11: f(std::integral_constant<unsigned, 11>()); break;
+        case 12: f(std::integral_constant<unsigned, 12>()); break;
+        case 13: f(std::integral_constant<unsigned, 13>()); break;
+        case 14: f(std::integral_constant<unsigned, 14>()); break;
+        case 15: f(std::integral_constant<unsigned, 15>()); break;
+        case 16: f(std::integral_constant<unsigned, 16>()); break;
+        default:
+            throw std::invalid_argument("Unsupported fan-out 2^" + std::to_string(bits));
+    }
+}
+
+// --- ОЦЕНКА ДОЛИ РАЗЛИЧНЫХ КЛЮЧЕЙ ---
+
+// 64-битный хэш ключа (финализатор MurmurHash3). У ключей одного бакета общие старшие биты,
+// поэтому перемешиваются обе половины.
+inline uint64_t hashKey(const uint128_t& key) {
+    uint64_t h = key.hi * 0x9E3779B97F4A7C15ULL ^ key.lo;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Что известно о бакете до его загрузки
+struct BucketProfile {
+    uint64_t keys = 0;
+    unsigned fixedBits = 0;     // Старшие биты, общие для всех ключей бакета
+    double distinctRatio = 1.0; // Оценка доли различных ключей по выборке фазы 1
+    // Оценки числа различных префиксов /112 и /64 (старших половин ключей) по выборке загруженных
+    // ключей, если движок выбирается автоматически
+    double prefixes112 = HUGE_VAL;
+    double prefixes64 = HUGE_VAL;
+};
+
+// Выборочные HyperLogLog-скетчи бакетов. В выборку попадают ключи с нулевыми младшими SAMPLE_BITS битами хэша:
+// все повторы ключа либо в выборке, либо вне ее, поэтому доля различных ключей в выборке
+// оценивает долю различных во всем бакете. Остальные ключи стоят только вычисления хэша.
+class DistinctSketches {
+public:
+    static const unsigned SAMPLE_BITS = 3;   // В выборку идет 1/8 ключей
+    static const unsigned REGISTER_BITS = 6; // 64 регистра (одна кэш-линия) на бакет, ошибка около 13%
+    static const size_t REGISTERS = size_t(1) << REGISTER_BITS;
+    static const uint64_t MIN_SAMPLE = 32;   // По меньшей выборке оценка не делается
+
+private:
+    std::vector<uint8_t> registers;
+    std::vector<uint64_t> sampled; // Ключей в выборке вместе с повторами
+
+public:
+    explicit DistinctSketches(size_t buckets) : registers(buckets * REGISTERS, 0), sampled(buckets, 0) {}
+
+    void add(size_t bucket_idx, uint64_t hash) {
+        if (hash & ((1u << SAMPLE_BITS) - 1)) return;
+        hash >>= SAMPLE_BITS;
+        uint8_t& reg = registers[bucket_idx * REGISTERS + (hash & (REGISTERS - 1))];
+        uint8_t rank = __builtin_ctzll((hash >> REGISTER_BITS) | (1ULL << (64 - SAMPLE_BITS - REGISTER_BITS))) + 1;
+        if (rank > reg) reg = rank;
+        sampled[bucket_idx]++;
+    }
+
+    void merge(const DistinctSketches& other) {
+        for (size_t i = 0; i < registers.size(); ++i) registers[i] = std::max(registers[i], other.registers[i]);
+        for (size_t i = 0; i < sampled.size(); ++i) sampled[i] += other.sampled[i];
+    }
+
+    void clear() {
+        std::fill(registers.begin(), registers.end(), 0);
+        std::fill(sampled.begin(), sampled.end(), 0);
+    }
+
+    double distinctRatio(size_t bucket_idx) const {
+        if (sampled[bucket_idx] < MIN_SAMPLE) return 1.0;
+        const uint8_t* reg = &registers[bucket_idx * REGISTERS];
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t j = 0; j < REGISTERS; ++j) {
+            sum += std::ldexp(1.0, -reg[j]);
+            if (reg[j] == 0) zeros++;
+        }
+        const double m = REGISTERS;
+        double estimate = 0.709 * m * m / sum;
+        // На малых числах точнее линейный подсчет по пустым регистрам
+        if (estimate <= 2.5 * m && zeros > 0) estimate = m * std::log(m / zeros);
+        return std::min(1.0, estimate / sampled[bucket_idx]);
+    }
+};
+
+// Число различных префиксов во всем бакете по префиксам выборки из n ключей, как в парадоксе дней
+// рождения: из P равновероятных префиксов в выборке различных около P * (1 - e^(-n/P)), и P находится
+// делением пополам. Без совпадений в выборке префиксов много больше n^2 - тогда бесконечность.
+// Выборка при этом портится.
+double estimatePrefixes(uint128_t* prefixes, size_t n) {
+    std::sort(prefixes, prefixes + n);
+    double seen = double(std::unique(prefixes, prefixes + n) - prefixes);
+    if (seen == n) return HUGE_VAL;
+    double lo = seen, hi = double(n) * n;
+    for (int step = 0; step < 64; ++step) {
+        double mid = (lo + hi) / 2;
+        if (mid * -std::expm1(-double(n) / mid) < seen) lo = mid;
+        else hi = mid;
+    }
+    return hi;
+}
+
+// --- УПРАВЛЕНИЕ ФАЙЛАМИ ---
+
+// Временные файлы счетчика: <tempDir>/temp_bucket_<pid>_<номер счетчика>_<бакет>.bin,
+// поэтому несколько счетчиков и процессов могут работать в одном каталоге
+std::string makeTempPrefix(const std::string& tempDir) {
+    static std::atomic<uint64_t> counters{0};
+    std::string dir = tempDir.empty() ? "." : tempDir;
+    if (dir.back() != '/') dir += '/';
+    return dir + "temp_bucket_" + std::to_string(getpid()) + "_" + std::to_string(counters++) + "_";
+}
+
+// Жесткий лимит открытых файлов: выше него мягкий лимит не поднять
+size_t openFileHardLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_max == RLIM_INFINITY) return SIZE_MAX;
+    return size_t(limit.rlim_max);
+}
+
+// Бакетов может быть десятки тысяч: поднимаем мягкий лимит открытых файлов до нужного
+void ensureOpenFileLimit(size_t needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= needed) return;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+        throw std::runtime_error("Fan-out needs " + std::to_string(needed) + " open files, the limit is " +
+                                 std::to_string(limit.rlim_max) + ". Use a smaller or two-level --fanout.");
+    }
+    limit.rlim_cur = needed;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+// Запись всего блока по смещению
+void writeFully(int fd, const void* data, size_t length, uint64_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n <= 0) throw std::runtime_error("Could not write temp file.");
+        p += n;
+        length -= n;
+        offset += n;
+    }
+}
+
+// Общие для всех потоков файлы бакетов. Место под блок резервируется атомарным сдвигом
+// конца файла, после чего блоки разных потоков пишутся через pwrite без блокировок.
+// С бюджетом памяти (keepInMemory) бакеты сначала копятся в памяти цепочками блоков; когда
+// общий объем превышает бюджет, самый большой бакет целиком сбрасывается в свой файл,
+// и дальше его блоки пишутся на диск. Бакет, таким образом, всегда либо целиком в памяти, либо на диске.
+// С наблюдением за диском (watchDiskUsage) накопленный файл бакета можно отделить для сжатия:
+// запись бакета на время подмены файла ждет его замка, в остальное время замок общий.
+// Файлы, оставшиеся после обработки или ошибки, удаляются вместе с объектом.
+class BucketFiles {
+    struct MemoryBucket {
+        std::mutex lock;
+        std::vector<std::pair<uint128_t*, size_t>> chunks; // Блок и число ключей в нем
+        bool spilled = false;
+    };
+
+    LargeAllocator& allocator;
+    std::string prefix;
+    unsigned fixedBits; // Старших бит ключа, определяющих бакет (с учетом всех уровней)
+    std::vector<int> fds;
+    bool opened = false;
+    bool keepFiles = false; // Файлы нужны контрольной точке и после ошибки
+    std::vector<std::atomic<uint64_t>> reserved; // Байт зарезервировано в файле каждого бакета
+    std::mutex sketchLock;
+    DistinctSketches sketches; // Сводка скетчей всех писателей
+
+    uint64_t memoryBudget = 0;
+    std::unique_ptr<MemoryBucket[]> memory; // nullptr - все бакеты пишутся на диск
+    std::vector<std::atomic<uint64_t>> memoryBytes;
+    std::atomic<uint64_t> memoryTotal{0};
+    std::atomic<uint64_t> memoryPeak{0};
+    std::atomic<uint64_t> spilledCount{0};
+    std::mutex spillLock;
+
+    std::unique_ptr<std::shared_mutex[]> fileLocks; // nullptr - файлы не подменяются
+    std::atomic<uint64_t> diskTotal{0};             // Файлы бакетов и все, что учтено через addDiskBytes
+    std::atomic<uint64_t> diskPeak{0};
+    uint64_t diskThreshold = 0;
+    std::function<void(uint64_t)> diskWatch;
+
+    // Запись в файл бакета по зарезервированному смещению
+    void append(size_t bucket_idx, const uint128_t* data, size_t count) {
+        if (!fileLocks) {
+            writeFully(fds[bucket_idx], data, count * sizeof(uint128_t), reserve(bucket_idx, count));
+            return;
+        }
+        std::shared_lock<std::shared_mutex> guard(fileLocks[bucket_idx]);
+        writeFully(fds[bucket_idx], data, count * sizeof(uint128_t), reserve(bucket_idx, count));
+    }
+
+    // Сброс цепочки бакета в его файл; дальнейшие блоки бакета пойдут на диск
+    void spill(size_t bucket_idx) {
+        MemoryBucket& bucket = memory[bucket_idx];
+        std::lock_guard<std::mutex> guard(bucket.lock);
+        if (bucket.spilled) return;
+        bucket.spilled = true;
+        for (auto& chunk : bucket.chunks) {
+            append(bucket_idx, chunk.first, chunk.second);
+            allocator.release(chunk.first, chunk.second * sizeof(uint128_t));
+        }
+        bucket.chunks.clear();
+        memoryTotal -= memoryBytes[bucket_idx].exchange(0);
+        spilledCount++;
+    }
+
+    // Сбрасывать самые большие бакеты, пока объем в памяти не уложится в бюджет
+    void spillLargest() {
+        std::lock_guard<std::mutex> guard(spillLock);
+        while (memoryTotal.load() > memoryBudget) {
+            size_t largest = 0;
+            for (size_t i = 1; i < fds.size(); ++i) {
+                if (memoryBytes[i].load() > memoryBytes[largest].load()) largest = i;
+            }
+            if (memoryBytes[largest].load() == 0) break;
+            spill(largest);
+        }
+    }
+
+    // Оставить блок в памяти; false, если бакет уже сброшен на диск
+    bool keep(size_t bucket_idx, const uint128_t* data, size_t count) {
+        MemoryBucket& bucket = memory[bucket_idx];
+        size_t bytes = count * sizeof(uint128_t);
+        uint64_t total;
+        {
+            // Счетчики меняются под замком бакета, чтобы spill не вычел еще не учтенный блок
+            std::lock_guard<std::mutex> guard(bucket.lock);
+            if (bucket.spilled) return false;
+            uint128_t* chunk = static_cast<uint128_t*>(allocator.allocate(bytes));
+            std::memcpy(static_cast<void*>(chunk), data, bytes);
+            bucket.chunks.emplace_back(chunk, count);
+            memoryBytes[bucket_idx] += bytes;
+            total = memoryTotal += bytes;
+        }
+        uint64_t peak = memoryPeak.load();
+        while (total > peak && !memoryPeak.compare_exchange_weak(peak, total)) {}
+        if (total > memoryBudget) spillLargest();
+        return true;
+    }
+
+public:
+    BucketFiles(LargeAllocator& allocator, size_t count, unsigned fixedBits, const std::string& prefix)
+        : allocator(allocator), prefix(prefix), fixedBits(fixedBits), fds(count, -1), reserved(count),
+          sketches(count), memoryBytes(count) {}
+
+    ~BucketFiles() {
+        closeAll();
+        if (opened && !keepFiles) {
+            for (size_t i = 0; i < fds.size(); ++i) std::remove(fileName(i).c_str());
+        }
+        if (!memory) return;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            for (auto& chunk : memory[i].chunks) allocator.release(chunk.first, chunk.second * sizeof(uint128_t));
+        }
+    }
+
+    BucketFiles(const BucketFiles&) = delete;
+    BucketFiles& operator=(const BucketFiles&) = delete;
+
+    // Держать бакеты в памяти, пока их общий объем не превысит budget байт. Вызывать до записи.
+    void keepInMemory(uint64_t budget) {
+        memoryBudget = budget;
+        memory.reset(new MemoryBucket[fds.size()]);
+    }
+
+    size_t count() const { return fds.size(); }
+
+    std::string fileName(size_t bucket_idx) const {
+        return prefix + std::to_string(bucket_idx) + ".bin";
+    }
+
+    // Подбакеты второго уровня: <префикс><бакет>_<подбакет>.bin
+    std::string subBucketPrefix(size_t bucket_idx) const {
+        return prefix + std::to_string(bucket_idx) + "_";
+    }
+
+    void openAll() {
+        opened = true;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            std::string file_name = fileName(i);
+            fds[i] = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fds[i] < 0) throw std::runtime_error("Could not open temp file " + file_name);
+            reserved[i].store(0);
+        }
+    }
+
+    // Файлы прерванного подсчета: обрезаются до длин из контрольной точки, запись продолжается с них
+    void openExisting(const std::vector<uint64_t>& lengths) {
+        opened = true;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            std::string file_name = fileName(i);
+            fds[i] = open(file_name.c_str(), O_WRONLY | O_CREAT, 0644);
+            struct stat st;
+            if (fds[i] < 0 || fstat(fds[i], &st) != 0) throw std::runtime_error("Could not open temp file " + file_name);
+            if (uint64_t(st.st_size) < lengths[i]) {
+                throw std::runtime_error("Temp file " + file_name + " is shorter than its checkpoint");
+            }
+            if (ftruncate(fds[i], lengths[i]) != 0) throw std::runtime_error("Could not truncate temp file " + file_name);
+            reserved[i].store(lengths[i]);
+            addDiskBytes(lengths[i]);
+        }
+    }
+
+    // Не удалять файлы вместе с объектом: по ним продолжится прерванный подсчет
+    void keepFilesOnExit() { keepFiles = true; }
+
+    // Вызывать, когда записи не идут: после него файлы на диске не короче bytesIn
+    void syncAll() {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fdatasync(fds[i]) != 0) throw std::runtime_error("Could not sync temp file " + fileName(i));
+        }
+    }
+
+    uint64_t bytesIn(size_t bucket_idx) const { return reserved[bucket_idx].load(); }
+
+    int fd(size_t bucket_idx) const { return fds[bucket_idx]; }
+
+    // Смещение, по которому нужно записать count элементов
+    uint64_t reserve(size_t bucket_idx, size_t count) {
+        addDiskBytes(count * sizeof(uint128_t));
+        return reserved[bucket_idx].fetch_add(count * sizeof(uint128_t));
+    }
+
+    // Блок копируется в память бакета или пишется в его файл
+    void write(size_t bucket_idx, const uint128_t* data, size_t count) {
+        if (!memory || !keep(bucket_idx, data, count)) append(bucket_idx, data, count);
+        if (diskWatch) {
+            uint64_t total = diskTotal.load();
+            if (total > diskThreshold) diskWatch(total);
+        }
+    }
+
+    // После записи в файл, когда файлы на диске больше threshold байт, пишущий поток вызывает callback
+    // с их объемом; замков бакетов он при этом не держит. Разрешает detachFile. Вызывать до записи.
+    void watchDiskUsage(uint64_t threshold, std::function<void(uint64_t)> callback) {
+        diskThreshold = threshold;
+        diskWatch = std::move(callback);
+        fileLocks.reset(new std::shared_mutex[fds.size()]);
+    }
+
+    // Учет временных файлов вне бакетов (например, прогонов сжатия)
+    void addDiskBytes(uint64_t bytes) {
+        uint64_t total = diskTotal += bytes;
+        uint64_t peak = diskPeak.load();
+        while (total > peak && !diskPeak.compare_exchange_weak(peak, total)) {}
+    }
+
+    void releaseDiskBytes(uint64_t bytes) { diskTotal -= bytes; }
+
+    uint64_t diskBytes() const { return diskTotal.load(); }
+    uint64_t diskPeakBytes() const { return diskPeak.load(); }
+
+    // Накопленный файл бакета переименовывается в detachedName, а запись продолжается в новый пустой файл.
+    // Возвращает длину отделенного файла; его место на диске освобождает releaseDiskBytes.
+    uint64_t detachFile(size_t bucket_idx, const std::string& detachedName) {
+        std::unique_lock<std::shared_mutex> guard(fileLocks[bucket_idx]);
+        std::string name = fileName(bucket_idx);
+        if (std::rename(name.c_str(), detachedName.c_str()) != 0) {
+            throw std::runtime_error("Could not rename temp file " + name);
+        }
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Could not open temp file " + name);
+        close(fds[bucket_idx]);
+        fds[bucket_idx] = fd;
+        return reserved[bucket_idx].exchange(0);
+    }
+
+    // true, если блок оставлен в памяти и писать его в файл не нужно
+    bool tryKeep(size_t bucket_idx, const uint128_t* data, size_t count) {
+        return memory && keep(bucket_idx, data, count);
+    }
+
+    // Вызывать после завершения записи
+    uint64_t countIn(size_t bucket_idx) const {
+        return (reserved[bucket_idx].load() + memoryBytes[bucket_idx].load()) / sizeof(uint128_t);
+    }
+
+    bool inMemory(size_t bucket_idx) const { return memory && !memory[bucket_idx].spilled; }
+
+    // Перенос цепочки бакета в dest (countIn ключей) с освобождением блоков
+    void takeFromMemory(size_t bucket_idx, uint128_t* dest) {
+        MemoryBucket& bucket = memory[bucket_idx];
+        std::lock_guard<std::mutex> guard(bucket.lock);
+        for (auto& chunk : bucket.chunks) {
+            std::memcpy(static_cast<void*>(dest), chunk.first, chunk.second * sizeof(uint128_t));
+            dest += chunk.second;
+            allocator.release(chunk.first, chunk.second * sizeof(uint128_t));
+        }
+        bucket.chunks.clear();
+        memoryTotal -= memoryBytes[bucket_idx].exchange(0);
+    }
+
+    void printMemoryUse(std::ostream& out) const {
+        if (!memory) return;
+        size_t inMemoryCount = 0;
+        for (size_t i = 0; i < fds.size(); ++i) inMemoryCount += !memory[i].spilled;
+        out << "Buckets: " << inMemoryCount << " kept in memory, " << spilledCount.load()
+            << " spilled to disk; peak " << std::fixed << std::setprecision(1) << memoryPeak.load() / (1024.0 * 1024.0)
+            << " MB of " << memoryBudget / (1024.0 * 1024.0) << " MB budget" << std::endl;
+    }
+
+    void mergeSketches(const DistinctSketches& local) {
+        std::lock_guard<std::mutex> guard(sketchLock);
+        sketches.merge(local);
+    }
+
+    // Вызывать после завершения записи
+    BucketProfile profile(size_t bucket_idx) const {
+        BucketProfile p;
+        p.keys = countIn(bucket_idx);
+        p.fixedBits = fixedBits;
+        p.distinctRatio = sketches.distinctRatio(bucket_idx);
+        return p;
+    }
+
+    void closeAll() {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i] >= 0) close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+};
+
+// Слот программного объединения записи: одна кэш-линия ключей бакета
+struct alignas(CACHE_LINE_SIZE) StagingLine {
+    static const size_t KEYS = CACHE_LINE_SIZE / sizeof(uint128_t);
+    uint128_t keys[KEYS];
+};
+
+// Перенос заполненной линии в блок бакета потоковыми (non-temporal) записями:
+// линия уходит в память целиком, не вытесняя из кэша слоты и входные данные.
+inline void streamLine(uint128_t* dst, const StagingLine& line) {
+#if defined(__SSE2__)
+    const __m128i* src = reinterpret_cast<const __m128i*>(line.keys);
+    __m128i* out = reinterpret_cast<__m128i*>(dst);
+    for (size_t i = 0; i < StagingLine::KEYS; ++i) {
+        _mm_stream_si128(out + i, _mm_load_si128(src + i));
+    }
+#else
+    std::memcpy(dst, line.keys, sizeof(line.keys));
+#endif
+}
+
+// Потоковые записи не упорядочены с обычными: перед передачей блока другому потоку нужен барьер
+inline void streamFence() {
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Точный фильтр недавних ключей потока фазы 1: двухканальный ассоциативный кэш ключей размером с L2.
+// Ключ, найденный в кэше, этот же поток уже записал в бакет, поэтому повтор можно отбросить, не меняя ответа.
+// Промах ничего не утверждает: ключ пишется и вытесняет давнее значение набора.
+// Внутри набора недавний ключ стоит первым (вытесняется второй), как в LRU.
+class RecentKeyFilter {
+    struct alignas(2 * sizeof(uint128_t)) Set {
+        uint128_t way[2];
+    };
+
+    std::vector<Set> sets; // Пустое место - нулевой ключ, сам нулевой ключ помнит флаг
+    size_t mask;
+    bool zeroSeen = false;
+
+public:
+    explicit RecentKeyFilter(size_t bytes) {
+        size_t count = 1;
+        while (count * 2 * sizeof(Set) <= bytes) count *= 2;
+        sets.assign(count, Set{});
+        mask = count - 1;
+    }
+
+    size_t bytes() const { return sets.size() * sizeof(Set); }
+
+    // true, если ключ недавно встречался; иначе запоминает его
+    bool seen(const uint128_t& key, uint64_t hash) {
+        if ((key.hi | key.lo) == 0) {
+            bool was = zeroSeen;
+            zeroSeen = true;
+            return was;
+        }
+        Set& set = sets[(hash >> 32) & mask];
+        if (set.way[0] == key) return true;
+        if (set.way[1] == key) {
+            std::swap(set.way[0], set.way[1]);
+            return true;
+        }
+        set.way[1] = set.way[0];
+        set.way[0] = key;
+        return false;
+    }
+};
+
+// Класс для буферизированной записи в бакеты. У каждого потока пула в фазе 1 свой экземпляр;
+// он создается уже в привязанном к узлу потоке, поэтому буферы лежат в локальной памяти.
+// Все блоки буферов - один непрерывный кусок, чтобы его можно было целиком разместить на больших страницах.
+// Заполненный блок уходит на запись отдельной задачей пула, а бакет сразу получает запасной блок.
+// Ключи сначала копятся в слоте-линии бакета (при 256 бакетах все слоты вместе - 16 КБ, живут в L1/L2)
+// и переносятся в блок только целыми линиями, поэтому раскладка не трогает 256 холодных линий подряд.
+// Писатель получает долю ctx.writeBudgetBytes на один из ctx.writerSlots одновременно живущих писателей;
+// чем больше бакетов, тем меньше блок каждого, пока он не упрется в MIN_WRITE_BUFFER_SIZE.
+// Попутно писатель собирает свои скетчи бакетов и сливает их в общие при flushAll.
+class BucketWriter {
+    CounterContext& ctx;
+    BucketFiles& files;
+    ThreadPool& pool;
+    TaskGroup& flushes;
+    size_t bucketCount;
+    size_t blockKeys;   // Размер блока в ключах
+    size_t totalBlocks; // Блоки бакетов плюс запасные
+    uint128_t* slab; // Без инициализации: страницы выделяются при первой записи
+    std::vector<uint128_t*> current;
+    std::vector<size_t> fill; // Ключей в блоке; всегда кратно StagingLine::KEYS, пока бакет не сброшен
+    std::unique_ptr<StagingLine[]> staging;
+    std::vector<uint8_t> staged; // Ключей в слоте бакета
+    DistinctSketches sketches;
+    std::unique_ptr<RecentKeyFilter> recent;
+    uint64_t checked = 0;
+    uint64_t dropped = 0;
+
+    std::mutex spareLock;
+    std::vector<uint128_t*> spare; // Возвращаются задачами записи из других потоков
+
+#if HAVE_COROUTINES
+    IoService* io = nullptr;
+    AsyncScope* ioScope = nullptr;
+
+    AsyncTask flushAsync(size_t bucket_idx, uint128_t* full, size_t count) {
+        if (files.tryKeep(bucket_idx, full, count)) {
+            returnSpare(full);
+            co_return;
+        }
+        size_t length = count * sizeof(uint128_t);
+        ssize_t n = co_await io->write(files.fd(bucket_idx), full, length, files.reserve(bucket_idx, count));
+        if (n != (ssize_t)length) throw std::runtime_error("Could not write temp file.");
+        returnSpare(full);
+    }
+#endif
+
+    void returnSpare(uint128_t* block) {
+        std::lock_guard<std::mutex> guard(spareLock);
+        spare.push_back(block);
+    }
+
+    static size_t blocksFor(size_t buckets) { return buckets + std::max<size_t>(32, buckets / 8); }
+
+    // Блок кратен линии слота: add() переносит ключи только целыми линиями и сбрасывает блок,
+    // когда он заполнен, поэтому последняя линия не должна выходить за его конец
+    static size_t blockKeysFor(const CounterContext& ctx, size_t buckets) {
+        size_t share = ctx.writeBudgetBytes / ctx.writerSlots;
+        size_t keys = std::max(MIN_WRITE_BUFFER_SIZE, std::min(WRITE_BUFFER_SIZE, share / sizeof(uint128_t) / blocksFor(buckets)));
+        return keys / StagingLine::KEYS * StagingLine::KEYS;
+    }
+
+public:
+    // Сколько памяти займут буферы одного писателя на buckets бакетов
+    static size_t slabBytes(const CounterContext& ctx, size_t buckets) {
+        return blocksFor(buckets) * blockKeysFor(ctx, buckets) * sizeof(uint128_t);
+    }
+
+    BucketWriter(CounterContext& ctx, BucketFiles& files, ThreadPool& pool, TaskGroup& flushes)
+        : ctx(ctx), files(files), pool(pool), flushes(flushes), bucketCount(files.count()),
+          blockKeys(blockKeysFor(ctx, bucketCount)), totalBlocks(blocksFor(bucketCount)),
+          slab(static_cast<uint128_t*>(ctx.memory.allocate(totalBlocks * blockKeys * sizeof(uint128_t)))),
+          current(bucketCount), fill(bucketCount, 0),
+          staging(new StagingLine[bucketCount]), staged(bucketCount, 0), sketches(bucketCount) {
+        for (size_t i = 0; i < bucketCount; ++i) current[i] = slab + i * blockKeys;
+        for (size_t i = bucketCount; i < totalBlocks; ++i) spare.push_back(slab + i * blockKeys);
+    }
+
+    // Перед уничтожением все задачи записи должны быть завершены
+    ~BucketWriter() {
+        ctx.memory.release(slab, totalBlocks * blockKeys * sizeof(uint128_t));
+    }
+
+    BucketWriter(const BucketWriter&) = delete;
+    BucketWriter& operator=(const BucketWriter&) = delete;
+
+    // Повторы недавних ключей этого писателя будут отбрасываться до записи
+    void useRecentFilter(size_t bytes) {
+        recent.reset(new RecentKeyFilter(bytes));
+    }
+
+#if HAVE_COROUTINES
+    // Заполненные блоки будут записываться корутинами через io; дождаться их можно через scope
+    void useAsyncIo(IoService& service, AsyncScope& scope) {
+        io = &service;
+        ioScope = &scope;
+    }
+#endif
+
+    void add(size_t bucket_idx, const uint128_t& ip) {
+        uint64_t hash = hashKey(ip);
+        if (recent) {
+            checked++;
+            if (recent->seen(ip, hash)) {
+                dropped++;
+                return;
+            }
+        }
+        sketches.add(bucket_idx, hash);
+        StagingLine& line = staging[bucket_idx];
+        line.keys[staged[bucket_idx]] = ip;
+        if (++staged[bucket_idx] < StagingLine::KEYS) return;
+
+        streamLine(current[bucket_idx] + fill[bucket_idx], line);
+        staged[bucket_idx] = 0;
+        fill[bucket_idx] += StagingLine::KEYS;
+        if (fill[bucket_idx] >= blockKeys) {
+            flush(bucket_idx);
+        }
+    }
+
+    void flush(size_t bucket_idx) {
+        // Неполная линия дописывается обычными записями
+        for (size_t i = 0; i < staged[bucket_idx]; ++i) {
+            current[bucket_idx][fill[bucket_idx]++] = staging[bucket_idx].keys[i];
+        }
+        staged[bucket_idx] = 0;
+
+        size_t count = fill[bucket_idx];
+        if (count == 0) return;
+        streamFence();
+
+        uint128_t* next = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(spareLock);
+            if (!spare.empty()) {
+                next = spare.back();
+                spare.pop_back();
+            }
+        }
+
+        // Запасных блоков нет - диск не успевает, пишем сами
+        if (!next) {
+            files.write(bucket_idx, current[bucket_idx], count);
+            fill[bucket_idx] = 0;
+            return;
+        }
+
+        uint128_t* full = current[bucket_idx];
+        current[bucket_idx] = next;
+        fill[bucket_idx] = 0;
+#if HAVE_COROUTINES
+        if (io) {
+            ioScope->spawn(flushAsync(bucket_idx, full, count));
+            return;
+        }
+#endif
+        pool.submit(flushes, [this, bucket_idx, full, count]() {
+            files.write(bucket_idx, full, count);
+            returnSpare(full);
+        });
+    }
+
+    void flushAll() {
+        for (size_t i = 0; i < bucketCount; ++i) {
+            flush(i);
+        }
+        files.mergeSketches(sketches);
+        sketches.clear();
+        ctx.prefilterChecked += checked;
+        ctx.prefilterDropped += dropped;
+        checked = dropped = 0;
+    }
+};
+
+// --- ФАЗА 1: РАЗБИЕНИЕ ВХОДНОГО ФАЙЛА ---
+
+// Размер фрагмента входного файла для одной задачи фазы 1
+const uint64_t PHASE1_CHUNK_BYTES = 32 * 1024 * 1024;
+
+// Разбор фрагмента входного файла [begin, end): onKey(key, pos) вызывается для каждого адреса,
+// pos - смещение конца его строки; обход прекращается, если onKey вернул false.
+// Строка относится к тому фрагменту, в котором лежит ее первый байт.
+template <typename F>
+void forEachKeyInChunk(const std::string& inputPath, uint64_t begin, uint64_t end, LineProgress& progress, F onKey) {
+    std::ifstream inFile(inputPath);
+    if (!inFile.is_open()) throw std::runtime_error("Could not open input file.");
+
+    std::string line;
+    uint64_t pos = begin;
+    if (begin > 0) {
+        // Дочитываем строку, начавшуюся в предыдущем фрагменте
+        inFile.seekg(begin - 1);
+        std::getline(inFile, line);
+        pos = begin + line.length();
+    }
+
+    uint128_t ipVal;
+    uint64_t localLines = 0;
+
+    while (pos < end && std::getline(inFile, line)) {
+        pos += line.length() + 1;
+        if (line.empty()) continue;
+
+        // Удаляем CR в конце, если они есть
+        if (line.back() == '\r') line.pop_back();
+
+        if (parseIPv6(line, ipVal) && !onKey(ipVal, pos)) break;
+
+        if (++localLines == 65536) {
+            progress.add(localLines);
+            localLines = 0;
+        }
+    }
+    progress.add(localLines);
+}
+
+template <unsigned BITS>
+void partitionChunk(const std::string& inputPath, uint64_t begin, uint64_t end, LineProgress& progress,
+                    BucketWriter& writer) {
+    forEachKeyInChunk(inputPath, begin, end, progress, [&](const uint128_t& key, uint64_t) {
+        // Используем старшие BITS бит как индекс корзины
+        writer.add(BucketIndex<BITS>::top(key), key);
+        return true;
+    });
+}
+
+// --- ФАЗА 1: УПОРЯДОЧЕННЫЙ ВХОД ---
+
+// Итог просмотра одного фрагмента упорядоченного входа
+struct SortedChunk {
+    uint64_t keys = 0;
+    uint64_t distinct = 0;
+    uint128_t first{0, 0};
+    uint128_t last{0, 0};
+};
+
+// Если адреса во входе уже идут по неубыванию, различные считаются одним проходом сравнением
+// с предыдущим адресом, без временных файлов и с памятью O(1) на фрагмент. Фрагменты просматриваются
+// параллельно, на стыках проверяется, что последний адрес фрагмента не больше первого адреса следующего.
+// Первое же нарушение порядка останавливает все фрагменты; тогда возвращается false, а в brokenAt -
+// смещение строки, на которой порядок нарушился.
+bool countSortedInput(const std::string& inputPath, uint64_t fileSize, uint64_t nChunks, ThreadPool& pool,
+                      LineProgress& progress, uint64_t& distinct, uint64_t& brokenAt) {
+    std::vector<SortedChunk> chunks(nChunks);
+    std::atomic<bool> broken{false};
+    std::atomic<uint64_t> firstBreak{UINT64_MAX};
+    TaskGroup scan;
+    for (uint64_t c = 0; c < nChunks; ++c) {
+        uint64_t begin = fileSize * c / nChunks;
+        uint64_t end = fileSize * (c + 1) / nChunks;
+        pool.submit(scan, [&, c, begin, end]() {
+            SortedChunk& chunk = chunks[c];
+            forEachKeyInChunk(inputPath, begin, end, progress, [&](const uint128_t& key, uint64_t pos) {
+                if (chunk.keys > 0 && key < chunk.last) {
+                    uint64_t seen = firstBreak.load();
+                    while (pos < seen && !firstBreak.compare_exchange_weak(seen, pos)) {}
+                    broken.store(true, std::memory_order_relaxed);
+                    return false;
+                }
+                if (chunk.keys == 0) chunk.first = key;
+                chunk.distinct += chunk.keys == 0 || !(key == chunk.last);
+                chunk.last = key;
+                ++chunk.keys;
+                return !broken.load(std::memory_order_relaxed);
+            });
+        });
+    }
+    pool.wait(scan);
+    if (broken.load()) {
+        brokenAt = firstBreak.load();
+        return false;
+    }
+
+    // Стыки фрагментов: пустые фрагменты пропускаются, одинаковый адрес по обе стороны стыка считается один раз
+    distinct = 0;
+    const SortedChunk* previous = nullptr;
+    for (uint64_t c = 0; c < nChunks; ++c) {
+        const SortedChunk& chunk = chunks[c];
+        if (chunk.keys == 0) continue;
+        distinct += chunk.distinct;
+        if (previous) {
+            if (chunk.first < previous->last) {
+                brokenAt = fileSize * c / nChunks;
+                return false;
+            }
+            if (chunk.first == previous->last) --distinct;
+        }
+        previous = &chunk;
+    }
+    return true;
+}
+
+// --- ФАЗА 1: КОНВЕЙЕР ЧТЕНИЕ -> РАЗБОР -> РАЗБИЕНИЕ ---
+
+// Кольцевой буфер с одним писателем и одним читателем
+template <typename T>
+class SpscRing {
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // Позиция читателя
+    alignas(64) std::atomic<size_t> tail{0}; // Позиция писателя
+
+public:
+    // capacity - степень двойки
+    explicit SpscRing(size_t capacity) : slots(capacity), mask(capacity - 1) {}
+
+    bool tryPush(const T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Ограниченная очередь Вьюкова для нескольких писателей и читателей
+template <typename T>
+class MpmcRing {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+
+public:
+    // capacity - степень двойки
+    explicit MpmcRing(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool tryPush(const T& value) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Очередь полна
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Очередь пуста
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Канал между стадиями: SPSC, если с обеих сторон по одному потоку, иначе MPMC.
+// Запись в полный канал ждет (обратное давление) и считается в статистике простоев.
+template <typename T>
+class StageChannel {
+    std::unique_ptr<SpscRing<T>> spsc;
+    std::unique_ptr<MpmcRing<T>> mpmc;
+
+public:
+    StageChannel(size_t capacity, size_t producers, size_t consumers) {
+        if (producers == 1 && consumers == 1) {
+            spsc.reset(new SpscRing<T>(capacity));
+        } else {
+            mpmc.reset(new MpmcRing<T>(capacity));
+        }
+    }
+
+    bool tryPush(const T& value) { return spsc ? spsc->tryPush(value) : mpmc->tryPush(value); }
+    bool tryPop(T& value) { return spsc ? spsc->tryPop(value) : mpmc->tryPop(value); }
+
+    void push(const T& value, uint64_t& stalls) {
+        for (unsigned spin = 0; !tryPush(value); ++spin) {
+            stalls++;
+            if (spin > 64) std::this_thread::yield();
+        }
+    }
+
+    // Ждет элемент, пока все producers писателей не закончили работу. false - данных больше не будет.
+    bool pop(T& value, const std::atomic<size_t>& finished, size_t producers, uint64_t& stalls) {
+        for (unsigned spin = 0; ; ++spin) {
+            if (tryPop(value)) return true;
+            if (finished.load(std::memory_order_acquire) == producers) {
+                // Все записи писателей видны после чтения счетчика - последняя попытка
+                return tryPop(value);
+            }
+            stalls++;
+            if (spin > 64) std::this_thread::yield();
+        }
+    }
+};
+
+struct PipelineConfig {
+    bool enabled = false;
+    size_t readers = 0;      // 0 - выбрать автоматически
+    size_t parsers = 0;
+    size_t partitioners = 0;
+};
+
+// Потоки по умолчанию: один читатель, четверть на раскладку, остальные на разбор
+void resolvePipelineConfig(PipelineConfig& cfg, size_t nThreads) {
+    size_t n = std::max<size_t>(3, nThreads);
+    if (cfg.readers == 0) cfg.readers = 1;
+    if (cfg.partitioners == 0) cfg.partitioners = std::max<size_t>(1, n / 4);
+    if (cfg.parsers == 0) cfg.parsers = std::max<size_t>(1, n - cfg.readers - cfg.partitioners);
+}
+
+// Фрагмент файла, содержащий только целые строки
+struct TextChunk {
+    static const size_t CAPACITY = 1024 * 1024;
+    char data[CAPACITY];
+    size_t length;
+};
+
+// Пачка разобранных адресов
+struct KeyBatch {
+    static const size_t CAPACITY = 4096;
+    uint128_t keys[CAPACITY];
+    size_t count;
+};
+
+// Фаза 1 в виде конвейера: читатели нарезают файл на фрагменты из целых строк, разборщики
+// превращают строки в пачки ключей, распределители раскладывают ключи по бакетам.
+// Стадии связаны ограниченными кольцевыми буферами; число фрагментов и пачек фиксировано,
+// свободные экземпляры возвращаются через отдельные кольца, поэтому память конвейера не растет.
+class Phase1Pipeline {
+    struct StageStats {
+        uint64_t items = 0;
+        uint64_t inputStalls = 0;  // Ждали данных от предыдущей стадии
+        uint64_t outputStalls = 0; // Ждали места в следующей стадии
+    };
+
+    CounterContext& ctx;
+    const std::string& inputPath;
+    const NumaTopology& topo;
+    std::function<std::unique_ptr<BucketWriter>()> makeWriter;
+    PipelineConfig config;
+
+    std::mutex errorLock;
+    std::exception_ptr error; // Первая ошибка стадий, выбрасывается из run
+
+    std::vector<TextChunk> chunks;
+    std::vector<KeyBatch> batches;
+    StageChannel<TextChunk*> freeChunks;
+    StageChannel<TextChunk*> filledChunks;
+    StageChannel<KeyBatch*> freeBatches;
+    StageChannel<KeyBatch*> filledBatches;
+
+    std::atomic<size_t> readersDone{0};
+    std::atomic<size_t> parsersDone{0};
+    const std::atomic<size_t> never{0}; // Свободные экземпляры возвращаются всегда, конца у этих каналов нет
+
+    std::vector<StageStats> readerStats, parserStats, partitionerStats;
+    std::vector<std::unique_ptr<BucketWriter>> writers;
+
+    static size_t ringCapacity(size_t items) {
+        size_t capacity = 2;
+        while (capacity < items) capacity *= 2;
+        return capacity;
+    }
+
+public:
+    // makeWriter вызывается в потоке распределителя, чтобы буферы легли на его NUMA-узел
+    Phase1Pipeline(CounterContext& ctx, const std::string& inputPath, const NumaTopology& topo,
+                   std::function<std::unique_ptr<BucketWriter>()> makeWriter, const PipelineConfig& cfg)
+        : ctx(ctx), inputPath(inputPath), topo(topo), makeWriter(std::move(makeWriter)), config(cfg),
+          chunks(4 * config.parsers),
+          batches(4 * (config.partitioners + config.parsers)),
+          freeChunks(ringCapacity(chunks.size()), config.parsers, config.readers),
+          filledChunks(ringCapacity(chunks.size()), config.readers, config.parsers),
+          freeBatches(ringCapacity(batches.size()), config.partitioners, config.parsers),
+          filledBatches(ringCapacity(batches.size()), config.parsers, config.partitioners),
+          readerStats(config.readers), parserStats(config.parsers), partitionerStats(config.partitioners),
+          writers(config.partitioners) {
+        for (auto& c : chunks) freeChunks.tryPush(&c);
+        for (auto& b : batches) freeBatches.tryPush(&b);
+    }
+
+    // Стадия, на которой произошла ошибка, завершается так, чтобы соседние стадии не ждали ее вечно
+    void run(uint64_t fileSize) {
+        int fd = open(inputPath.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open input file.");
+
+        std::vector<std::thread> threads;
+        size_t slot = 0;
+        for (size_t r = 0; r < config.readers; ++r, ++slot) {
+            uint64_t begin = fileSize * r / config.readers;
+            uint64_t end = fileSize * (r + 1) / config.readers;
+            threads.emplace_back([this, fd, r, begin, end, slot]() {
+                pinCurrentThreadToNode(topo.nodes[topo.nodeForThread(slot)]);
+                try {
+                    readerStage(fd, begin, end, readerStats[r]);
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+                readersDone.fetch_add(1, std::memory_order_release);
+            });
+        }
+        for (size_t p = 0; p < config.parsers; ++p, ++slot) {
+            threads.emplace_back([this, p, slot]() {
+                pinCurrentThreadToNode(topo.nodes[topo.nodeForThread(slot)]);
+                try {
+                    parserStage(parserStats[p]);
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+                parsersDone.fetch_add(1, std::memory_order_release);
+            });
+        }
+        for (size_t w = 0; w < config.partitioners; ++w, ++slot) {
+            threads.emplace_back([this, w, slot]() {
+                pinCurrentThreadToNode(topo.nodes[topo.nodeForThread(slot)]);
+                try {
+                    writers[w] = makeWriter();
+                    dispatchBucketBits(ctx.partition.bits, [&](auto bits) {
+                        partitionerStage<decltype(bits)::value>(*writers[w], partitionerStats[w]);
+                    });
+                    writers[w]->flushAll();
+                } catch (...) {
+                    fail(std::current_exception());
+                    // Пачки дальше только возвращаются, чтобы разборщики не ждали места
+                    KeyBatch* batch = nullptr;
+                    while (filledBatches.pop(batch, parsersDone, config.parsers, partitionerStats[w].inputStalls)) {
+                        freeBatches.push(batch, partitionerStats[w].outputStalls);
+                    }
+                }
+            });
+        }
+
+        for (auto& t : threads) t.join();
+        close(fd);
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Буферы распределителей нужны, пока идет запись заполненных блоков
+    void releaseWriters() {
+        writers.clear();
+    }
+
+    void printStats(std::ostream& out) const {
+        out << "Pipeline: " << config.readers << " reader(s), " << config.parsers << " parser(s), "
+            << config.partitioners << " partitioner(s)" << std::endl;
+        printStage(out, "readers", readerStats);
+        printStage(out, "parsers", parserStats);
+        printStage(out, "partitioners", partitionerStats);
+    }
+
+private:
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> guard(errorLock);
+        if (!error) error = e;
+    }
+
+    static void printStage(std::ostream& out, const char* name, const std::vector<StageStats>& stats) {
+        StageStats sum;
+        for (const auto& s : stats) {
+            sum.items += s.items;
+            sum.inputStalls += s.inputStalls;
+            sum.outputStalls += s.outputStalls;
+        }
+        out << "  " << name << ": " << sum.items << " item(s), waited for input " << sum.inputStalls
+            << ", blocked on output " << sum.outputStalls << std::endl;
+    }
+
+    // Читает [begin, end) блоками; строка относится к диапазону, где лежит ее первый байт.
+    // Незавершенная строка в конце блока переносится в начало следующего.
+    void readerStage(int fd, uint64_t begin, uint64_t end, StageStats& stats) {
+        uint64_t pos = begin;
+        if (begin > 0) {
+            // Пропускаем хвост строки, начатой в предыдущем диапазоне
+            char c;
+            pos = begin - 1;
+            while (pread(fd, &c, 1, pos) == 1) {
+                pos++;
+                if (c == '\n') break;
+            }
+        }
+
+        std::string carry;
+        bool skippingLongLine = false;
+        while (pos < end || !carry.empty()) {
+            TextChunk* chunk = nullptr;
+            freeChunks.pop(chunk, never, 1, stats.inputStalls);
+
+            size_t length = carry.size();
+            std::memcpy(chunk->data, carry.data(), length);
+            carry.clear();
+            uint64_t chunkStart = pos - length; // Смещение chunk->data[0] в файле
+
+            ssize_t got = pread(fd, chunk->data + length, TextChunk::CAPACITY - length, pos);
+            if (got < 0) throw std::runtime_error("Could not read input file.");
+            pos += got;
+            length += got;
+
+            if (got == 0) {
+                // Конец файла: последняя строка без перевода строки
+                chunk->length = skippingLongLine ? 0 : length;
+                filledChunks.push(chunk, stats.outputStalls);
+                stats.items++;
+                break;
+            }
+
+            size_t cut; // Длина отдаваемой части (до последнего '\n' включительно)
+            bool finished = false;
+            uint64_t limit = end > chunkStart ? end - chunkStart : 0;
+            const char* lastNewline = nullptr;
+            if (limit <= length) {
+                // Ищем конец строки, в которой лежит последний байт диапазона
+                size_t from = limit > 0 ? limit - 1 : 0;
+                lastNewline = static_cast<const char*>(std::memchr(chunk->data + from, '\n', length - from));
+                finished = lastNewline != nullptr;
+            }
+            if (!lastNewline) {
+                lastNewline = static_cast<const char*>(memrchr(chunk->data, '\n', length));
+            }
+
+            if (lastNewline) {
+                cut = lastNewline - chunk->data + 1;
+                carry.assign(chunk->data + cut, length - cut);
+            } else if (length == TextChunk::CAPACITY) {
+                // Строка длиннее фрагмента не может быть адресом: отбрасываем ее до следующего '\n'
+                cut = 0;
+                skippingLongLine = true;
+            } else {
+                cut = 0;
+                carry.assign(chunk->data, length);
+            }
+
+            if (skippingLongLine && lastNewline) {
+                // Начало фрагмента - окончание слишком длинной строки
+                size_t skip = static_cast<const char*>(std::memchr(chunk->data, '\n', cut)) - chunk->data + 1;
+                std::memmove(chunk->data, chunk->data + skip, cut - skip);
+                cut -= skip;
+                skippingLongLine = false;
+            }
+
+            chunk->length = cut;
+            filledChunks.push(chunk, stats.outputStalls);
+            stats.items++;
+            if (finished) break;
+        }
+    }
+
+    void parserStage(StageStats& stats) {
+        KeyBatch* batch = nullptr;
+        freeBatches.pop(batch, never, 1, stats.outputStalls);
+        batch->count = 0;
+
+        TextChunk* chunk = nullptr;
+        uint64_t localLines = 0;
+        while (filledChunks.pop(chunk, readersDone, config.readers, stats.inputStalls)) {
+            const char* p = chunk->data;
+            const char* end = chunk->data + chunk->length;
+            while (p < end) {
+                const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                const char* lineEnd = nl ? nl : end;
+                size_t len = lineEnd - p;
+                if (len > 0) {
+                    // Удаляем CR в конце, если он есть
+                    size_t parseLen = (p[len - 1] == '\r') ? len - 1 : len;
+                    uint128_t& slotKey = batch->keys[batch->count];
+                    if (parseIPv6(p, parseLen, slotKey) && ++batch->count == KeyBatch::CAPACITY) {
+                        filledBatches.push(batch, stats.outputStalls);
+                        freeBatches.pop(batch, never, 1, stats.outputStalls);
+                        batch->count = 0;
+                    }
+                    localLines++;
+                }
+                p = lineEnd + 1;
+            }
+            freeChunks.push(chunk, stats.outputStalls);
+            stats.items++;
+        }
+
+        if (batch->count > 0) {
+            filledBatches.push(batch, stats.outputStalls);
+        } else {
+            freeBatches.push(batch, stats.outputStalls);
+        }
+        ctx.progress.add(localLines);
+    }
+
+    template <unsigned BITS>
+    void partitionerStage(BucketWriter& writer, StageStats& stats) {
+        KeyBatch* batch = nullptr;
+        while (filledBatches.pop(batch, parsersDone, config.parsers, stats.inputStalls)) {
+            for (size_t i = 0; i < batch->count; ++i) {
+                const uint128_t& ip = batch->keys[i];
+                writer.add(BucketIndex<BITS>::top(ip), ip);
+            }
+            freeBatches.push(batch, stats.outputStalls);
+            stats.items++;
+        }
+    }
+};
+
+// --- ВЕКТОРНАЯ СОРТИРОВКА КЛЮЧЕЙ ---
+
+// Сортировка без ветвлений на AVX-512 или AVX2. Ключи раскладываются на массивы старших и младших
+// половин, и одна векторная операция сравнивает W пар ключей: hi_a > hi_b || (hi_a == hi_b && lo_a > lo_b).
+// Блоки по VECTOR_BLOCK_KEYS ключей сортируются битонической сетью в регистрах, затем серии попарно
+// сливаются: регистр из очередной серии битонически сливается с удержанным, младшие W ключей уходят в выход,
+// а следующий регистр берется из серии с меньшей головой. Ядра собраны с атрибутом target и
+// выбираются по CPUID, поэтому программа по-прежнему собирается для любого x86-64.
+const size_t VECTOR_BLOCK_KEYS = 64;
+const size_t VECTOR_MAX_LANES = 8;
+
+// Позиция чтения в серии, разложенной на половины
+struct MergeCursor {
+    const uint64_t* hi;
+    const uint64_t* lo;
+    size_t size;
+    size_t pos;
+
+    size_t left() const { return size - pos; }
+};
+
+inline bool headLess(const MergeCursor& a, const MergeCursor& b) {
+    if (a.hi[a.pos] != b.hi[b.pos]) return a.hi[a.pos] < b.hi[b.pos];
+    return a.lo[a.pos] < b.lo[b.pos];
+}
+
+// Ядра одной системы команд
+struct VectorSortKernels {
+    const char* name;
+    size_t lanes;
+    // Сортировка VECTOR_BLOCK_KEYS ключей на месте
+    void (*sortBlock)(uint64_t* hi, uint64_t* lo);
+    // Векторное слияние, пока в серии с меньшей головой есть целый регистр (в обеих сериях должно быть
+    // не меньше lanes ключей). Возвращает число выведенных ключей; lanes ключей, еще не выведенных
+    // из удержанного регистра, остаются в pendingHi/pendingLo.
+    size_t (*mergeVectors)(MergeCursor& a, MergeCursor& b, uint64_t* outHi, uint64_t* outLo,
+                           uint64_t* pendingHi, uint64_t* pendingLo);
+};
+
+// Дорожки регистра из W ключей, у которых бит j номера равен нулю
+inline unsigned lowerLanes(unsigned j, size_t lanes) {
+    unsigned bits = 0;
+    for (size_t lane = 0; lane < lanes; ++lane) {
+        if ((lane & j) == 0) bits |= 1u << lane;
+    }
+    return bits;
+}
+
+// Дорожки регистра v, которые на шаге (k, j) битонической сети оставляют меньший ключ пары:
+// нижние в паре на участках по возрастанию и верхние на участках по убыванию
+inline unsigned keepMinLanes(unsigned k, unsigned j, size_t v, size_t lanes) {
+    unsigned all = (1u << lanes) - 1;
+    unsigned ascending = k < lanes ? lowerLanes(k, lanes) : ((v * lanes) & k) == 0 ? all : 0;
+    return ~(lowerLanes(j, lanes) ^ ascending) & all;
+}
+
+#if HAVE_VECTOR_SORT
+#define AVX512_TARGET __attribute__((target("avx512f")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+namespace avx512 {
+
+const size_t W = 8;
+const size_t BLOCK_VECTORS = VECTOR_BLOCK_KEYS / W;
+
+AVX512_TARGET inline __mmask8 greater(__m512i ah, __m512i al, __m512i bh, __m512i bl) {
+    return _mm512_cmpgt_epu64_mask(ah, bh) | (_mm512_cmpeq_epu64_mask(ah, bh) & _mm512_cmpgt_epu64_mask(al, bl));
+}
+
+// Обмен между регистрами: в a остаются меньшие ключи пар, при descending - большие
+AVX512_TARGET inline void exchange(__m512i& ah, __m512i& al, __m512i& bh, __m512i& bl, bool descending) {
+    __mmask8 swap = descending ? greater(bh, bl, ah, al) : greater(ah, al, bh, bl);
+    __m512i th = _mm512_mask_blend_epi64(swap, ah, bh);
+    __m512i tl = _mm512_mask_blend_epi64(swap, al, bl);
+    bh = _mm512_mask_blend_epi64(swap, bh, ah);
+    bl = _mm512_mask_blend_epi64(swap, bl, al);
+    ah = th;
+    al = tl;
+}
+
+// Обмен внутри регистра на расстоянии j: дорожки из keepMin оставляют меньший ключ пары
+AVX512_TARGET inline void exchangeLanes(__m512i& h, __m512i& l, unsigned j, __mmask8 keepMin) {
+    __m512i partner = _mm512_xor_si512(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0), _mm512_set1_epi64(j));
+    __m512i ph = _mm512_permutex2var_epi64(h, partner, h);
+    __m512i pl = _mm512_permutex2var_epi64(l, partner, l);
+    __mmask8 take = (keepMin & greater(h, l, ph, pl)) | (~keepMin & greater(ph, pl, h, l));
+    h = _mm512_mask_blend_epi64(take, h, ph);
+    l = _mm512_mask_blend_epi64(take, l, pl);
+}
+
+AVX512_TARGET void sortBlock(uint64_t* hi, uint64_t* lo) {
+    __m512i h[BLOCK_VECTORS], l[BLOCK_VECTORS];
+    for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+        h[v] = _mm512_loadu_si512(hi + v * W);
+        l[v] = _mm512_loadu_si512(lo + v * W);
+    }
+    for (unsigned k = 2; k <= VECTOR_BLOCK_KEYS; k *= 2) {
+        for (unsigned j = k / 2; j >= 1; j /= 2) {
+            if (j >= W) {
+                for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+                    size_t u = v + j / W;
+                    if (v & (j / W)) continue;
+                    exchange(h[v], l[v], h[u], l[u], ((v * W) & k) != 0);
+                }
+            } else {
+                for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+                    exchangeLanes(h[v], l[v], j, keepMinLanes(k, j, v, W));
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+        _mm512_storeu_si512(hi + v * W, h[v]);
+        _mm512_storeu_si512(lo + v * W, l[v]);
+    }
+}
+
+// Битоническое слияние двух отсортированных регистров: в x - младшие W ключей, в y - старшие
+AVX512_TARGET inline void mergeRegisters(__m512i& xh, __m512i& xl, __m512i& yh, __m512i& yl) {
+    const __m512i reverse = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    yh = _mm512_permutex2var_epi64(yh, reverse, yh);
+    yl = _mm512_permutex2var_epi64(yl, reverse, yl);
+    exchange(xh, xl, yh, yl, false);
+    for (unsigned j = W / 2; j >= 1; j /= 2) {
+        exchangeLanes(xh, xl, j, lowerLanes(j, W));
+        exchangeLanes(yh, yl, j, lowerLanes(j, W));
+    }
+}
+
+AVX512_TARGET size_t mergeVectors(MergeCursor& a, MergeCursor& b, uint64_t* outHi, uint64_t* outLo,
+                                  uint64_t* pendingHi, uint64_t* pendingLo) {
+    __m512i xh = _mm512_loadu_si512(a.hi + a.pos), xl = _mm512_loadu_si512(a.lo + a.pos);
+    __m512i yh = _mm512_loadu_si512(b.hi + b.pos), yl = _mm512_loadu_si512(b.lo + b.pos);
+    a.pos += W;
+    b.pos += W;
+    size_t out = 0;
+    while (true) {
+        mergeRegisters(xh, xl, yh, yl);
+        _mm512_storeu_si512(outHi + out, xh);
+        _mm512_storeu_si512(outLo + out, xl);
+        out += W;
+        xh = yh;
+        xl = yl;
+        MergeCursor& next = a.left() > 0 && (b.left() == 0 || headLess(a, b)) ? a : b;
+        if (next.left() < W) break;
+        yh = _mm512_loadu_si512(next.hi + next.pos);
+        yl = _mm512_loadu_si512(next.lo + next.pos);
+        next.pos += W;
+    }
+    _mm512_storeu_si512(pendingHi, xh);
+    _mm512_storeu_si512(pendingLo, xl);
+    return out;
+}
+
+const VectorSortKernels kernels = {"AVX-512", W, sortBlock, mergeVectors};
+
+} // namespace avx512
+
+namespace avx2 {
+
+const size_t W = 4;
+const size_t BLOCK_VECTORS = VECTOR_BLOCK_KEYS / W;
+
+// Беззнаковых 64-битных сравнений в AVX2 нет: знаковое сравнение после инверсии старшего бита
+AVX2_TARGET inline __m256i greater(__m256i ah, __m256i al, __m256i bh, __m256i bl) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    __m256i hiGt = _mm256_cmpgt_epi64(_mm256_xor_si256(ah, sign), _mm256_xor_si256(bh, sign));
+    __m256i hiEq = _mm256_cmpeq_epi64(ah, bh);
+    __m256i loGt = _mm256_cmpgt_epi64(_mm256_xor_si256(al, sign), _mm256_xor_si256(bl, sign));
+    return _mm256_or_si256(hiGt, _mm256_and_si256(hiEq, loGt));
+}
+
+AVX2_TARGET inline __m256i load(const uint64_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2_TARGET inline void store(uint64_t* p, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+
+AVX2_TARGET inline __m256i laneMask(unsigned bits) {
+    return _mm256_set_epi64x(-int64_t((bits >> 3) & 1), -int64_t((bits >> 2) & 1),
+                             -int64_t((bits >> 1) & 1), -int64_t(bits & 1));
+}
+
+AVX2_TARGET inline __m256i partnerLanes(__m256i v, unsigned j) {
+    return j == 1 ? _mm256_permute4x64_epi64(v, 0xB1) : _mm256_permute4x64_epi64(v, 0x4E);
+}
+
+AVX2_TARGET inline void exchange(__m256i& ah, __m256i& al, __m256i& bh, __m256i& bl, bool descending) {
+    __m256i swap = descending ? greater(bh, bl, ah, al) : greater(ah, al, bh, bl);
+    __m256i th = _mm256_blendv_epi8(ah, bh, swap);
+    __m256i tl = _mm256_blendv_epi8(al, bl, swap);
+    bh = _mm256_blendv_epi8(bh, ah, swap);
+    bl = _mm256_blendv_epi8(bl, al, swap);
+    ah = th;
+    al = tl;
+}
+
+AVX2_TARGET inline void exchangeLanes(__m256i& h, __m256i& l, unsigned j, __m256i keepMin) {
+    __m256i ph = partnerLanes(h, j);
+    __m256i pl = partnerLanes(l, j);
+    __m256i take = _mm256_or_si256(_mm256_and_si256(keepMin, greater(h, l, ph, pl)),
+                                   _mm256_andnot_si256(keepMin, greater(ph, pl, h, l)));
+    h = _mm256_blendv_epi8(h, ph, take);
+    l = _mm256_blendv_epi8(l, pl, take);
+}
+
+AVX2_TARGET void sortBlock(uint64_t* hi, uint64_t* lo) {
+    __m256i h[BLOCK_VECTORS], l[BLOCK_VECTORS];
+    for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+        h[v] = load(hi + v * W);
+        l[v] = load(lo + v * W);
+    }
+    for (unsigned k = 2; k <= VECTOR_BLOCK_KEYS; k *= 2) {
+        for (unsigned j = k / 2; j >= 1; j /= 2) {
+            if (j >= W) {
+                for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+                    size_t u = v + j / W;
+                    if (v & (j / W)) continue;
+                    exchange(h[v], l[v], h[u], l[u], ((v * W) & k) != 0);
+                }
+            } else {
+                for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+                    exchangeLanes(h[v], l[v], j, laneMask(keepMinLanes(k, j, v, W)));
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < BLOCK_VECTORS; ++v) {
+        store(hi + v * W, h[v]);
+        store(lo + v * W, l[v]);
+    }
+}
+
+AVX2_TARGET inline void mergeRegisters(__m256i& xh, __m256i& xl, __m256i& yh, __m256i& yl) {
+    yh = _mm256_permute4x64_epi64(yh, 0x1B);
+    yl = _mm256_permute4x64_epi64(yl, 0x1B);
+    exchange(xh, xl, yh, yl, false);
+    for (unsigned j = W / 2; j >= 1; j /= 2) {
+        __m256i lower = laneMask(lowerLanes(j, W));
+        exchangeLanes(xh, xl, j, lower);
+        exchangeLanes(yh, yl, j, lower);
+    }
+}
+
+AVX2_TARGET size_t mergeVectors(MergeCursor& a, MergeCursor& b, uint64_t* outHi, uint64_t* outLo,
+                                uint64_t* pendingHi, uint64_t* pendingLo) {
+    __m256i xh = load(a.hi + a.pos), xl = load(a.lo + a.pos);
+    __m256i yh = load(b.hi + b.pos), yl = load(b.lo + b.pos);
+    a.pos += W;
+    b.pos += W;
+    size_t out = 0;
+    while (true) {
+        mergeRegisters(xh, xl, yh, yl);
+        store(outHi + out, xh);
+        store(outLo + out, xl);
+        out += W;
+        xh = yh;
+        xl = yl;
+        MergeCursor& next = a.left() > 0 && (b.left() == 0 || headLess(a, b)) ? a : b;
+        if (next.left() < W) break;
+        yh = load(next.hi + next.pos);
+        yl = load(next.lo + next.pos);
+        next.pos += W;
+    }
+    store(pendingHi, xh);
+    store(pendingLo, xl);
+    return out;
+}
+
+const VectorSortKernels kernels = {"AVX2", W, sortBlock, mergeVectors};
+
+} // namespace avx2
+#endif
+
+const VectorSortKernels* detectVectorSortKernels() {
+#if HAVE_VECTOR_SORT
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return &avx512::kernels;
+    if (__builtin_cpu_supports("avx2")) return &avx2::kernels;
+#endif
+    return nullptr;
+}
+
+// nullptr, если процессор не поддерживает ни AVX-512, ни AVX2
+const VectorSortKernels* vectorSortKernels() {
+    static const VectorSortKernels* kernels = detectVectorSortKernels();
+    return kernels;
+}
+
+// Слияние двух серий в out. Векторное ядро работает, пока в серии с меньшей головой есть целый регистр;
+// все выведенное им не больше оставшегося, поэтому остаток (удержанный регистр и хвосты серий)
+// досливается поштучно.
+void mergeRuns(const VectorSortKernels& kernels, MergeCursor a, MergeCursor b, uint64_t* outHi, uint64_t* outLo) {
+    uint64_t pendingHi[VECTOR_MAX_LANES], pendingLo[VECTOR_MAX_LANES];
+    MergeCursor pending{pendingHi, pendingLo, 0, 0};
+    size_t out = 0;
+    if (a.left() >= kernels.lanes && b.left() >= kernels.lanes) {
+        out = kernels.mergeVectors(a, b, outHi, outLo, pendingHi, pendingLo);
+        pending.size = kernels.lanes;
+    }
+
+    MergeCursor* runs[3] = {&pending, &a, &b};
+    while (true) {
+        MergeCursor* best = nullptr;
+        size_t nonEmpty = 0;
+        for (MergeCursor* run : runs) {
+            if (run->left() == 0) continue;
+            nonEmpty++;
+            if (!best || headLess(*run, *best)) best = run;
+        }
+        if (!best) break;
+        if (nonEmpty == 1) {
+            std::memcpy(outHi + out, best->hi + best->pos, best->left() * sizeof(uint64_t));
+            std::memcpy(outLo + out, best->lo + best->pos, best->left() * sizeof(uint64_t));
+            break;
+        }
+        outHi[out] = best->hi[best->pos];
+        outLo[out] = best->lo[best->pos];
+        out++;
+        best->pos++;
+    }
+}
+
+// Векторная сортировка count ключей; scratch - не меньше count ключей. Сначала ключи раскладываются
+// по блокам на половины в scratch, после этого и сам массив keys служит вторым буфером слияний.
+void vectorSort(const VectorSortKernels& kernels, uint128_t* keys, size_t count, uint128_t* scratch) {
+    uint64_t* bufHi[2] = {reinterpret_cast<uint64_t*>(scratch), reinterpret_cast<uint64_t*>(keys)};
+    uint64_t* bufLo[2] = {bufHi[0] + count, bufHi[1] + count};
+
+    for (size_t begin = 0; begin < count; begin += VECTOR_BLOCK_KEYS) {
+        size_t n = std::min(VECTOR_BLOCK_KEYS, count - begin);
+        // Неполный блок дополняется наибольшими ключами, которые после сортировки оказываются в конце
+        uint64_t hi[VECTOR_BLOCK_KEYS], lo[VECTOR_BLOCK_KEYS];
+        for (size_t i = 0; i < VECTOR_BLOCK_KEYS; ++i) {
+            hi[i] = i < n ? keys[begin + i].hi : UINT64_MAX;
+            lo[i] = i < n ? keys[begin + i].lo : UINT64_MAX;
+        }
+        kernels.sortBlock(hi, lo);
+        std::memcpy(bufHi[0] + begin, hi, n * sizeof(uint64_t));
+        std::memcpy(bufLo[0] + begin, lo, n * sizeof(uint64_t));
+    }
+
+    size_t src = 0;
+    for (size_t width = VECTOR_BLOCK_KEYS; width < count; width *= 2) {
+        for (size_t begin = 0; begin < count; begin += 2 * width) {
+            size_t mid = std::min(begin + width, count);
+            size_t end = std::min(begin + 2 * width, count);
+            MergeCursor a{bufHi[src] + begin, bufLo[src] + begin, mid - begin, 0};
+            MergeCursor b{bufHi[src] + mid, bufLo[src] + mid, end - mid, 0};
+            mergeRuns(kernels, a, b, bufHi[1 - src] + begin, bufLo[1 - src] + begin);
+        }
+        src = 1 - src;
+    }
+
+    if (src == 0) {
+        for (size_t i = 0; i < count; ++i) keys[i] = uint128_t{bufHi[0][i], bufLo[0][i]};
+    } else {
+        // Результат лежит в самом keys в виде половин: собираем ключи через scratch
+        for (size_t i = 0; i < count; ++i) scratch[i] = uint128_t{bufHi[1][i], bufLo[1][i]};
+        std::memcpy(static_cast<void*>(keys), scratch, count * sizeof(uint128_t));
+    }
+}
+
+// Сортировка count ключей ядром kernel; векторному нужен scratch не меньше count ключей.
+// Без AVX2 и на коротких массивах остается std::sort.
+void sortKeys(SortKernel kernel, uint128_t* keys, size_t count, uint128_t* scratch) {
+    const VectorSortKernels* kernels = vectorSortKernels();
+    if (kernel == SORT_KERNEL_VECTOR && kernels && count > VECTOR_BLOCK_KEYS) {
+        vectorSort(*kernels, keys, count, scratch);
+    } else {
+        std::sort(keys, keys + count);
+    }
+}
+
+// --- КОНТЕЙНЕРЫ ROARING ДЛЯ ПЛОТНЫХ ДИАПАЗОНОВ ---
+
+// Ключи с общими старшими 112 битами (префикс /112) различаются только младшими 16 битами, и их множество
+// хранится одним контейнером, как в Roaring bitmaps: массивом значений, битовой картой на 65536 бит
+// или списком отрезков подряд идущих значений. Плотный диапазон (ферма серверов, сканер, обходящий /112)
+// занимает тогда не больше 8 КБ на префикс вместо 16 байт на адрес.
+enum ContainerKind : uint32_t {
+    CONTAINER_ARRAY,  // uint16_t[cardinality] по возрастанию
+    CONTAINER_BITMAP, // uint64_t[1024]
+    CONTAINER_RUNS    // Пары uint16_t (начало, длина - 1) по возрастанию
+};
+
+const size_t ROARING_BITMAP_WORDS = 65536 / 64;
+const size_t ROARING_BITMAP_BYTES = ROARING_BITMAP_WORDS * sizeof(uint64_t);
+const size_t ROARING_ARRAY_MAX = 4096; // Больший массив занял бы больше битовой карты
+const size_t ROARING_SORT_BY_BITMAP_MIN = 128;
+
+inline uint128_t prefix112(const uint128_t& key) {
+    return uint128_t{key.hi, key.lo & ~uint64_t(0xFFFF)};
+}
+
+inline uint16_t low16(const uint128_t& key) {
+    return static_cast<uint16_t>(key.lo);
+}
+
+// Самый компактный вид контейнера для отсортированных различных ключей одного префикса
+struct ContainerShape {
+    ContainerKind kind;
+    uint32_t entries; // Значений массива или отрезков; у битовой карты - число ключей
+    uint64_t bytes;
+};
+
+ContainerShape containerShape(const uint128_t* keys, size_t count) {
+    uint32_t runs = 1;
+    for (size_t i = 1; i < count; ++i) runs += low16(keys[i]) != uint16_t(low16(keys[i - 1]) + 1);
+    uint64_t arrayBytes = count * sizeof(uint16_t);
+    uint64_t runBytes = runs * 2 * sizeof(uint16_t);
+    if (runBytes < std::min<uint64_t>(arrayBytes, ROARING_BITMAP_BYTES)) return {CONTAINER_RUNS, runs, runBytes};
+    if (arrayBytes <= ROARING_BITMAP_BYTES) return {CONTAINER_ARRAY, uint32_t(count), arrayBytes};
+    return {CONTAINER_BITMAP, uint32_t(count), ROARING_BITMAP_BYTES};
+}
+
+// out - shape.bytes байт, для битовой карты выровненных по 8 и заполненных нулями
+void encodeContainer(const uint128_t* keys, size_t count, const ContainerShape& shape, char* out) {
+    if (shape.kind == CONTAINER_BITMAP) {
+        uint64_t* bits = reinterpret_cast<uint64_t*>(out);
+        for (size_t i = 0; i < count; ++i) bits[low16(keys[i]) >> 6] |= uint64_t(1) << (low16(keys[i]) & 63);
+        return;
+    }
+    uint16_t* values = reinterpret_cast<uint16_t*>(out);
+    if (shape.kind == CONTAINER_ARRAY) {
+        for (size_t i = 0; i < count; ++i) values[i] = low16(keys[i]);
+        return;
+    }
+    size_t r = 0;
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && low16(keys[j]) == uint16_t(low16(keys[j - 1]) + 1)) j++;
+        values[2 * r] = low16(keys[i]);
+        values[2 * r + 1] = static_cast<uint16_t>(j - i - 1);
+        r++;
+        i = j;
+    }
+}
+
+bool containerContains(ContainerKind kind, uint32_t entries, const char* data, uint16_t value) {
+    if (kind == CONTAINER_BITMAP) {
+        return (reinterpret_cast<const uint64_t*>(data)[value >> 6] >> (value & 63)) & 1;
+    }
+    const uint16_t* values = reinterpret_cast<const uint16_t*>(data);
+    if (kind == CONTAINER_ARRAY) return std::binary_search(values, values + entries, value);
+    // Последний отрезок, начинающийся не позже value
+    size_t lo = 0, hi = entries;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (values[2 * mid] <= value) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 && value - values[2 * (lo - 1)] <= values[2 * (lo - 1) + 1];
+}
+
+// Номера групп ключей по общему префиксу в порядке появления: открытая адресация, заполнение
+// не больше половины. Соседние ключи бакета часто из одной группы, поэтому прошлая группа проверяется первой.
+class GroupIndex {
+    std::vector<uint128_t> prefixes;
+    std::vector<uint32_t> table; // Номер группы + 1, 0 - пусто
+    size_t last = SIZE_MAX;
+
+    void place(size_t g) {
+        const size_t mask = table.size() - 1;
+        size_t pos = hashKey(prefixes[g]) & mask;
+        while (table[pos] != 0) pos = (pos + 1) & mask;
+        table[pos] = uint32_t(g + 1);
+    }
+
+public:
+    // Новый префикс получает номер size()
+    size_t find(const uint128_t& prefix) {
+        if (last != SIZE_MAX && prefixes[last] == prefix) return last;
+        if (2 * (prefixes.size() + 1) > table.size()) {
+            table.assign(std::max<size_t>(64, 2 * table.size()), 0);
+            for (size_t g = 0; g < prefixes.size(); ++g) place(g);
+        }
+        const size_t mask = table.size() - 1;
+        for (size_t pos = hashKey(prefix) & mask;; pos = (pos + 1) & mask) {
+            uint32_t g = table[pos];
+            if (g == 0) {
+                prefixes.push_back(prefix);
+                table[pos] = uint32_t(prefixes.size());
+                return last = prefixes.size() - 1;
+            }
+            if (prefixes[g - 1] == prefix) return last = g - 1;
+        }
+    }
+
+    size_t size() const { return prefixes.size(); }
+    const uint128_t& prefix(size_t g) const { return prefixes[g]; }
+};
+
+// Множество ключей в контейнерах по префиксам /112 для подсчета в памяти. Массив сначала только
+// дописывается, с повторами; заполнившись, он сортируется без повторов и, если различных осталось
+// больше половины ROARING_ARRAY_MAX, становится битовой картой. Отрезки нужны только на диске:
+// в памяти множество живет один бакет.
+class RoaringSet {
+    struct Container {
+        std::vector<uint16_t> values;
+        std::unique_ptr<uint64_t[]> bits; // nullptr - контейнер еще массив
+        uint32_t distinct = 0;            // Ключей битовой карты
+    };
+
+    GroupIndex prefixes;
+    std::vector<Container> containers; // По номерам префиксов
+    size_t bitmaps = 0;
+
+    // Сотни и тысячи значений дешевле отсортировать без повторов через битовую карту:
+    // проход по значениям и по 1024 словам карты вместо std::sort
+    static void sortUnique(std::vector<uint16_t>& values) {
+        if (values.size() < ROARING_SORT_BY_BITMAP_MIN) {
+            std::sort(values.begin(), values.end());
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+            return;
+        }
+        thread_local std::vector<uint64_t> bits(ROARING_BITMAP_WORDS, 0);
+        for (uint16_t v : values) bits[v >> 6] |= uint64_t(1) << (v & 63);
+        size_t n = 0;
+        for (size_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+            for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+                values[n++] = static_cast<uint16_t>(w * 64 + __builtin_ctzll(word));
+            }
+            bits[w] = 0;
+        }
+        values.resize(n);
+    }
+
+    void compact(Container& c) {
+        sortUnique(c.values);
+        if (c.values.size() <= ROARING_ARRAY_MAX / 2) return;
+        c.bits.reset(new uint64_t[ROARING_BITMAP_WORDS]());
+        for (uint16_t v : c.values) c.bits[v >> 6] |= uint64_t(1) << (v & 63);
+        c.distinct = uint32_t(c.values.size());
+        std::vector<uint16_t>().swap(c.values);
+        bitmaps++;
+    }
+
+public:
+    void add(const uint128_t& key) {
+        size_t g = prefixes.find(prefix112(key));
+        if (g == containers.size()) containers.emplace_back();
+        Container& c = containers[g];
+        uint16_t v = low16(key);
+        if (c.bits) {
+            uint64_t& word = c.bits[v >> 6];
+            uint64_t bit = uint64_t(1) << (v & 63);
+            c.distinct += (word & bit) == 0;
+            word |= bit;
+            return;
+        }
+        c.values.push_back(v);
+        if (c.values.size() >= ROARING_ARRAY_MAX) compact(c);
+    }
+
+    void addBatch(const uint128_t* keys, size_t count) {
+        for (size_t i = 0; i < count; ++i) add(keys[i]);
+    }
+
+    // Массивы при этом сортируются без повторов
+    uint64_t countDistinct() {
+        uint64_t distinct = 0;
+        for (Container& c : containers) {
+            if (!c.bits) sortUnique(c.values);
+            distinct += c.bits ? c.distinct : c.values.size();
+        }
+        return distinct;
+    }
+
+    size_t size() const { return containers.size(); }
+    size_t bitmapCount() const { return bitmaps; }
+};
+
+// Бакет плотный, если на префикс /112 в среднем приходится хотя бы столько различных ключей. Памяти
+// контейнеры экономят и на меньших группах, но в замерах при десятках ключей на префикс промахи
+// по контейнерам делают подсчет втрое медленнее одной хэш-таблицы, а с сотни ключей - не медленнее.
+const double ROARING_MIN_KEYS_PER_PREFIX = 64;
+
+// --- ИНДЕКС РАЗЛИЧНЫХ АДРЕСОВ ---
+
+// Файл индекса: заголовок, каталог участков, ключи и контейнеры. Участок - ключи с одинаковыми старшими
+// directoryBits битами; каталог хранит номер первого ключа каждого участка и в конце - общее число.
+// Внутри участка из n ключей ключ с номером k (с 1) - корень поддерева, слева от него ключ 2k, справа 2k+1.
+// Префиксы /112, на которые пришлось не меньше INDEX_CONTAINER_MIN_KEYS адресов, хранятся не ключами,
+// а контейнерами Roaring: префиксы одним деревом Эйтцингера, за ними в том же порядке ссылки на данные.
+// Числа записаны в порядке байт машины, построившей индекс.
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t directoryBits;
+    uint64_t keys;             // Адресов в массиве ключей
+    uint64_t directoryOffset;  // uint64_t[2^directoryBits + 1]
+    uint64_t keysOffset;       // uint128_t[keys], выровнено по строке кэша
+    uint64_t containers;
+    uint64_t containersOffset; // uint128_t[containers], затем IndexContainer[containers]; выровнено по строке кэша
+    uint64_t containerKeys;    // Адресов в контейнерах
+    uint64_t dataOffset;       // Данные контейнеров до конца файла
+};
+
+struct IndexContainer {
+    uint64_t offset;  // От dataOffset, кратно 8
+    uint32_t kind;    // ContainerKind
+    uint32_t entries; // См. ContainerShape
+};
+
+const char INDEX_MAGIC[8] = {'I', 'P', '6', 'I', 'N', 'D', 'E', 'X'};
+const uint32_t INDEX_VERSION = 2;
+const uint64_t INDEX_CONTAINER_MIN_KEYS = 16; // Контейнер тогда хотя бы вчетверо меньше ключей
+const uint64_t INDEX_SLOT_KEYS = 64;          // Ключей на участок в среднем
+const unsigned INDEX_MAX_DIRECTORY_BITS = 24; // Каталог не больше 128 МБ
+const uint64_t INDEX_ALIGN = 64;
+const uint64_t INDEX_TASK_MIN_KEYS = 1 << 20; // Меньше ключей на задачу раскладки не дается
+const size_t LOOKUP_GROUP = 16;               // Поисков, которые идут вперемешку
+
+// Участков столько, чтобы на каждый в среднем приходилось около INDEX_SLOT_KEYS ключей
+unsigned indexDirectoryBits(uint64_t keys) {
+    unsigned bits = 1;
+    while (bits < INDEX_MAX_DIRECTORY_BITS && (keys >> (bits + 1)) >= INDEX_SLOT_KEYS) bits++;
+    return bits;
+}
+
+// Файл, целиком отображенный в память
+class MappedFile {
+    char* base = nullptr;
+    size_t length = 0;
+
+public:
+    MappedFile(int fd, size_t length, bool writable) {
+        if (length == 0) return;
+        void* p = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw std::runtime_error("Could not map a file into memory");
+        base = static_cast<char*>(p);
+        this->length = length;
+    }
+
+    ~MappedFile() {
+        if (base) munmap(base, length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+// Отображенный индекс, по которому идет поиск
+struct IndexView {
+    const uint64_t* directory;
+    const uint128_t* keys;
+    unsigned shift; // 64 - directoryBits
+    const uint128_t* prefixes;
+    const IndexContainer* containers;
+    uint64_t containerCount;
+    const char* data;
+    uint64_t dataBytes;
+};
+
+// Обход дерева Эйтцингера из n узлов по порядку ключей: от самого левого узла к следующему справа
+inline uint64_t eytzingerFirst(uint64_t n) {
+    uint64_t k = 1;
+    while (2 * k <= n) k *= 2;
+    return k;
+}
+
+inline uint64_t eytzingerNext(uint64_t k, uint64_t n) {
+    if (2 * k + 1 <= n) {
+        k = 2 * k + 1;
+        while (2 * k <= n) k *= 2;
+        return k;
+    }
+    while (k & 1) k >>= 1;
+    return k >> 1;
+}
+
+// Поиск в участке: спуск от корня k = 1 к 2k, если ключ узла не меньше искомого, иначе к 2k+1, пока k <= n.
+// Младшие единичные биты вышедшего за участок k - повороты направо после последнего поворота налево;
+// сдвиг на них и еще на один бит дает узел с наименьшим ключом не меньше искомого (0 - такого нет).
+inline uint64_t eytzingerLowerBound(uint64_t k) {
+    return k >> (__builtin_ctzll(~k) + 1);
+}
+
+// Начала и размеры участков для группы запросов: сначала подгружаются строки каталога, потом корни участков
+inline void locateSlots(const IndexView& index, const uint128_t* queries, size_t count, uint64_t* base,
+                        uint64_t* n) {
+    for (size_t j = 0; j < count; ++j) __builtin_prefetch(index.directory + (queries[j].hi >> index.shift));
+    for (size_t j = 0; j < count; ++j) {
+        const uint64_t* slot = index.directory + (queries[j].hi >> index.shift);
+        base[j] = slot[0];
+        n[j] = slot[1] - slot[0];
+        __builtin_prefetch(index.keys + base[j]);
+    }
+}
+
+inline size_t finishSearches(const IndexView& index, const uint128_t* queries, size_t count, const uint64_t* base,
+                             const uint64_t* k, uint8_t* found) {
+    size_t hits = 0;
+    for (size_t j = 0; j < count; ++j) {
+        uint64_t node = eytzingerLowerBound(k[j]);
+        found[j] = node != 0 && index.keys[base[j] + node - 1] == queries[j];
+        hits += found[j];
+    }
+    return hits;
+}
+
+// Группа до LOOKUP_GROUP поисков спускается по уровню за шаг; каждый шаг подгружает внуков узла,
+// которые понадобятся через шаг (четыре ключа по 16 байт - одна строка кэша)
+size_t searchGroupScalar(const IndexView& index, const uint128_t* queries, size_t count, uint8_t* found) {
+    uint64_t base[LOOKUP_GROUP], n[LOOKUP_GROUP], k[LOOKUP_GROUP];
+    locateSlots(index, queries, count, base, n);
+    for (size_t j = 0; j < count; ++j) k[j] = 1;
+    for (bool active = true; active;) {
+        active = false;
+        for (size_t j = 0; j < count; ++j) {
+            if (k[j] > n[j]) continue;
+            k[j] = 2 * k[j] + (index.keys[base[j] + k[j] - 1] < queries[j]);
+            __builtin_prefetch(index.keys + base[j] + 4 * k[j] - 1);
+            active = true;
+        }
+    }
+    return finishSearches(index, queries, count, base, k, found);
+}
+
+#if HAVE_VECTOR_SORT
+namespace avx2 {
+
+// Те же шаги по четыре поиска в регистре: половины ключей узлов собираются выборками (gather) из
+// массива ключей как из uint64_t[], сравнение без знака - знаковое после сдвига на 2^63
+AVX2_TARGET size_t searchGroup(const IndexView& index, const uint128_t* queries, size_t count, uint8_t* found) {
+    const size_t W = 4;
+    const size_t V = LOOKUP_GROUP / W;
+    alignas(32) uint64_t base[LOOKUP_GROUP], n[LOOKUP_GROUP], k[LOOKUP_GROUP], qh[LOOKUP_GROUP], ql[LOOKUP_GROUP];
+    locateSlots(index, queries, count, base, n);
+    const uint64_t flip = uint64_t(1) << 63;
+    for (size_t j = 0; j < LOOKUP_GROUP; ++j) {
+        // Пустые места группы - поиски в пустом участке
+        if (j >= count) base[j] = n[j] = 0;
+        qh[j] = j < count ? queries[j].hi ^ flip : 0;
+        ql[j] = j < count ? queries[j].lo ^ flip : 0;
+    }
+
+    const long long* halves = reinterpret_cast<const long long*>(index.keys);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(flip));
+    __m256i vk[V], vlimit[V], vfirst[V], vqh[V], vql[V];
+    for (size_t v = 0; v < V; ++v) {
+        vk[v] = one;
+        vlimit[v] = _mm256_add_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(n + v * W)), one);
+        // Старшая половина узла k - элемент 2 * (base + k - 1) массива половин
+        __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(base + v * W));
+        vfirst[v] = _mm256_sub_epi64(_mm256_add_epi64(b, b), _mm256_add_epi64(one, one));
+        vqh[v] = _mm256_load_si256(reinterpret_cast<const __m256i*>(qh + v * W));
+        vql[v] = _mm256_load_si256(reinterpret_cast<const __m256i*>(ql + v * W));
+    }
+    for (bool active = true; active;) {
+        active = false;
+        for (size_t v = 0; v < V; ++v) {
+            __m256i live = _mm256_cmpgt_epi64(vlimit[v], vk[v]);
+            if (_mm256_testz_si256(live, live)) continue;
+            active = true;
+            __m256i at = _mm256_add_epi64(vfirst[v], _mm256_add_epi64(vk[v], vk[v]));
+            __m256i h = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), halves, at, live, 8);
+            __m256i l = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), halves, _mm256_add_epi64(at, one), live, 8);
+            h = _mm256_xor_si256(h, sign);
+            l = _mm256_xor_si256(l, sign);
+            __m256i less = _mm256_or_si256(_mm256_cmpgt_epi64(vqh[v], h),
+                                           _mm256_and_si256(_mm256_cmpeq_epi64(vqh[v], h), _mm256_cmpgt_epi64(vql[v], l)));
+            // less - это -1 в дорожках, где ключ узла меньше искомого: 2k - less = 2k + 1
+            __m256i next = _mm256_sub_epi64(_mm256_add_epi64(vk[v], vk[v]), less);
+            vk[v] = _mm256_blendv_epi8(vk[v], next, live);
+        }
+    }
+    for (size_t v = 0; v < V; ++v) _mm256_store_si256(reinterpret_cast<__m256i*>(k + v * W), vk[v]);
+    return finishSearches(index, queries, count, base, k, found);
+}
+
+} // namespace avx2
+#endif
+
+struct IndexSearchKernel {
+    const char* name;
+    size_t (*searchGroup)(const IndexView& index, const uint128_t* queries, size_t count, uint8_t* found);
+};
+
+const IndexSearchKernel* detectIndexSearchKernel() {
+    static const IndexSearchKernel scalar = {"scalar, interleaved", searchGroupScalar};
+#if HAVE_VECTOR_SORT
+    static const IndexSearchKernel vector = {"AVX2 gathers", avx2::searchGroup};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &vector;
+#endif
+    return &scalar;
+}
+
+const IndexSearchKernel& indexSearchKernel() {
+    static const IndexSearchKernel* kernel = detectIndexSearchKernel();
+    return *kernel;
+}
+
+uint64_t containerBytes(ContainerKind kind, uint32_t entries) {
+    if (kind == CONTAINER_BITMAP) return ROARING_BITMAP_BYTES;
+    return uint64_t(entries) * (kind == CONTAINER_RUNS ? 2 : 1) * sizeof(uint16_t);
+}
+
+// Адрес, не найденный среди ключей, ищется в контейнере своего префикса /112
+bool containerSearch(const IndexView& index, const uint128_t& query) {
+    uint128_t prefix = prefix112(query);
+    uint64_t k = 1;
+    while (k <= index.containerCount) k = 2 * k + (index.prefixes[k - 1] < prefix);
+    uint64_t node = eytzingerLowerBound(k);
+    if (node == 0 || !(index.prefixes[node - 1] == prefix)) return false;
+    const IndexContainer& c = index.containers[node - 1];
+    if (c.kind > CONTAINER_RUNS || c.offset > index.dataBytes ||
+        containerBytes(ContainerKind(c.kind), c.entries) > index.dataBytes - c.offset) {
+        throw std::runtime_error("Address index is damaged");
+    }
+    return containerContains(ContainerKind(c.kind), c.entries, index.data + c.offset, low16(query));
+}
+
+// Индекс строится по ходу фазы 2: каждый бакет (или подбакет) отдает свои различные ключи отсортированным
+// прогоном во временный файл. Бакеты делят ключи по старшим битам, поэтому прогоны не пересекаются,
+// и после фазы 2 индекс собирается из них по порядку параллельными проходами: первый находит плотные
+// префиксы /112, второй считает размеры участков каталога по остальным ключам, третий раскладывает участки
+// в порядке Эйтцингера и кодирует контейнеры прямо в отображенный файл.
+class IndexBuilder {
+    struct Run {
+        uint128_t first;
+        uint64_t offset; // В файле прогонов, байт
+        uint64_t keys;
+    };
+
+    // Плотный префикс прогона: ключи [pos, pos + keys) уходят в контейнер
+    struct DenseGroup {
+        uint64_t pos;
+        uint64_t keys;
+        ContainerShape shape;
+        uint64_t dataOffset = 0;
+    };
+
+    std::string runsName;
+    int fd = -1;
+    std::atomic<uint64_t> reserved{0};
+    std::mutex lock;
+    std::vector<Run> runs;
+    std::vector<std::vector<DenseGroup>> dense; // По прогонам
+
+    std::string indexPath;
+    uint64_t indexKeys = 0;
+    uint64_t containerKeys = 0;
+    uint64_t kindCount[CONTAINER_RUNS + 1] = {};
+    unsigned directoryBits = 0;
+    uint64_t indexBytes = 0;
+    double seconds = 0;
+
+    // Участки [from, to) раскладываются по порядку прогонов, минуя плотные группы;
+    // starts - номер первого ключа массива у каждого прогона
+    void layoutSlots(const uint128_t* source, const std::vector<uint64_t>& starts, const uint64_t* directory,
+                     uint128_t* keys, size_t from, size_t to) const {
+        if (directory[from] == directory[to]) return;
+        size_t r = std::upper_bound(starts.begin(), starts.end(), directory[from]) - starts.begin() - 1;
+        uint64_t pos = directory[from] - starts[r];
+        size_t d = 0;
+        while (d < dense[r].size() && dense[r][d].pos <= pos) pos += dense[r][d++].keys;
+        for (size_t s = from; s < to; ++s) {
+            uint64_t n = directory[s + 1] - directory[s];
+            if (n == 0) continue;
+            uint64_t k = eytzingerFirst(n);
+            for (uint64_t i = 0; i < n; ++i) {
+                while (true) {
+                    if (pos == runs[r].keys) {
+                        r++;
+                        pos = 0;
+                        d = 0;
+                    } else if (d < dense[r].size() && pos == dense[r][d].pos) {
+                        pos += dense[r][d++].keys;
+                    } else {
+                        break;
+                    }
+                }
+                keys[directory[s] + k - 1] = source[runs[r].offset / sizeof(uint128_t) + pos++];
+                k = eytzingerNext(k, n);
+            }
+        }
+    }
+
+public:
+    explicit IndexBuilder(const std::string& tempPrefix) : runsName(tempPrefix + "index.bin") {
+        fd = open(runsName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Could not open temp file " + runsName);
+    }
+
+    ~IndexBuilder() {
+        close(fd);
+        std::remove(runsName.c_str());
+    }
+
+    IndexBuilder(const IndexBuilder&) = delete;
+    IndexBuilder& operator=(const IndexBuilder&) = delete;
+
+    int runsFd() const { return fd; }
+
+    // Смещение в файле прогонов для count ключей
+    uint64_t reserve(size_t count) {
+        return reserved.fetch_add(count * sizeof(uint128_t));
+    }
+
+    // По смещению offset записан прогон из count отсортированных различных ключей, first - наименьший из них
+    void addRun(const uint128_t& first, uint64_t offset, size_t count) {
+        if (count == 0) return;
+        std::lock_guard<std::mutex> guard(lock);
+        runs.push_back(Run{first, offset, count});
+    }
+
+    void addRun(const uint128_t* keys, size_t count) {
+        if (count == 0) return;
+        uint64_t offset = reserve(count);
+        writeFully(fd, keys, count * sizeof(uint128_t), offset);
+        addRun(keys[0], offset, count);
+    }
+
+    // Вызывать после фазы 2. Индекс пишется во временный файл рядом с path и переименовывается,
+    // поэтому читатели прежнего индекса по этому пути не увидят недописанного.
+    void write(const std::string& path, ThreadPool& pool) {
+        auto start = std::chrono::steady_clock::now();
+        std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.first < b.first; });
+        indexPath = path;
+        MappedFile runsFile(fd, reserved.load(), false);
+        const uint128_t* source = reinterpret_cast<const uint128_t*>(runsFile.data());
+
+        // Проход 1: плотные префиксы. Префикс /112 не делится между бакетами, так что и между прогонами.
+        TaskGroup group;
+        dense.assign(runs.size(), std::vector<DenseGroup>());
+        for (size_t r = 0; r < runs.size(); ++r) {
+            pool.submit(group, [this, source, r]() {
+                const uint128_t* p = source + runs[r].offset / sizeof(uint128_t);
+                for (uint64_t i = 0; i < runs[r].keys;) {
+                    uint128_t prefix = prefix112(p[i]);
+                    uint64_t j = i + 1;
+                    while (j < runs[r].keys && prefix112(p[j]) == prefix) j++;
+                    if (j - i >= INDEX_CONTAINER_MIN_KEYS) dense[r].push_back({i, j - i, containerShape(p + i, j - i)});
+                    i = j;
+                }
+            });
+        }
+        pool.wait(group);
+
+        // Данные контейнеров по порядку префиксов, каждый с границы 8 байт
+        std::vector<uint64_t> starts(runs.size() + 1, 0);
+        std::vector<uint64_t> firstContainer(runs.size() + 1, 0);
+        uint64_t dataBytes = 0;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            uint64_t inContainers = 0;
+            for (DenseGroup& g : dense[r]) {
+                g.dataOffset = dataBytes;
+                dataBytes += (g.shape.bytes + 7) / 8 * 8;
+                inContainers += g.keys;
+                kindCount[g.shape.kind]++;
+            }
+            starts[r + 1] = starts[r] + runs[r].keys - inContainers;
+            firstContainer[r + 1] = firstContainer[r] + dense[r].size();
+            containerKeys += inContainers;
+        }
+        indexKeys = starts.back();
+        uint64_t containers = firstContainer.back();
+        directoryBits = indexDirectoryBits(indexKeys);
+        size_t slots = size_t(1) << directoryBits;
+        auto aligned = [](uint64_t offset) { return (offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN; };
+        uint64_t directoryOffset = sizeof(IndexHeader);
+        uint64_t keysOffset = aligned(directoryOffset + (slots + 1) * sizeof(uint64_t));
+        uint64_t containersOffset = aligned(keysOffset + indexKeys * sizeof(uint128_t));
+        uint64_t dataOffset = aligned(containersOffset + containers * (sizeof(uint128_t) + sizeof(IndexContainer)));
+        indexBytes = dataOffset + dataBytes;
+
+        // Место каждого контейнера в дереве префиксов
+        std::vector<uint64_t> node(containers);
+        for (uint64_t c = 0, k = eytzingerFirst(containers); c < containers; ++c, k = eytzingerNext(k, containers)) {
+            node[c] = k - 1;
+        }
+
+        std::string tmpName = path + ".tmp";
+        int out = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) throw std::runtime_error("Could not write index " + path);
+        try {
+            if (ftruncate(out, indexBytes) != 0) throw std::runtime_error("Could not write index " + path);
+            MappedFile target(out, indexBytes, true);
+            uint64_t* directory = reinterpret_cast<uint64_t*>(target.data() + directoryOffset);
+            uint128_t* keys = reinterpret_cast<uint128_t*>(target.data() + keysOffset);
+            uint128_t* prefixes = reinterpret_cast<uint128_t*>(target.data() + containersOffset);
+            IndexContainer* refs = reinterpret_cast<IndexContainer*>(prefixes + containers);
+            char* data = target.data() + dataOffset;
+            unsigned shift = 64 - directoryBits;
+
+            // Проход 2: размеры участков. Один участок могут делить только соседние прогоны,
+            // так что атомарные сложения почти не сталкиваются. Новый файл заполнен нулями.
+            for (size_t r = 0; r < runs.size(); ++r) {
+                pool.submit(group, [this, source, directory, shift, r]() {
+                    const uint128_t* p = source + runs[r].offset / sizeof(uint128_t);
+                    const std::vector<DenseGroup>& skip = dense[r];
+                    size_t d = 0;
+                    for (uint64_t i = 0; i < runs[r].keys;) {
+                        if (d < skip.size() && i == skip[d].pos) {
+                            i += skip[d++].keys;
+                            continue;
+                        }
+                        uint64_t end = d < skip.size() ? skip[d].pos : runs[r].keys;
+                        uint64_t slot = p[i].hi >> shift;
+                        uint64_t j = i + 1;
+                        while (j < end && (p[j].hi >> shift) == slot) j++;
+                        __atomic_fetch_add(&directory[slot + 1], j - i, __ATOMIC_RELAXED);
+                        i = j;
+                    }
+                });
+            }
+            pool.wait(group);
+            for (size_t s = 0; s < slots; ++s) directory[s + 1] += directory[s];
+
+            // Проход 3: задачи берут подряд идущие участки примерно поровну по ключам,
+            // контейнеры кодируются задачами по прогонам
+            size_t nTasks = std::min<uint64_t>(4 * pool.size(), indexKeys / INDEX_TASK_MIN_KEYS + 1);
+            size_t from = 0;
+            for (size_t t = 1; t <= nTasks; ++t) {
+                size_t to = t == nTasks ? slots
+                                        : std::lower_bound(directory, directory + slots, indexKeys * t / nTasks) - directory;
+                if (to <= from) continue;
+                pool.submit(group, [this, source, &starts, directory, keys, from, to]() {
+                    layoutSlots(source, starts, directory, keys, from, to);
+                });
+                from = to;
+            }
+            for (size_t r = 0; r < runs.size(); ++r) {
+                if (dense[r].empty()) continue;
+                pool.submit(group, [this, source, &firstContainer, &node, prefixes, refs, data, r]() {
+                    const uint128_t* p = source + runs[r].offset / sizeof(uint128_t);
+                    for (size_t i = 0; i < dense[r].size(); ++i) {
+                        const DenseGroup& g = dense[r][i];
+                        uint64_t at = node[firstContainer[r] + i];
+                        encodeContainer(p + g.pos, g.keys, g.shape, data + g.dataOffset);
+                        prefixes[at] = prefix112(p[g.pos]);
+                        refs[at] = IndexContainer{g.dataOffset, g.shape.kind, g.shape.entries};
+                    }
+                });
+            }
+            pool.wait(group);
+
+            IndexHeader header = {};
+            std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+            header.version = INDEX_VERSION;
+            header.directoryBits = directoryBits;
+            header.keys = indexKeys;
+            header.directoryOffset = directoryOffset;
+            header.keysOffset = keysOffset;
+            header.containers = containers;
+            header.containersOffset = containersOffset;
+            header.containerKeys = containerKeys;
+            header.dataOffset = dataOffset;
+            std::memcpy(target.data(), &header, sizeof(header));
+        } catch (...) {
+            close(out);
+            std::remove(tmpName.c_str());
+            throw;
+        }
+        close(out);
+        if (std::rename(tmpName.c_str(), path.c_str()) != 0) {
+            std::remove(tmpName.c_str());
+            throw std::runtime_error("Could not write index " + path);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void printStats(std::ostream& out) const {
+        out << "Index: " << indexKeys + containerKeys << " address(es), " << indexKeys << " in "
+            << (size_t(1) << directoryBits) << " directory slot(s) and " << containerKeys << " in "
+            << kindCount[CONTAINER_ARRAY] << " array, " << kindCount[CONTAINER_BITMAP] << " bitmap and "
+            << kindCount[CONTAINER_RUNS] << " run container(s) for dense /112 prefixes; " << std::fixed
+            << std::setprecision(1) << indexBytes / (1024.0 * 1024.0) << " MB written to " << indexPath << " in "
+            << std::setprecision(3) << seconds << " s" << std::endl;
+    }
+};
+
+// --- ОБРАБОТКА БАКЕТОВ ---
+
+// Рабочая область потока фазы 2. Память не инициализируется и только растет,
+// поэтому следующий бакет того же потока не платит за malloc, обнуление и page fault.
+class BucketArena {
+    struct Region {
+        uint128_t* data = nullptr;
+        size_t capacity = 0;
+    };
+
+    CounterContext& ctx;
+    Region keys;
+    Region scratch; // Вспомогательный буфер того же размера для сортировок, которым нужна копия
+
+    uint128_t* reserve(Region& r, size_t count) {
+        if (count > r.capacity) {
+            // Запас в полтора раза, чтобы не перевыделять память на почти одинаковых бакетах
+            size_t capacity = std::max(count, r.capacity + r.capacity / 2);
+            ctx.memory.release(r.data, r.capacity * sizeof(uint128_t));
+            ctx.arenaBytes -= r.capacity * sizeof(uint128_t);
+            r.data = nullptr;
+            r.capacity = 0;
+            r.data = static_cast<uint128_t*>(ctx.memory.allocate(capacity * sizeof(uint128_t)));
+            r.capacity = capacity;
+            ctx.arenaBytes += r.capacity * sizeof(uint128_t);
+        }
+        return r.data;
+    }
+
+public:
+    explicit BucketArena(CounterContext& ctx) : ctx(ctx) {}
+    BucketArena(const BucketArena&) = delete;
+    BucketArena& operator=(const BucketArena&) = delete;
+
+    ~BucketArena() {
+        ctx.memory.release(keys.data, keys.capacity * sizeof(uint128_t));
+        ctx.memory.release(scratch.data, scratch.capacity * sizeof(uint128_t));
+    }
+
+    // Содержимое прошлого бакета не сохраняется
+    uint128_t* keysFor(size_t count) { return reserve(keys, count); }
+    uint128_t* scratchFor(size_t count) { return reserve(scratch, count); }
+};
+
+// Свободные рабочие области каждого потока пула. Задача бакета берет область на время обработки:
+// если поток, ожидая вложенные задачи, начнет другой бакет, тот получит отдельную область.
+class ArenaPool {
+    CounterContext& ctx;
+    std::vector<std::vector<std::unique_ptr<BucketArena>>> idle;
+
+public:
+    ArenaPool(CounterContext& ctx, size_t nWorkers) : ctx(ctx), idle(nWorkers) {}
+
+    // Вызывать из потока пула с номером worker
+    std::unique_ptr<BucketArena> acquire(size_t worker) {
+        if (idle[worker].empty()) return std::unique_ptr<BucketArena>(new BucketArena(ctx));
+        std::unique_ptr<BucketArena> arena = std::move(idle[worker].back());
+        idle[worker].pop_back();
+        return arena;
+    }
+
+    void release(size_t worker, std::unique_ptr<BucketArena> arena) {
+        idle[worker].push_back(std::move(arena));
+    }
+};
+
+// Бакеты больше этого размера (в элементах) сортируются несколькими задачами пула
+const size_t PARALLEL_SORT_MIN = 1 << 20;
+
+// Части сортируются отдельными задачами, затем попарно сливаются, поочередно используя keys и scratch.
+// Возвращает указатель на отсортированные данные (keys или scratch).
+uint128_t* parallelSort(SortKernel kernel, uint128_t* keys, uint128_t* scratch, size_t count, ThreadPool& pool) {
+    size_t parts = 1;
+    while (parts < pool.size() * 2 && count / (parts * 2) >= PARALLEL_SORT_MIN / 4) parts *= 2;
+
+    std::vector<size_t> bounds(parts + 1);
+    for (size_t i = 0; i <= parts; ++i) bounds[i] = count * i / parts;
+
+    TaskGroup group;
+    for (size_t i = 0; i < parts; ++i) {
+        size_t lo = bounds[i], hi = bounds[i + 1];
+        pool.submit(group, [kernel, keys, scratch, lo, hi]() { sortKeys(kernel, keys + lo, hi - lo, scratch + lo); });
+    }
+    pool.wait(group);
+
+    uint128_t* src = keys;
+    uint128_t* dst = scratch;
+    for (size_t width = 1; width < parts; width *= 2) {
+        for (size_t i = 0; i < parts; i += 2 * width) {
+            size_t lo = bounds[i];
+            size_t mid = bounds[std::min(i + width, parts)];
+            size_t hi = bounds[std::min(i + 2 * width, parts)];
+            pool.submit(group, [src, dst, lo, mid, hi]() {
+                std::merge(src + lo, src + mid, src + mid, src + hi, dst + lo);
+            });
+        }
+        pool.wait(group);
+        std::swap(src, dst);
+    }
+    return src;
+}
+
+// --- ДВИЖКИ ПОДСЧЕТА УНИКАЛЬНЫХ В БАКЕТЕ ---
+
+// Способ подсчета различных ключей загруженного бакета. Движок может переставлять ключи в keys;
+// дополнительную память он берет из рабочей области потока. Сам движок состояния не хранит:
+// настройки и статистика - в контексте счетчика.
+class DedupEngine {
+public:
+    virtual ~DedupEngine() = default;
+    virtual const char* name() const = 0;
+    virtual size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile& profile,
+                               BucketArena& arena, ThreadPool& pool) const = 0;
+};
+
+// Число различных ключей в отсортированном массиве
+size_t countDistinctSorted(const uint128_t* keys, size_t count) {
+    if (count == 0) return 0;
+    size_t distinct = 1;
+    for (size_t i = 1; i < count; ++i) {
+        distinct += !(keys[i] == keys[i - 1]);
+    }
+    return distinct;
+}
+
+// Сортировка сравнениями (ядро задает --sort), для крупных бакетов - параллельная сортировка слиянием
+class SortEngine : public DedupEngine {
+public:
+    const char* name() const override { return "sort"; }
+
+    size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile&,
+                       BucketArena& arena, ThreadPool& pool) const override {
+        if (count >= PARALLEL_SORT_MIN && pool.size() > 1) {
+            keys = parallelSort(ctx.sortKernel, keys, arena.scratchFor(count), count, pool);
+        } else {
+            sortKeys(ctx.sortKernel, keys, count, arena.scratchFor(count));
+        }
+        return countDistinctSorted(keys, count);
+    }
+};
+
+// Крошечные бакеты: сеть Бэтчера на NETWORK_MAX_KEYS входов без ветвлений,
+// недостающие входы заполняются наибольшим ключом и оказываются в конце
+const size_t NETWORK_MAX_KEYS = 16;
+
+inline void compareExchange(uint128_t& a, uint128_t& b) {
+    bool swap = b < a;
+    uint128_t lo = swap ? b : a;
+    uint128_t hi = swap ? a : b;
+    a = lo;
+    b = hi;
+}
+
+class NetworkEngine : public DedupEngine {
+    std::vector<std::pair<uint8_t, uint8_t>> comparators;
+
+public:
+    // Компараторы сети строятся один раз
+    NetworkEngine() {
+        const size_t N = NETWORK_MAX_KEYS;
+        for (size_t p = 1; p < N; p *= 2) {
+            for (size_t k = p; k >= 1; k /= 2) {
+                for (size_t j = k % p; j + k < N; j += 2 * k) {
+                    for (size_t i = 0; i < k && i + j + k < N; ++i) {
+                        if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) comparators.emplace_back(i + j, i + j + k);
+                    }
+                }
+            }
+        }
+    }
+
+    const char* name() const override { return "network"; }
+
+    size_t countUnique(CounterContext&, uint128_t* keys, size_t count, const BucketProfile&,
+                       BucketArena&, ThreadPool&) const override {
+        uint128_t v[NETWORK_MAX_KEYS];
+        for (size_t i = 0; i < NETWORK_MAX_KEYS; ++i) v[i] = i < count ? keys[i] : uint128_t{UINT64_MAX, UINT64_MAX};
+        for (const auto& c : comparators) compareExchange(v[c.first], v[c.second]);
+        return countDistinctSorted(v, count);
+    }
+};
+
+// Биты ключа начиная с shift (младшие 64 бита сдвинутого 128-битного значения)
+inline uint64_t keyBitsFrom(const uint128_t& key, unsigned shift) {
+    if (shift == 0) return key.lo;
+    if (shift < 64) return (key.lo >> shift) | (key.hi << (64 - shift));
+    return key.hi >> (shift - 64);
+}
+
+// Группы раскладки: группа g занимает out[begin[g], end[g]). Начало каждой группы выровнено
+// на кэш-линию, поэтому между группами остаются неиспользуемые промежутки.
+struct KeyGroups {
+    std::vector<size_t> begin;
+    std::vector<size_t> end;
+    size_t keys = 0;
+
+    size_t size() const { return begin.size(); }
+};
+
+// Сколько ключей должен вмещать out для раскладки count ключей на 2^digitBits групп
+inline size_t scatteredSize(size_t count, unsigned digitBits) {
+    return count + (size_t(1) << digitBits) * StagingLine::KEYS;
+}
+
+// Раскладка ключей в out по 2^digitBits группам. Разряд - digitBits бит сразу за fixedBits старшими битами,
+// общими для всего бакета (при 256 бакетах - второй и третий байты адреса). Одинаковые ключи
+// попадают в одну группу. Ключи копятся в слотах-линиях групп и уходят в out целыми линиями
+// потоковыми записями, как в BucketWriter: раскладка - один проход записи, который не читает out в кэш
+// и не вытесняет из него слоты. out должен быть выровнен на кэш-линию.
+KeyGroups scatterByDigit(const uint128_t* keys, uint128_t* out, size_t count, unsigned fixedBits, unsigned digitBits) {
+    const size_t groups = size_t(1) << digitBits;
+    const size_t LINE = StagingLine::KEYS;
+    const unsigned shift = 128 - fixedBits - digitBits;
+    const uint64_t mask = groups - 1;
+
+    KeyGroups result;
+    result.keys = count;
+    result.begin.assign(groups, 0);
+    result.end.assign(groups, 0);
+    for (size_t i = 0; i < count; ++i) result.end[keyBitsFrom(keys[i], shift) & mask]++;
+    size_t offset = 0;
+    for (size_t g = 0; g < groups; ++g) {
+        result.begin[g] = offset;
+        offset += (result.end[g] + LINE - 1) / LINE * LINE;
+    }
+
+    std::vector<size_t> pos(result.begin);
+    std::unique_ptr<StagingLine[]> staging(new StagingLine[groups]);
+    std::vector<uint8_t> staged(groups, 0);
+    for (size_t i = 0; i < count; ++i) {
+        size_t g = keyBitsFrom(keys[i], shift) & mask;
+        staging[g].keys[staged[g]] = keys[i];
+        if (++staged[g] == LINE) {
+            streamLine(out + pos[g], staging[g]);
+            pos[g] += LINE;
+            staged[g] = 0;
+        }
+    }
+    // Неполные линии дописываются обычными записями в свой промежуток
+    for (size_t g = 0; g < groups; ++g) {
+        for (size_t j = 0; j < staged[g]; ++j) out[pos[g] + j] = staging[g].keys[j];
+        result.end[g] = pos[g] + staged[g];
+    }
+    streamFence();
+    return result;
+}
+
+// Сумма countGroup(begin, end) по всем группам; у крупных бакетов группы делят задачи пула
+template <typename F>
+size_t sumOverGroups(const KeyGroups& groups, ThreadPool& pool, F countGroup) {
+    size_t n = groups.size();
+    if (groups.keys < PARALLEL_SORT_MIN || pool.size() == 1) {
+        size_t total = 0;
+        for (size_t g = 0; g < n; ++g) total += countGroup(groups.begin[g], groups.end[g]);
+        return total;
+    }
+
+    std::atomic<size_t> total{0};
+    size_t tasks = std::min(n, pool.size() * 4);
+    TaskGroup group;
+    for (size_t t = 0; t < tasks; ++t) {
+        size_t first = n * t / tasks, last = n * (t + 1) / tasks;
+        pool.submit(group, [&, first, last]() {
+            size_t local = 0;
+            for (size_t g = first; g < last; ++g) local += countGroup(groups.begin[g], groups.end[g]);
+            total += local;
+        });
+    }
+    pool.wait(group);
+    return total;
+}
+
+// Поразрядная раскладка по битам за префиксом бакета, затем сортировка небольших групп
+const unsigned RADIX_DIGIT_BITS = 11;
+const size_t RADIX_MIN_KEYS = 64 * 1024; // На меньших бакетах раскладка не окупается
+
+class RadixEngine : public DedupEngine {
+public:
+    const char* name() const override { return "radix"; }
+
+    size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile& profile,
+                       BucketArena& arena, ThreadPool& pool) const override {
+        uint128_t* sorted = arena.scratchFor(scatteredSize(count, RADIX_DIGIT_BITS));
+        KeyGroups groups = scatterByDigit(keys, sorted, count, profile.fixedBits, RADIX_DIGIT_BITS);
+        SortKernel kernel = ctx.sortKernel;
+        return sumOverGroups(groups, pool, [sorted, kernel](size_t begin, size_t end) {
+            // Буфер векторной сортировки свой у каждого потока и только растет
+            thread_local std::vector<uint128_t> scratch;
+            if (scratch.size() < end - begin) scratch.resize(end - begin);
+            sortKeys(kernel, sorted + begin, end - begin, scratch.data());
+            return countDistinctSorted(sorted + begin, end - begin);
+        });
+    }
+};
+
+// Подсчет различных ключей открытой адресацией в table из capacity ячеек (степень двойки).
+// Пустая ячейка - нулевой ключ, сам нулевой ключ учитывается отдельно.
+// Возвращает SIZE_MAX, если таблица заполнилась больше чем на 3/4.
+size_t countWithHashTable(const uint128_t* keys, size_t count, uint128_t* table, size_t capacity) {
+    std::memset(static_cast<void*>(table), 0, capacity * sizeof(uint128_t));
+    const size_t mask = capacity - 1;
+    const size_t limit = capacity / 4 * 3;
+    size_t distinct = 0;
+    bool zero = false;
+    for (size_t i = 0; i < count; ++i) {
+        const uint128_t& key = keys[i];
+        if ((key.hi | key.lo) == 0) {
+            zero = true;
+            continue;
+        }
+        size_t pos = hashKey(key) & mask;
+        while (true) {
+            uint128_t& slot = table[pos];
+            if ((slot.hi | slot.lo) == 0) {
+                slot = key;
+                if (++distinct > limit) return SIZE_MAX;
+                break;
+            }
+            if (slot == key) break;
+            pos = (pos + 1) & mask;
+        }
+    }
+    return distinct + zero;
+}
+
+// Размер таблицы под expected различных ключей при заполнении не больше половины
+size_t hashCapacityFor(size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2) capacity *= 2;
+    return capacity;
+}
+
+// Сколько различных ключей ждать среди count по оценке фазы 1 (с запасом на ошибку скетча)
+size_t expectedDistinct(size_t count, const BucketProfile& profile) {
+    return std::min<size_t>(count, profile.distinctRatio * count * 1.25 + 64);
+}
+
+// Одна хэш-таблица на весь бакет: выгодна при большой доле повторов, пока таблица помещается в кэш
+class HashEngine : public DedupEngine {
+public:
+    const char* name() const override { return "hash"; }
+
+    size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile& profile,
+                       BucketArena& arena, ThreadPool& pool) const override {
+        size_t capacity = hashCapacityFor(expectedDistinct(count, profile));
+        size_t distinct = countWithHashTable(keys, count, arena.scratchFor(capacity), capacity);
+        if (distinct != SIZE_MAX) return distinct;
+        // Бакет, где хэш-таблица переполнилась из-за заниженной оценки, приходится сортировать
+        ctx.hashFallbacks++;
+        return SortEngine().countUnique(ctx, keys, count, profile, arena, pool);
+    }
+};
+
+// Бакет одним потоковым проходом раскладывается на группы, таблица каждой из которых
+// помещается в половину L2, и каждая группа считается своей небольшой хэш-таблицей.
+// Вставка тогда стоит обращения к L2, а не промаха в память, как у одной таблицы на весь бакет.
+// Групп не больше 4096: их слоты раскладки (256 КБ) тоже должны оставаться в L2.
+const unsigned HASH_MAX_DIGIT_BITS = 12;
+
+// Сколько ключей бакета с такой долей различных дать одной группе
+size_t hashChunkKeys(double distinctRatio) {
+    // Таблица заполнена не больше чем наполовину и округлена до степени двойки: до 4 ячеек на ключ
+    size_t distinctPerChunk = l2CacheBytes() / 2 / (4 * sizeof(uint128_t));
+    return distinctPerChunk / std::max(distinctRatio, 1.0 / 64);
+}
+
+class PartitionedHashEngine : public DedupEngine {
+public:
+    const char* name() const override { return "partitioned-hash"; }
+
+    size_t countUnique(CounterContext&, uint128_t* keys, size_t count, const BucketProfile& profile,
+                       BucketArena& arena, ThreadPool& pool) const override {
+        size_t chunkKeys = hashChunkKeys(profile.distinctRatio);
+        unsigned digitBits = 0;
+        while (digitBits < HASH_MAX_DIGIT_BITS && (count >> digitBits) > chunkKeys) digitBits++;
+        uint128_t* grouped = arena.scratchFor(scatteredSize(count, digitBits));
+        KeyGroups groups = scatterByDigit(keys, grouped, count, profile.fixedBits, digitBits);
+        return sumOverGroups(groups, pool, [grouped, &profile](size_t begin, size_t end) {
+            // Таблица своя у каждого потока и только растет
+            thread_local std::vector<uint128_t> table;
+            size_t n = end - begin;
+            size_t capacity = hashCapacityFor(expectedDistinct(n, profile));
+            if (table.size() < capacity) table.resize(capacity);
+            size_t distinct = countWithHashTable(grouped + begin, n, table.data(), capacity);
+            if (distinct == SIZE_MAX) {
+                capacity = hashCapacityFor(n);
+                if (table.size() < capacity) table.resize(capacity);
+                distinct = countWithHashTable(grouped + begin, n, table.data(), capacity);
+            }
+            return distinct;
+        });
+    }
+};
+
+// Ключи собираются в контейнеры по префиксам /112 (RoaringSet): бакету нужно не больше 8 КБ на префикс
+// вместо копии ключей, а вставка - сравнение с префиксом прошлого ключа и запись в массив или бит карты
+class RoaringEngine : public DedupEngine {
+public:
+    const char* name() const override { return "roaring"; }
+
+    size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile&, BucketArena&,
+                       ThreadPool&) const override {
+        RoaringSet set;
+        set.addBatch(keys, count);
+        ctx.roaringContainers += set.size();
+        ctx.roaringBitmaps += set.bitmapCount();
+        return set.countDistinct();
+    }
+};
+
+// Раскладка младших половин ключей в столбец по группам старших половин: сначала все ключи проходят
+// через count, чтобы узнать размеры групп, затем через place, который дает место младшей половины
+class HiColumns {
+    GroupIndex his;
+    std::vector<size_t> next; // Размеры групп, после groups() - места следующих младших половин
+
+public:
+    // Номер группы
+    size_t count(uint64_t hi) {
+        size_t g = his.find(uint128_t{hi, 0});
+        if (g == next.size()) next.push_back(0);
+        next[g]++;
+        return g;
+    }
+
+    // Границы групп в столбце
+    KeyGroups groups() {
+        KeyGroups groups;
+        size_t at = 0;
+        for (size_t& n : next) {
+            groups.begin.push_back(at);
+            at += n;
+            groups.end.push_back(at);
+            n = groups.begin.back();
+        }
+        groups.keys = at;
+        return groups;
+    }
+
+    size_t place(uint64_t hi) { return placeInGroup(his.find(uint128_t{hi, 0})); }
+    size_t placeInGroup(size_t g) { return next[g]++; }
+};
+
+// Поразрядная сортировка на месте от старшего байта (American flag sort): подсчет байтов, перестановка
+// циклами по корзинам и рекурсия в корзины. Без копии столбца она в замерах вдвое быстрее std::sort
+// на случайных 64-битных значениях; корзины меньше COLUMN_RADIX_MIN досортировываются std::sort.
+const size_t COLUMN_RADIX_MIN = 256;
+
+void sortColumn(uint64_t* values, size_t n, int shift = 56) {
+    if (n < COLUMN_RADIX_MIN || shift < 0) {
+        std::sort(values, values + n);
+        return;
+    }
+    size_t counts[256] = {};
+    for (size_t i = 0; i < n; ++i) counts[(values[i] >> shift) & 255]++;
+    size_t next[256], end[256];
+    for (size_t b = 0, at = 0; b < 256; ++b) {
+        next[b] = at;
+        at += counts[b];
+        end[b] = at;
+    }
+    for (size_t b = 0; b < 256; ++b) {
+        while (next[b] < end[b]) {
+            uint64_t v = values[next[b]];
+            size_t d = (v >> shift) & 255;
+            while (d != b) {
+                std::swap(v, values[next[d]++]);
+                d = (v >> shift) & 255;
+            }
+            values[next[b]++] = v;
+        }
+    }
+    for (size_t b = 0, at = 0; b < 256; at += counts[b++]) {
+        if (counts[b] > 1) sortColumn(values + at, counts[b], shift - 8);
+    }
+}
+
+size_t countDistinctColumns(const KeyGroups& groups, uint64_t* column, ThreadPool& pool) {
+    return sumOverGroups(groups, pool, [column](size_t begin, size_t end) {
+        sortColumn(column + begin, end - begin);
+        return size_t(std::unique(column + begin, column + end) - (column + begin));
+    });
+}
+
+// Ключи группируются по старшей половине (обычно сеть /64), а младшие половины каждой группы лежат
+// подряд в столбце uint64_t и сортируются отдельно: 8-байтовые ключи небольшими группами вместо
+// 16-байтовых во всем бакете, а столбец вдвое меньше копии ключей
+class ColumnarEngine : public DedupEngine {
+public:
+    const char* name() const override { return "columnar"; }
+
+    size_t countUnique(CounterContext& ctx, uint128_t* keys, size_t count, const BucketProfile&, BucketArena& arena,
+                       ThreadPool& pool) const override {
+        // Старшая половина загруженного ключа больше не нужна: на ее месте запоминается номер группы,
+        // и второй проход обходится без поиска в таблице
+        HiColumns columns;
+        for (size_t i = 0; i < count; ++i) keys[i].hi = columns.count(keys[i].hi);
+        KeyGroups groups = columns.groups();
+        uint64_t* column = reinterpret_cast<uint64_t*>(arena.scratchFor((count + 1) / 2));
+        for (size_t i = 0; i < count; ++i) column[columns.placeInGroup(keys[i].hi)] = keys[i].lo;
+        ctx.columnarGroups += groups.size();
+        return countDistinctColumns(groups, column, pool);
+    }
+};
+
+const DedupEngine& dedupEngine(EngineKind kind) {
+    static const NetworkEngine network;
+    static const SortEngine sort;
+    static const RadixEngine radix;
+    static const HashEngine hash;
+    static const PartitionedHashEngine partitionedHash;
+    static const RoaringEngine roaring;
+    static const ColumnarEngine columnar;
+    static const DedupEngine* const engines[ENGINE_COUNT] = {&network, &sort, &radix, &hash, &partitionedHash,
+                                                             &roaring, &columnar};
+    return *engines[kind];
+}
+
+// Наибольшая хэш-таблица на весь бакет. Пока таблица в пределах кэша, один проход по ключам
+// быстрее любой сортировки (в замерах - в 3-6 раз даже без повторов); большей таблице
+// каждая вставка стоит промаха в память, и выгоднее сначала разложить бакет на группы.
+const size_t HASH_TABLE_MAX_BYTES = 8 * 1024 * 1024;
+
+// Ключей на старшую половину, начиная с которых бакет, не помещающийся в одну хэш-таблицу, считается
+// движком columnar. В замерах на 8 млн ключей он с сотен ключей на /64 не медленнее partitioned-hash,
+// а при 80 ключах на /64 медленнее на 40%; памяти ему нужно в разы меньше (столбец - 8 байт на ключ).
+const double COLUMNAR_MIN_KEYS_PER_HI = 256;
+const size_t PREFIX_SAMPLE_KEYS = 4096;
+
+void samplePrefixes(const uint128_t* sample, size_t n, BucketProfile& profile) {
+    if (n < 2) return;
+    uint128_t prefixes[PREFIX_SAMPLE_KEYS];
+    for (size_t i = 0; i < n; ++i) prefixes[i] = prefix112(sample[i]);
+    profile.prefixes112 = estimatePrefixes(prefixes, n);
+    for (size_t i = 0; i < n; ++i) prefixes[i] = uint128_t{sample[i].hi, 0};
+    profile.prefixes64 = estimatePrefixes(prefixes, n);
+}
+
+// Размер таблицы зависит от оценки числа различных ключей: при частых повторах
+// одна таблица годится и для бакетов, во много раз больших кэша.
+// Плотным бакетам достаются контейнеры roaring, большим бакетам из немногих сетей /64 - столбцы columnar.
+// Сортировки остаются для явного выбора через --engine (forced не ENGINE_AUTO).
+EngineKind chooseEngine(EngineKind forced, const BucketProfile& profile) {
+    size_t count = profile.keys;
+    if (forced != ENGINE_AUTO) {
+        return forced == ENGINE_NETWORK && count > NETWORK_MAX_KEYS ? ENGINE_SORT : forced;
+    }
+    if (count <= NETWORK_MAX_KEYS) return ENGINE_NETWORK;
+    double distinct = profile.distinctRatio * count;
+    if (distinct >= ROARING_MIN_KEYS_PER_PREFIX * profile.prefixes112) return ENGINE_ROARING;
+    size_t tableBytes = hashCapacityFor(expectedDistinct(count, profile)) * sizeof(uint128_t);
+    if (tableBytes <= HASH_TABLE_MAX_BYTES) return ENGINE_HASH;
+    return count >= COLUMNAR_MIN_KEYS_PER_HI * profile.prefixes64 ? ENGINE_COLUMNAR : ENGINE_PARTITIONED_HASH;
+}
+
+// Для индекса нужны сами различные ключи по порядку, поэтому бакет всегда сортируется
+size_t indexUniqueKeys(CounterContext& ctx, uint128_t* keys, size_t count, BucketArena& arena, ThreadPool& pool) {
+    if (count >= PARALLEL_SORT_MIN && pool.size() > 1) {
+        keys = parallelSort(ctx.sortKernel, keys, arena.scratchFor(count), count, pool);
+    } else {
+        sortKeys(ctx.sortKernel, keys, count, arena.scratchFor(count));
+    }
+    count = std::unique(keys, keys + count) - keys;
+    ctx.index->addRun(keys, count);
+    return count;
+}
+
+void recordEngine(CounterContext& ctx, EngineKind kind, uint64_t keys, std::chrono::steady_clock::time_point start) {
+    EngineStats& stats = ctx.engineStats[kind];
+    stats.buckets++;
+    stats.keys += keys;
+    stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Подсчет уникальных значений загруженного бакета выбранным движком
+size_t countUniqueKeys(CounterContext& ctx, uint128_t* ips, BucketProfile profile, BucketArena& arena,
+                       ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    if (ctx.engine == ENGINE_AUTO && !ctx.index && profile.keys > NETWORK_MAX_KEYS) {
+        // Выборка ключей через равные промежутки
+        uint128_t sample[PREFIX_SAMPLE_KEYS];
+        size_t n = std::min<size_t>(profile.keys, PREFIX_SAMPLE_KEYS);
+        for (size_t i = 0; i < n; ++i) sample[i] = ips[profile.keys / n * i];
+        samplePrefixes(sample, n, profile);
+    }
+    EngineKind kind = ctx.index ? ENGINE_SORT : chooseEngine(ctx.engine, profile);
+    size_t unique = ctx.index ? indexUniqueKeys(ctx, ips, profile.keys, arena, pool)
+                              : dedupEngine(kind).countUnique(ctx, ips, profile.keys, profile, arena, pool);
+    recordEngine(ctx, kind, profile.keys, start);
+    return unique;
+}
+
+void printEngineStats(std::ostream& out, const CounterContext& ctx) {
+    out << "Dedup engines:";
+    const char* sep = " ";
+    for (size_t k = 0; k < ENGINE_COUNT; ++k) {
+        const EngineStats& stats = ctx.engineStats[k];
+        if (stats.buckets == 0) continue;
+        out << sep << dedupEngine(EngineKind(k)).name() << " " << stats.buckets.load() << " bucket(s) "
+            << stats.keys.load() << " key(s) " << std::fixed << std::setprecision(3)
+            << stats.nanoseconds.load() / 1e9 << " s";
+        sep = ", ";
+    }
+    if (ctx.hashFallbacks > 0) out << "; " << ctx.hashFallbacks.load() << " hash table(s) overflowed, sorted instead";
+    if (ctx.roaringContainers > 0) {
+        out << "; roaring " << ctx.roaringContainers.load() << " /112 container(s), " << ctx.roaringBitmaps.load()
+            << " as bitmaps";
+    }
+    if (ctx.columnarGroups > 0) out << "; columnar " << ctx.columnarGroups.load() << " /64 group(s)";
+    out << std::endl;
+    if (ctx.sortKernel == SORT_KERNEL_VECTOR) {
+        const VectorSortKernels* kernels = vectorSortKernels();
+        out << "Sort kernel: " << (kernels ? kernels->name : "std::sort (no AVX2 or AVX-512)") << std::endl;
+    }
+}
+
+// Функции бакетов фазы 2 возвращают число уникальных; временный файл бакета удаляет вызывающий,
+// когда посчитанное уже учтено (с контрольными точками - после записи манифеста).
+
+// Бакет больше этого размера (в элементах), доставшийся движку roaring или columnar, не загружается
+// целиком, а читается из файла блоками: roaring собирает контейнеры за один проход, columnar за два
+// (размеры групп, затем раскладка) и держит только столбец младших половин - половину размера бакета
+const size_t STREAM_MIN_KEYS = 1 << 20;
+const size_t STREAM_BLOCK_KEYS = 64 * 1024;
+const size_t STREAM_SAMPLES = 64; // Выборка для samplePrefixes - столько кусков через равные промежутки
+
+// Движок потокового подсчета бакета; ENGINE_AUTO - бакет загружается целиком
+EngineKind streamingEngine(CounterContext& ctx, std::ifstream& in, BucketProfile profile) {
+    if (ctx.index || profile.keys < STREAM_MIN_KEYS) return ENGINE_AUTO;
+    if (ctx.engine == ENGINE_AUTO) {
+        const size_t piece = PREFIX_SAMPLE_KEYS / STREAM_SAMPLES;
+        uint128_t sample[PREFIX_SAMPLE_KEYS];
+        for (size_t i = 0; i < STREAM_SAMPLES; ++i) {
+            in.seekg((profile.keys - piece) / STREAM_SAMPLES * i * sizeof(uint128_t));
+            in.read(reinterpret_cast<char*>(sample + i * piece), piece * sizeof(uint128_t));
+        }
+        if (!in) throw std::runtime_error("Could not read temp file");
+        samplePrefixes(sample, PREFIX_SAMPLE_KEYS, profile);
+    }
+    EngineKind kind = chooseEngine(ctx.engine, profile);
+    return kind == ENGINE_ROARING || kind == ENGINE_COLUMNAR ? kind : ENGINE_AUTO;
+}
+
+// Бакет из файла по блокам в block
+template <typename F>
+void forEachBlock(std::ifstream& in, size_t count, uint128_t* block, F consume) {
+    in.seekg(0);
+    for (size_t done = 0; done < count;) {
+        size_t n = std::min(count - done, STREAM_BLOCK_KEYS);
+        if (!in.read(reinterpret_cast<char*>(block), n * sizeof(uint128_t))) {
+            throw std::runtime_error("Could not read temp file");
+        }
+        consume(block, n);
+        done += n;
+    }
+}
+
+uint64_t countStreaming(CounterContext& ctx, EngineKind kind, std::ifstream& in, size_t count, BucketArena& arena,
+                        ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t unique;
+    if (kind == ENGINE_ROARING) {
+        RoaringSet set;
+        forEachBlock(in, count, arena.keysFor(STREAM_BLOCK_KEYS), [&](const uint128_t* keys, size_t n) {
+            set.addBatch(keys, n);
+        });
+        unique = set.countDistinct();
+        ctx.roaringContainers += set.size();
+        ctx.roaringBitmaps += set.bitmapCount();
+    } else {
+        HiColumns columns;
+        uint128_t* block = arena.scratchFor(STREAM_BLOCK_KEYS);
+        forEachBlock(in, count, block, [&](const uint128_t* keys, size_t n) {
+            for (size_t i = 0; i < n; ++i) columns.count(keys[i].hi);
+        });
+        KeyGroups groups = columns.groups();
+        uint64_t* column = reinterpret_cast<uint64_t*>(arena.keysFor((count + 1) / 2));
+        forEachBlock(in, count, block, [&](const uint128_t* keys, size_t n) {
+            for (size_t i = 0; i < n; ++i) column[columns.place(keys[i].hi)] = keys[i].lo;
+        });
+        unique = countDistinctColumns(groups, column, pool);
+        ctx.columnarGroups += groups.size();
+    }
+    recordEngine(ctx, kind, count, start);
+    return unique;
+}
+
+// Профиль нужен только для выбора движка: число ключей берется из размера файла
+uint64_t processBucket(CounterContext& ctx, const std::string& fname, BucketProfile profile, BucketArena& arena,
+                       ThreadPool& pool) {
+    std::ifstream infile(fname, std::ios::binary | std::ios::ate);
+    
+    if (!infile.is_open()) return 0;
+
+    std::streamsize size = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+
+    if (size == 0) return 0;
+
+    size_t count = size / sizeof(uint128_t);
+    profile.keys = count;
+    EngineKind streaming = streamingEngine(ctx, infile, profile);
+    if (streaming != ENGINE_AUTO) return countStreaming(ctx, streaming, infile, count, arena, pool);
+
+    uint128_t* ips = arena.keysFor(count);
+    infile.seekg(0, std::ios::beg);
+    infile.read(reinterpret_cast<char*>(ips), size);
+    infile.close();
+
+    return countUniqueKeys(ctx, ips, profile, arena, pool);
+}
+
+// Бакет, оставшийся в памяти после фазы 1: ввода-вывода нет, остается пустой временный файл
+uint64_t processMemoryBucket(CounterContext& ctx, BucketFiles& files, size_t bucket_idx, BucketArena& arena,
+                             ThreadPool& pool) {
+    BucketProfile profile = files.profile(bucket_idx);
+    if (profile.keys == 0) return 0;
+    uint128_t* ips = arena.keysFor(profile.keys);
+    files.takeFromMemory(bucket_idx, ips);
+    return countUniqueKeys(ctx, ips, profile, arena, pool);
+}
+
+// Второй уровень разбиения: крупный бакет потоково раскладывается по подбакетам
+// по следующим ctx.partition.subBits битам, затем подбакеты обрабатываются вложенными задачами.
+uint64_t splitAndProcessBucket(CounterContext& ctx, BucketFiles& files, size_t bucket_idx, BucketArena& arena,
+                               ArenaPool& arenas, ThreadPool& pool) {
+    const PartitionPlan& plan = ctx.partition;
+    std::string fname = files.fileName(bucket_idx);
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+
+    BucketFiles sub(ctx.memory, plan.subBuckets(), plan.bits + plan.subBits, files.subBucketPrefix(bucket_idx));
+    sub.openAll();
+    {
+        TaskGroup flushes;
+        BucketWriter writer(ctx, sub, pool, flushes);
+        const size_t READ_KEYS = 64 * 1024;
+        uint128_t* block = arena.keysFor(READ_KEYS);
+        dispatchBucketBits(plan.subBits, [&](auto bits) {
+            constexpr unsigned BITS = decltype(bits)::value;
+            const unsigned skip = plan.bits;
+            uint64_t offset = 0;
+            while (true) {
+                ssize_t got = pread(fd, block, READ_KEYS * sizeof(uint128_t), offset);
+                if (got <= 0) break;
+                size_t n = got / sizeof(uint128_t);
+                for (size_t i = 0; i < n; ++i) {
+                    writer.add(BucketIndex<BITS>::after(block[i], skip), block[i]);
+                }
+                offset += n * sizeof(uint128_t);
+            }
+        });
+        writer.flushAll();
+        pool.wait(flushes);
+    }
+    close(fd);
+    sub.closeAll();
+    ctx.splitBuckets++;
+
+    std::atomic<uint64_t> unique{0};
+    TaskGroup subTasks;
+    for (size_t s = 0; s < sub.count(); ++s) {
+        std::string subName = sub.fileName(s);
+        BucketProfile subProfile = sub.profile(s);
+        pool.submitOuter(subTasks, [&ctx, &arenas, &pool, &unique, subName, subProfile]() {
+            size_t worker = ThreadPool::currentWorker();
+            std::unique_ptr<BucketArena> subArena = arenas.acquire(worker);
+            unique += processBucket(ctx, subName, subProfile, *subArena, pool);
+            arenas.release(worker, std::move(subArena));
+            std::remove(subName.c_str());
+        });
+    }
+    pool.wait(subTasks);
+    return unique.load();
+}
+
+#if HAVE_COROUTINES
+// То же, что processBucket, но чтение файла не занимает поток пула. Запускать из потока пула:
+// корутина всегда продолжается в пуле, а рабочая область берется у текущего потока.
+// Семафор inFlight ограничивает число одновременно загруженных бакетов; число уникальных получает counted.
+AsyncTask processBucketAsync(CounterContext& ctx, std::string fname, BucketProfile profile, ArenaPool& arenas,
+                             ThreadPool& pool, IoService& io, AsyncSemaphore& inFlight,
+                             std::function<void(uint64_t)> counted) {
+    size_t count = profile.keys;
+    if (count == 0) {
+        counted(0);
+        co_return;
+    }
+
+    co_await inFlight.acquire();
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        inFlight.release();
+        counted(0);
+        co_return;
+    }
+
+    std::unique_ptr<BucketArena> arena = arenas.acquire(ThreadPool::currentWorker());
+    uint128_t* ips = arena->keysFor(count);
+    ssize_t got = co_await io.read(fd, ips, count * sizeof(uint128_t), 0);
+    close(fd);
+    if (got != (ssize_t)(count * sizeof(uint128_t))) {
+        inFlight.release();
+        throw std::runtime_error("Could not read temp file " + fname);
+    }
+
+    uint64_t unique = countUniqueKeys(ctx, ips, profile, *arena, pool);
+    arenas.release(ThreadPool::currentWorker(), std::move(arena));
+    inFlight.release();
+    counted(unique);
+}
+#endif
+
+
+// --- НАСТРОЙКИ СЧЕТЧИКА ---
+
+// По умолчанию бакетам фазы 1 отдается четверть физической памяти: остальное нужно фазе 2 и системе
+uint64_t defaultMemoryBudget() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || pageSize <= 0) return 0;
+    return uint64_t(pages) * pageSize / 4;
+}
+
+bool parseEngineName(const std::string& name, EngineKind& kind) {
+    if (name == "auto") {
+        kind = ENGINE_AUTO;
+        return true;
+    }
+    for (size_t k = 0; k < ENGINE_COUNT; ++k) {
+        if (name == dedupEngine(EngineKind(k)).name()) {
+            kind = EngineKind(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Число бакетов - степень двойки от 2^MIN_BUCKET_BITS до 2^MAX_BUCKET_BITS
+unsigned fanoutBits(unsigned fanout) {
+    unsigned bits = 0;
+    while (bits < 31 && (1u << bits) < fanout) bits++;
+    if ((1u << bits) != fanout || bits < MIN_BUCKET_BITS || bits > MAX_BUCKET_BITS) {
+        throw std::invalid_argument("Fan-out must be a power of two from " + std::to_string(1u << MIN_BUCKET_BITS) +
+                                    " to " + std::to_string(1u << MAX_BUCKET_BITS) + ", got " +
+                                    std::to_string(fanout));
+    }
+    return bits;
+}
+
+PartitionPlan partitionFor(const DistinctCounterOptions& opts) {
+    PartitionPlan plan;
+    if (opts.fanout) plan.bits = fanoutBits(*opts.fanout);
+    if (opts.subFanout && *opts.subFanout > 0) plan.subBits = fanoutBits(*opts.subFanout);
+    return plan;
+}
+
+size_t prefilterBytesFor(const DistinctCounterOptions& opts) {
+    size_t bytes = opts.prefilterBytes.value_or(0);
+    return bytes == DistinctCounterOptions::PREFILTER_DEFAULT ? l2CacheBytes() / 2 : bytes;
+}
+
+// Проверка настроек и перенос в контекст всего, что не зависит от входа
+void configureContext(const DistinctCounterOptions& options, CounterContext& ctx) {
+    if (!parseEngineName(options.engine, ctx.engine)) {
+        throw std::invalid_argument("Unknown dedup engine " + options.engine);
+    }
+    if (options.sortKernel == "std") {
+        ctx.sortKernel = SORT_KERNEL_STD;
+    } else if (options.sortKernel == "vector") {
+        ctx.sortKernel = SORT_KERNEL_VECTOR;
+    } else {
+        throw std::invalid_argument("Unknown sort kernel " + options.sortKernel);
+    }
+#if !HAVE_COROUTINES
+    if (options.asyncIo) throw std::invalid_argument("Async I/O needs a C++20 build with coroutine support");
+#endif
+    partitionFor(options); // Проверка fanout до начала работы
+    ctx.tempPrefix = makeTempPrefix(options.tempDir);
+    ctx.progress.log = options.log;
+}
+
+size_t threadCount(const DistinctCounterOptions& options, const NumaTopology& topo) {
+    size_t n = options.threads ? options.threads : topo.cpuCount();
+    return n ? n : 4;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t inputFileSize(const std::string& path) {
+    std::ifstream inFile(path, std::ios::binary | std::ios::ate);
+    if (!inFile.is_open()) throw std::runtime_error("Could not open input file " + path);
+    return inFile.tellg();
+}
+
+// --- КОНТРОЛЬНЫЕ ТОЧКИ ---
+
+const uint64_t NOT_COUNTED = UINT64_MAX;
+
+// Манифест прерываемого подсчета: какая часть входа разложена, какой длины при этом файлы бакетов
+// и какие бакеты фазы 2 уже посчитаны. Пишется во временный файл, сбрасывается на диск
+// и переименовывается, поэтому на диске всегда целиком старый или целиком новый манифест.
+struct CheckpointManifest {
+    std::string inputPath;
+    uint64_t inputSize = 0;
+    int64_t inputModified = 0;  // Время изменения входа в наносекундах
+    std::string tempPrefix;
+    unsigned bits = 0;
+    unsigned subBits = 0;
+    uint64_t offset = 0;        // Вход до этого смещения разложен по бакетам
+    std::vector<uint64_t> bucketBytes;
+    std::vector<uint64_t> counted; // NOT_COUNTED - бакет еще не посчитан
+
+    static int64_t modifiedTime(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) throw std::runtime_error("Could not open input file " + path);
+        return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    bool matches(const std::string& path, uint64_t size) const {
+        return inputPath == path && inputSize == size && inputModified == modifiedTime(path);
+    }
+
+    size_t countedBuckets() const {
+        return std::count_if(counted.begin(), counted.end(), [](uint64_t c) { return c != NOT_COUNTED; });
+    }
+
+    void save(const std::string& path) const {
+        std::ostringstream text;
+        text << "distinct-counter-checkpoint 1\n"
+             << "input " << inputSize << " " << inputModified << " " << inputPath << "\n"
+             << "prefix " << tempPrefix << "\n"
+             << "partition " << bits << " " << subBits << "\n"
+             << "offset " << offset << "\n";
+        for (size_t b = 0; b < bucketBytes.size(); ++b) {
+            text << "bucket " << b << " " << bucketBytes[b] << " ";
+            if (counted[b] == NOT_COUNTED) text << "-\n";
+            else text << counted[b] << "\n";
+        }
+        std::string data = text.str();
+        std::string tmpPath = path + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Could not write checkpoint " + tmpPath);
+        try {
+            writeFully(fd, data.data(), data.size(), 0);
+            if (fdatasync(fd) != 0) throw std::runtime_error("Could not sync checkpoint " + tmpPath);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) throw std::runtime_error("Could not replace checkpoint " + path);
+    }
+
+    // false, если манифеста нет; испорченный манифест - ошибка
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in.is_open()) return false;
+        auto bad = [&]() { return std::runtime_error("Checkpoint " + path + " is damaged"); };
+        std::string line, word;
+        if (!std::getline(in, line) || line != "distinct-counter-checkpoint 1") throw bad();
+        std::istringstream input(std::getline(in, line) ? line : std::string());
+        if (!(input >> word >> inputSize >> inputModified) || word != "input" || input.get() != ' ' ||
+            !std::getline(input, inputPath)) {
+            throw bad();
+        }
+        if (!std::getline(in, line) || line.compare(0, 7, "prefix ") != 0) throw bad();
+        tempPrefix = line.substr(7);
+        if (!(in >> word >> bits >> subBits) || word != "partition" || bits > 16 || subBits > 16) throw bad();
+        if (!(in >> word >> offset) || word != "offset" || offset > inputSize) throw bad();
+        bucketBytes.assign(size_t(1) << bits, 0);
+        counted.assign(size_t(1) << bits, NOT_COUNTED);
+        for (size_t b = 0; b < bucketBytes.size(); ++b) {
+            size_t index;
+            std::string count;
+            if (!(in >> word >> index >> bucketBytes[b] >> count) || word != "bucket" || index != b) throw bad();
+            if (count == "-") continue;
+            char* endp;
+            counted[b] = std::strtoull(count.c_str(), &endp, 10);
+            if (count.empty() || *endp != '\0') throw bad();
+        }
+        return true;
+    }
+
+    // Файлы прогона, который не будет продолжен
+    void removeFiles() const {
+        for (size_t b = 0; b < bucketBytes.size(); ++b) {
+            std::remove((tempPrefix + std::to_string(b) + ".bin").c_str());
+        }
+    }
+};
+
+// --- ПЛАН ВЫПОЛНЕНИЯ ПО ВЫБОРКЕ ---
+
+const size_t PLAN_WINDOWS = 16;                    // Окон выборки, равномерно по файлу
+const uint64_t PLAN_WINDOW_BYTES = 256 * 1024;     // Всего около 4 МБ
+const uint64_t PLAN_BUCKET_KEYS = 1024 * 1024;     // Желаемый средний бакет (16 МБ)
+const unsigned PLAN_MAX_BUCKET_BITS = 12;          // Больше файлов первого уровень не заводит, дальше второй уровень
+const double PLAN_PREFILTER_MIN_HITS = 0.25;       // Фильтр недавних ключей окупается с этой доли повторов
+const double PLAN_SKEW_SPLIT = 4.0;                // Самый тяжелый префикс во столько раз больше среднего - нужен второй уровень
+const unsigned PLAN_SKEW_BITS = 8;                 // Перекос префиксов меряется по старшим 8 битам
+
+// Что видно по выборке из окон входного файла
+struct InputSample {
+    uint64_t bytes = 0;
+    uint64_t keys = 0;
+    uint64_t recentHits = 0; // Ключей, которые отбросил бы фильтр недавних ключей
+    bool sorted = true;      // Внутри каждого окна ключи идут по неубыванию
+    double distinctRatio = 1.0;
+    double prefixSkew = 1.0; // Самый тяжелый префикс из PLAN_SKEW_BITS бит относительно среднего
+
+    uint64_t estimatedKeys(uint64_t fileSize) const {
+        return bytes ? uint64_t(double(keys) * fileSize / bytes) : 0;
+    }
+};
+
+// Выборка читает окна целыми строками тем же разбором, что и фаза 1. Каждое окно проходит
+// через свой фильтр недавних ключей размера --prefilter по умолчанию, как фрагмент фазы 1 у потока.
+InputSample sampleInput(const std::string& inputPath, uint64_t fileSize) {
+    InputSample sample;
+    DistinctSketches sketch(1);
+    LineProgress progress; // Строки выборки в ход работы не входят
+    std::vector<uint64_t> prefixes(size_t(1) << PLAN_SKEW_BITS, 0);
+    size_t windows = fileSize <= PLAN_WINDOWS * PLAN_WINDOW_BYTES ? 1 : PLAN_WINDOWS;
+    for (size_t w = 0; w < windows; ++w) {
+        uint64_t begin = windows == 1 ? 0 : (fileSize - PLAN_WINDOW_BYTES) * w / (windows - 1);
+        uint64_t end = windows == 1 ? fileSize : begin + PLAN_WINDOW_BYTES;
+        RecentKeyFilter recent(l2CacheBytes() / 2);
+        uint128_t previous{0, 0};
+        uint64_t windowKeys = 0;
+        forEachKeyInChunk(inputPath, begin, end, progress, [&](const uint128_t& key, uint64_t) {
+            uint64_t hash = hashKey(key);
+            if (windowKeys > 0 && key < previous) sample.sorted = false;
+            sample.recentHits += recent.seen(key, hash);
+            sketch.add(0, hash);
+            prefixes[BucketIndex<PLAN_SKEW_BITS>::top(key)]++;
+            previous = key;
+            ++windowKeys;
+            return true;
+        });
+        sample.keys += windowKeys;
+        sample.bytes += end - begin;
+    }
+    if (sample.keys > 0) {
+        sample.distinctRatio = sketch.distinctRatio(0);
+        uint64_t heaviest = *std::max_element(prefixes.begin(), prefixes.end());
+        sample.prefixSkew = double(heaviest) * prefixes.size() / sample.keys;
+    }
+    return sample;
+}
+
+// Планировщик заполняет в opts все, что не задано явно, и печатает план в log; явные настройки помечены "set"
+void planExecution(const InputSample& sample, uint64_t fileSize, EngineKind engineKind, size_t nThreads,
+                   DistinctCounterOptions& opts, std::ostream* log) {
+    uint64_t keys = sample.estimatedKeys(fileSize);
+    double hitRate = sample.keys ? double(sample.recentHits) / sample.keys : 0.0;
+    if (log) {
+        *log << std::fixed << std::setprecision(1) << "Plan: sampled " << sample.bytes / (1024.0 * 1024.0)
+             << " MB, ~" << keys << " address(es), ~" << 100.0 * sample.distinctRatio << "% distinct in sample, "
+             << 100.0 * hitRate << "% recent repeats, heaviest prefix " << sample.prefixSkew << "x average"
+             << (sample.sorted ? ", in order" : "") << std::endl;
+    }
+
+    bool fanoutSet = opts.fanout.has_value();
+    bool prefilterSet = opts.prefilterBytes.has_value();
+    bool memorySet = opts.memoryBytes.has_value();
+    bool sortedCheckSet = opts.sortedCheck.has_value();
+
+    if (!prefilterSet) {
+        opts.prefilterBytes = hitRate >= PLAN_PREFILTER_MIN_HITS ? DistinctCounterOptions::PREFILTER_DEFAULT : 0;
+    }
+    uint64_t written = *opts.prefilterBytes > 0 ? uint64_t(keys * (1.0 - hitRate)) : keys;
+
+    PartitionPlan partition = partitionFor(opts);
+    size_t fileLimit = openFileHardLimit();
+    bool fileLimited = false;
+    if (!fanoutSet) {
+        unsigned wanted = partition.bits;
+        while (wanted < PLAN_MAX_BUCKET_BITS && (written >> wanted) > PLAN_BUCKET_KEYS) ++wanted;
+        // Тяжелый префикс даст бакет заметно больше среднего - его поделит второй уровень
+        unsigned wantedSub = partition.subBits;
+        if (!opts.subFanout) {
+            uint64_t heaviest = uint64_t(double(written >> wanted) * sample.prefixSkew);
+            wantedSub = sample.prefixSkew >= PLAN_SKEW_SPLIT && heaviest >= SECOND_LEVEL_MIN_KEYS ? 8 : 0;
+        }
+        // Первый уровень не заводит больше файлов, чем позволяет жесткий лимит; недостающие биты
+        // деления уходят во второй уровень, если его файлы на всех потоках тоже помещаются
+        PartitionPlan fitting{wanted, wantedSub};
+        for (unsigned bits = wanted; bits >= MIN_BUCKET_BITS; --bits) {
+            unsigned deficit = wanted - bits;
+            PartitionPlan candidate{bits, wantedSub};
+            if (!opts.subFanout && deficit > 0) candidate.subBits = std::max({wantedSub, deficit, MIN_BUCKET_BITS});
+            if (candidate.openFiles(nThreads) <= fileLimit) {
+                fitting = candidate;
+                break;
+            }
+            // Без второго уровня меньший первый все еще лучше плана, который не запустится
+            PartitionPlan flat{bits, opts.subFanout ? wantedSub : 0};
+            if (flat.openFiles(nThreads) <= fileLimit) {
+                fitting = flat;
+                break;
+            }
+        }
+        fileLimited = fitting.bits < wanted;
+        partition = fitting;
+        opts.fanout = unsigned(partition.buckets());
+        opts.subFanout = unsigned(partition.subBuckets());
+    }
+    // Если в бюджет не поместится и половина ключей, копии в памяти почти все уйдут на диск
+    uint64_t writtenBytes = written * sizeof(uint128_t);
+    if (!memorySet) {
+        uint64_t budget = defaultMemoryBudget();
+        opts.memoryBytes = writtenBytes > 2 * budget ? 0 : budget;
+    }
+    if (!sortedCheckSet) opts.sortedCheck = sample.sorted;
+    if (!log) return;
+
+    BucketProfile average;
+    average.keys = written >> partition.bits;
+    average.fixedBits = partition.bits;
+    average.distinctRatio = sample.distinctRatio;
+    const char* engine = dedupEngine(chooseEngine(engineKind, average)).name();
+
+    auto origin = [](bool set) { return set ? " (set)" : ""; };
+    *log << "Plan: fanout " << partition.buckets();
+    if (partition.subBits > 0) *log << "x" << partition.subBuckets();
+    *log << origin(fanoutSet);
+    if (fileLimited) *log << " (open file limit " << fileLimit << ")";
+    *log << ", memory " << *opts.memoryBytes / (1024 * 1024) << " MB for ~"
+         << writtenBytes / (1024 * 1024) << " MB of keys" << origin(memorySet) << ", prefilter "
+         << (*opts.prefilterBytes ? "on" : "off") << origin(prefilterSet) << ", sorted check "
+         << (*opts.sortedCheck ? "on" : "off") << origin(sortedCheckSet) << ", engine "
+         << (engineKind == ENGINE_AUTO ? "auto, typical bucket " : "") << engine
+         << origin(engineKind != ENGINE_AUTO) << std::endl;
+}
+
+// --- ПОДСЧЕТ ---
+
+// Текст и пачки ключей крупнее этого делятся между потоками пула, мелкие раскладываются в вызывающем потоке
+const size_t INGEST_TASK_BYTES = 4 * 1024 * 1024;
+
+#if HAVE_COROUTINES
+// Потоки ввода-вывода только ждут диск, поэтому их немного и они не считаются вычислительными
+const size_t IO_THREADS = 4;
+#endif
+
+// --- ЖИВОЙ ПОДСЧЕТ ---
+
+const size_t LIVE_DELTA_KEYS = 64 * 1024;         // Новых ключей бакета, с которых их сливают с прогоном (1 МБ)
+const size_t LIVE_DELTA_MAX_KEYS = 1024 * 1024;   // Больше новых ключей не копится и у крупного прогона (16 МБ)
+const size_t LIVE_BLOCK_KEYS = 64 * 1024;         // Блок чтения и записи прогона на диске
+const size_t LIVE_PARSE_KEYS = 64 * 1024;         // Столько адресов текста разбирается до раскладки по бакетам
+
+// Бакет живого подсчета: отсортированный прогон различных ключей и новые ключи, еще не слитые с ним.
+// Новые ключи сливаются с прогоном, когда их набирается заметная доля прогона, поэтому каждый ключ
+// за время работы переписывается O(log) раз. Прогон лежит в памяти, а при нехватке бюджета - в файле.
+struct LiveBucket {
+    std::mutex lock;
+    uint128_t* run = nullptr;        // nullptr, если прогон пуст или лежит в файле
+    size_t runCapacity = 0;
+    std::atomic<size_t> runKeys{0};  // Атомарны, чтобы выбирать бакет для сброса без его мьютекса
+    std::atomic<bool> spilled{false};
+    int fd = -1;
+    std::vector<uint128_t> delta;
+    size_t checkedDelta = SIZE_MAX;  // Размер delta при последнем подсчете, тогда в ней было checkedNew
+    size_t checkedNew = 0;           // ключей не из прогона
+
+    size_t mergeThreshold() const {
+        return std::max(LIVE_DELTA_KEYS, std::min(LIVE_DELTA_MAX_KEYS, runKeys.load() / 8));
+    }
+};
+
+void readFully(int fd, void* data, size_t length, uint64_t offset) {
+    char* p = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n <= 0) throw std::runtime_error("Could not read temp file.");
+        p += n;
+        length -= n;
+        offset += n;
+    }
+}
+
+// Последовательное чтение прогона из файла блоками
+class RunReader {
+    int fd;
+    size_t remaining;
+    uint64_t offset = 0;
+    std::vector<uint128_t> block;
+    size_t pos = 0;
+
+public:
+    RunReader(int fd, size_t keys) : fd(fd), remaining(keys) {}
+
+    // nullptr в конце прогона
+    const uint128_t* peek() {
+        if (pos == block.size()) {
+            if (remaining == 0) return nullptr;
+            size_t n = std::min(remaining, LIVE_BLOCK_KEYS);
+            block.resize(n);
+            readFully(fd, block.data(), n * sizeof(uint128_t), offset);
+            offset += n * sizeof(uint128_t);
+            remaining -= n;
+            pos = 0;
+        }
+        return &block[pos];
+    }
+
+    void pop() { ++pos; }
+};
+
+void sortUnique(SortKernel kernel, std::vector<uint128_t>& keys) {
+    std::vector<uint128_t> scratch(kernel == SORT_KERNEL_VECTOR ? keys.size() : 0);
+    sortKeys(kernel, keys.data(), keys.size(), scratch.data());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+
+// Сколько ключей из отсортированных без повторов keys нет в прогоне
+size_t countMissing(const uint128_t* run, size_t runKeys, const std::vector<uint128_t>& keys) {
+    size_t missing = 0;
+    const uint128_t* lo = run;
+    const uint128_t* end = run + runKeys;
+    for (const uint128_t& key : keys) {
+        lo = std::lower_bound(lo, end, key);
+        if (lo == end || !(*lo == key)) missing++;
+    }
+    return missing;
+}
+
+size_t countMissing(RunReader& run, const uint128_t* keys, size_t count) {
+    size_t missing = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint128_t* next;
+        while ((next = run.peek()) && *next < keys[i]) run.pop();
+        if (!next || !(*next == keys[i])) missing++;
+    }
+    return missing;
+}
+
+// Объединение прогона с отсортированными без повторов keys пишется в out с offset; возвращает число ключей
+size_t writeMergedRun(RunReader& run, const uint128_t* keys, size_t count, int out, uint64_t offset = 0) {
+    std::vector<uint128_t> block;
+    block.reserve(LIVE_BLOCK_KEYS);
+    size_t written = 0;
+    auto emit = [&](const uint128_t& key) {
+        block.push_back(key);
+        if (block.size() == LIVE_BLOCK_KEYS) {
+            writeFully(out, block.data(), block.size() * sizeof(uint128_t), offset);
+            offset += block.size() * sizeof(uint128_t);
+            written += block.size();
+            block.clear();
+        }
+    };
+    for (size_t i = 0; i < count; ++i) {
+        const uint128_t& key = keys[i];
+        const uint128_t* next;
+        while ((next = run.peek()) && *next < key) {
+            emit(*next);
+            run.pop();
+        }
+        if (next && *next == key) run.pop();
+        emit(key);
+    }
+    for (const uint128_t* next; (next = run.peek()); run.pop()) emit(*next);
+    writeFully(out, block.data(), block.size() * sizeof(uint128_t), offset);
+    return written + block.size();
+}
+
+// --- СЖАТИЕ ФАЙЛОВ БАКЕТОВ ПОД БЮДЖЕТ ДИСКА ---
+
+const double COMPACT_START = 0.75;                    // Доля бюджета, с которой начинается сжатие
+const double COMPACT_TARGET = 0.5;                    // Сжимать, пока файлы не уложатся в эту долю
+const uint64_t COMPACT_MIN_BYTES = 1024 * 1024;       // Меньшие файлы не сжимаются, если бюджет позволяет
+const size_t COMPACT_CHUNK_KEYS = 8 * 1024 * 1024;    // Ключей сортируется за раз (128 МБ)
+
+// Сжатие файлов бакетов фазы 1 под бюджет временного диска. Накопленный файл самого большого бакета
+// отделяется (запись бакета продолжается в новый файл), сортируется частями без повторов, и части
+// сливаются с прогоном бакета - отсортированным файлом его различных ключей. Каждый адрес лежит в прогоне
+// один раз, поэтому место на диске растет с числом различных адресов, а не строк. Файл сжимается, только
+// если он не меньше четверти прогона: иначе переписывать прогон ради него дорого.
+// При малом бюджете и большом числе бакетов сжимаются и файлы меньше COMPACT_MIN_BYTES.
+// Сжатие начинается фоновой задачей с COMPACT_START бюджета; если запись все же обгоняет ее и выходит
+// за бюджет, пишущий поток ждет сжатия или сжимает сам. Одновременно сжимает один поток (замок running), поэтому прогоны
+// других замков не требуют; фаза 2 начинается после сжатия.
+class BucketCompactor {
+    struct Run {
+        int fd = -1;
+        uint64_t keys = 0;
+    };
+
+    CounterContext& ctx;
+    BucketFiles& files;
+    uint64_t budget;
+    std::vector<Run> runs;
+    uint64_t minBytes;
+    bool warned = false;
+    std::mutex running;
+    std::atomic<bool> queued{false};
+    std::atomic<uint64_t> settled{0}; // Объем файлов после прошлого сжатия: пока он не вырос, сжимать нечего
+
+    std::atomic<uint64_t> compactions{0};
+    std::atomic<uint64_t> compactedBytes{0};
+
+    std::string runFileName(size_t b) const { return files.subBucketPrefix(b) + "run.bin"; }
+
+    // Объединение прогона с отсортированными без повторов keys заменяет прогон
+    void mergeIntoRun(size_t b, const std::vector<uint128_t>& keys) {
+        Run& run = runs[b];
+        std::string name = runFileName(b);
+        std::string tmpName = name + ".tmp";
+        int out = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) throw std::runtime_error("Could not create temp file " + tmpName);
+        size_t written;
+        try {
+            RunReader reader(run.fd, run.keys);
+            written = writeMergedRun(reader, keys.data(), keys.size(), out);
+        } catch (...) {
+            close(out);
+            std::remove(tmpName.c_str());
+            throw;
+        }
+        // Пока старый прогон не удален, на диске лежат оба
+        files.addDiskBytes(written * sizeof(uint128_t));
+        if (run.fd >= 0) close(run.fd);
+        run.fd = -1;
+        if (std::rename(tmpName.c_str(), name.c_str()) != 0) {
+            close(out);
+            throw std::runtime_error("Could not replace temp file " + name);
+        }
+        files.releaseDiskBytes(run.keys * sizeof(uint128_t));
+        run.fd = out;
+        run.keys = written;
+    }
+
+    void compact(size_t b) {
+        std::string detached = files.subBucketPrefix(b) + "compact.bin";
+        uint64_t bytes = files.detachFile(b, detached);
+        int fd = open(detached.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open temp file " + detached);
+        try {
+            std::vector<uint128_t> keys;
+            for (uint64_t offset = 0; offset < bytes;) {
+                size_t n = std::min<uint64_t>(COMPACT_CHUNK_KEYS, (bytes - offset) / sizeof(uint128_t));
+                keys.resize(n);
+                readFully(fd, keys.data(), n * sizeof(uint128_t), offset);
+                offset += n * sizeof(uint128_t);
+                sortUnique(ctx.sortKernel, keys);
+                mergeIntoRun(b, keys);
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        std::remove(detached.c_str());
+        files.releaseDiskBytes(bytes);
+        compactions++;
+        compactedBytes += bytes;
+    }
+
+    // Сжимать самые большие файлы, пока занятое место не опустится до COMPACT_TARGET бюджета. Вызывать под running.
+    void compactLargest() {
+        while (files.diskBytes() > budget * COMPACT_TARGET) {
+            size_t victim = SIZE_MAX;
+            uint64_t largest = 0;
+            for (size_t b = 0; b < runs.size(); ++b) {
+                uint64_t bytes = files.bytesIn(b);
+                uint64_t least = std::max<uint64_t>({minBytes, runs[b].keys * sizeof(uint128_t) / 4, 1});
+                if (bytes >= least && bytes > largest) {
+                    largest = bytes;
+                    victim = b;
+                }
+            }
+            if (victim == SIZE_MAX) {
+                // Сжимать нечего: различные адреса сами занимают почти весь бюджет
+                if (!warned && files.diskBytes() > budget && ctx.progress.log) {
+                    *ctx.progress.log << "Warning: temp files take " << files.diskBytes() / (1024 * 1024)
+                                      << " MB, over the " << budget / (1024 * 1024)
+                                      << " MB budget, with nothing left worth compacting" << std::endl;
+                    warned = true;
+                }
+                break;
+            }
+            compact(victim);
+        }
+        settled = files.diskBytes();
+    }
+
+public:
+    BucketCompactor(CounterContext& ctx, BucketFiles& files, uint64_t budget)
+        : ctx(ctx), files(files), budget(budget), runs(files.count()),
+          minBytes(std::min<uint64_t>(COMPACT_MIN_BYTES, budget / files.count() / 4)) {}
+
+    ~BucketCompactor() {
+        for (size_t b = 0; b < runs.size(); ++b) removeRun(b);
+    }
+
+    BucketCompactor(const BucketCompactor&) = delete;
+    BucketCompactor& operator=(const BucketCompactor&) = delete;
+
+    // Файлы выросли с прошлого сжатия настолько, что есть что сжимать
+    bool worthCompacting(uint64_t total) const { return total >= settled.load() + minBytes; }
+
+    // Файлы занимают total байт после записи; true - нужно запустить compactInBackground
+    bool onDiskUsage(uint64_t total) {
+        if (!worthCompacting(total)) return false;
+        if (total > budget) {
+            // Фоновое сжатие не успевает: пишущий поток ждет его и, если файлы все еще за бюджетом, сжимает сам
+            std::lock_guard<std::mutex> guard(running);
+            uint64_t now = files.diskBytes();
+            if (now > budget && worthCompacting(now)) compactLargest();
+            return false;
+        }
+        return !queued.exchange(true);
+    }
+
+    void compactInBackground() {
+        queued = false;
+        std::lock_guard<std::mutex> guard(running);
+        if (worthCompacting(files.diskBytes())) compactLargest();
+    }
+
+    uint64_t runKeys(size_t b) const { return runs[b].keys; }
+    int runFd(size_t b) const { return runs[b].fd; }
+
+    // Прогон посчитанного бакета больше не нужен
+    void removeRun(size_t b) {
+        Run& run = runs[b];
+        if (run.fd < 0) return;
+        close(run.fd);
+        std::remove(runFileName(b).c_str());
+        files.releaseDiskBytes(run.keys * sizeof(uint128_t));
+        run.fd = -1;
+        run.keys = 0;
+    }
+
+    void printStats(std::ostream& out) const {
+        const double MB = 1024.0 * 1024.0;
+        out << "Temp disk: peak " << std::fixed << std::setprecision(1) << files.diskPeakBytes() / MB << " MB of "
+            << budget / MB << " MB budget, " << compactions.load() << " compaction(s) of "
+            << compactedBytes.load() / MB << " MB" << std::endl;
+    }
+};
+
+// Бакет со сжатым прогоном: остаток файла сортируется без повторов и сверяется с прогоном,
+// различных ключей - ключи прогона плюс ключи остатка, которых в прогоне нет
+uint64_t processCompactedBucket(CounterContext& ctx, const std::string& fname, int runFd, uint64_t runKeys,
+                                BucketArena& arena, ThreadPool& pool) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) throw std::runtime_error("Could not open temp file " + fname);
+    size_t count = st.st_size / sizeof(uint128_t);
+    uint128_t* keys = arena.keysFor(count);
+    try {
+        readFully(fd, keys, count * sizeof(uint128_t), 0);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    if (count >= PARALLEL_SORT_MIN && pool.size() > 1) {
+        keys = parallelSort(ctx.sortKernel, keys, arena.scratchFor(count), count, pool);
+    } else {
+        sortKeys(ctx.sortKernel, keys, count, arena.scratchFor(count));
+    }
+    count = std::unique(keys, keys + count) - keys;
+    RunReader run(runFd, runKeys);
+    uint64_t unique = runKeys + countMissing(run, keys, count);
+    if (ctx.index && unique > 0) {
+        // В индекс идет объединение прогона с остатком
+        RunReader merged(runFd, runKeys);
+        const uint128_t* head = merged.peek();
+        uint128_t first = count == 0 || (head && *head < keys[0]) ? *head : keys[0];
+        uint64_t offset = ctx.index->reserve(unique);
+        writeMergedRun(merged, keys, count, ctx.index->runsFd(), offset);
+        ctx.index->addRun(first, offset, unique);
+    }
+    return unique;
+}
+
+// --- ПОДСЧЕТ ПО ОКНАМ ВРЕМЕНИ ---
+
+const size_t WINDOW_TASK_BYTES = 4 * 1024 * 1024; // Текст крупнее разбирается задачами пула
+const int64_t WINDOW_MAX_EMPTY_SLOTS = 100000;     // Более долгий перерыв в данных не заполняется пустыми окнами
+
+// HyperLogLog на 2^14 регистров, ошибка около 0.8%
+class HyperLogLog {
+public:
+    static const unsigned PRECISION = 14;
+    static const size_t REGISTERS = size_t(1) << PRECISION;
+
+private:
+    std::vector<uint8_t> registers;
+
+public:
+    HyperLogLog() : registers(REGISTERS, 0) {}
+
+    void add(uint64_t hash) {
+        uint8_t& reg = registers[hash >> (64 - PRECISION)];
+        uint8_t rank = __builtin_clzll((hash << PRECISION) | (1ULL << (PRECISION - 1))) + 1;
+        if (rank > reg) reg = rank;
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < REGISTERS; ++i) registers[i] = std::max(registers[i], other.registers[i]);
+    }
+
+    uint64_t estimate() const {
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t reg : registers) {
+            sum += std::ldexp(1.0, -reg);
+            if (reg == 0) zeros++;
+        }
+        const double m = REGISTERS;
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        // На малых числах точнее линейный подсчет по пустым регистрам
+        if (estimate <= 2.5 * m && zeros > 0) estimate = m * std::log(m / zeros);
+        return uint64_t(estimate + 0.5);
+    }
+};
+
+// Точное множество ключей окна: открытая адресация, таблица удваивается при заполнении наполовину.
+// Пустая ячейка помечена ключом из одних единиц, сам такой ключ учитывается отдельным флагом.
+class KeySet {
+    static const uint64_t EMPTY = ~0ULL;
+
+    std::vector<uint128_t> table;
+    size_t count = 0;
+    bool hasEmptyKey = false;
+
+    static bool isEmpty(const uint128_t& key) { return key.hi == EMPTY && key.lo == EMPTY; }
+
+    void place(const uint128_t& key, uint64_t hash) {
+        size_t mask = table.size() - 1;
+        for (size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+            if (isEmpty(table[pos])) {
+                table[pos] = key;
+                count++;
+                return;
+            }
+            if (table[pos] == key) return;
+        }
+    }
+
+public:
+    KeySet() : table(64, uint128_t{EMPTY, EMPTY}) {}
+
+    void insert(const uint128_t& key, uint64_t hash) {
+        if (isEmpty(key)) {
+            hasEmptyKey = true;
+            return;
+        }
+        if (2 * (count + 1) > table.size()) {
+            std::vector<uint128_t> old(table.size() * 2, uint128_t{EMPTY, EMPTY});
+            old.swap(table);
+            count = 0;
+            for (const uint128_t& k : old) {
+                if (!isEmpty(k)) place(k, hashKey(k));
+            }
+        }
+        place(key, hash);
+    }
+
+    size_t size() const { return count + hasEmptyKey; }
+};
+
+// Дней от 1970-01-01 до даты григорианского календаря
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = unsigned(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + int64_t(doe) - 719468;
+}
+
+int64_t floorDiv(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+bool readDigits(const char*& p, const char* end, unsigned n, int& value) {
+    if (end - p < (ptrdiff_t)n) return false;
+    value = 0;
+    for (unsigned i = 0; i < n; ++i, ++p) {
+        if (*p < '0' || *p > '9') return false;
+        value = value * 10 + (*p - '0');
+    }
+    return true;
+}
+
+bool expect(const char*& p, const char* end, char c) {
+    if (p == end || *p != c) return false;
+    ++p;
+    return true;
+}
+
+// Смещение пояса "Z", "+HH:MM" или "-HHMM"; без пояса время считается UTC
+bool readZone(const char*& p, const char* end, int& offset) {
+    offset = 0;
+    if (p == end) return true;
+    if (*p == 'Z') {
+        ++p;
+        return true;
+    }
+    if (*p != '+' && *p != '-') return true;
+    int sign = *p++ == '-' ? -1 : 1;
+    int hours, minutes;
+    if (!readDigits(p, end, 2, hours)) return false;
+    expect(p, end, ':');
+    if (!readDigits(p, end, 2, minutes)) return false;
+    offset = sign * (hours * 3600 + minutes * 60);
+    return true;
+}
+
+int64_t civilSeconds(int year, int month, int day, int hours, int minutes, int seconds) {
+    return daysFromCivil(year, month, day) * 86400 + hours * 3600 + minutes * 60 + seconds;
+}
+
+// Время журнала nginx и Apache: [10/Oct/2000:13:55:36 -0700]
+bool parseClfTime(const char* p, const char* end, int64_t& time) {
+    static const char* const MONTHS = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int day, year, hours, minutes, seconds, offset;
+    if (!readDigits(p, end, 2, day) || !expect(p, end, '/') || end - p < 3) return false;
+    const char* found = std::search(MONTHS, MONTHS + 36, p, p + 3);
+    if (found == MONTHS + 36 || (found - MONTHS) % 3 != 0) return false;
+    int month = int(found - MONTHS) / 3 + 1;
+    p += 3;
+    if (!expect(p, end, '/') || !readDigits(p, end, 4, year) || !expect(p, end, ':') ||
+        !readDigits(p, end, 2, hours) || !expect(p, end, ':') || !readDigits(p, end, 2, minutes) ||
+        !expect(p, end, ':') || !readDigits(p, end, 2, seconds)) {
+        return false;
+    }
+    while (p < end && *p == ' ') ++p;
+    if (!readZone(p, end, offset)) return false;
+    time = civilSeconds(year, month, day, hours, minutes, seconds) - offset;
+    return true;
+}
+
+// ISO 8601: 2000-10-10T13:55:36[.123][Z|+03:00], вместо T допускается пробел
+bool parseIsoTime(const char* p, const char* end, int64_t& time) {
+    int year, month, day, hours, minutes, seconds, offset;
+    if (!readDigits(p, end, 4, year) || !expect(p, end, '-') || !readDigits(p, end, 2, month) ||
+        !expect(p, end, '-') || !readDigits(p, end, 2, day) || p == end || (*p != 'T' && *p != ' ')) {
+        return false;
+    }
+    ++p;
+    if (!readDigits(p, end, 2, hours) || !expect(p, end, ':') || !readDigits(p, end, 2, minutes) ||
+        !expect(p, end, ':') || !readDigits(p, end, 2, seconds)) {
+        return false;
+    }
+    if (p < end && (*p == '.' || *p == ',')) {
+        ++p;
+        while (p < end && *p >= '0' && *p <= '9') ++p;
+    }
+    if (!readZone(p, end, offset) || month < 1 || month > 12) return false;
+    time = civilSeconds(year, month, day, hours, minutes, seconds) - offset;
+    return true;
+}
+
+// Метка времени с начала поля: формат журнала в квадратных скобках, ISO 8601 или Unix-время в секундах
+// (дробная часть отбрасывается). Поле журнала nginx "[10/Oct/2000:13:55:36" продолжается поясом
+// в следующем поле, поэтому разбор может читать до конца строки.
+bool parseTimestamp(const char* p, const char* end, int64_t& time) {
+    if (p < end && *p == '[') return parseClfTime(p + 1, end, time);
+    if (end - p >= 10 && p[4] == '-') return parseIsoTime(p, end, time);
+    const char* start = p;
+    int64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    if (p == start || (p < end && *p != '.' && *p != ' ' && *p != '\t' && *p != ',')) return false;
+    time = value;
+    return true;
+}
+
+// Поле number (с 1) строки, поля разделены пробелами и табуляциями
+bool findField(const char* line, const char* end, unsigned number, const char*& begin, const char*& fieldEnd) {
+    const char* p = line;
+    for (unsigned n = 1;; ++n) {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p == end) return false;
+        const char* start = p;
+        while (p < end && *p != ' ' && *p != '\t') ++p;
+        if (n == number) {
+            begin = start;
+            fieldEnd = p;
+            return true;
+        }
+    }
+}
+
+struct WindowEvent {
+    int64_t time;
+    uint128_t key;
+};
+
+// Строки без адреса IPv6 (например, с клиентами IPv4) или без метки времени пропускаются
+bool parseWindowLine(const char* line, const char* end, const WindowOptions& format, WindowEvent& event) {
+    const char* begin;
+    const char* fieldEnd;
+    if (!findField(line, end, format.addressField, begin, fieldEnd) ||
+        !parseIPv6(begin, fieldEnd - begin, event.key)) {
+        return false;
+    }
+    return findField(line, end, format.timeField, begin, fieldEnd) && parseTimestamp(begin, end, event.time);
+}
+
+// Слот - отрезок времени длиной в шаг: у окон встык точное множество адресов, у скользящих - HyperLogLog
+struct WindowSlot {
+    KeySet keys;
+    std::unique_ptr<HyperLogLog> sketch;
+};
+
+// --- НЕСКОЛЬКО ПОДСЧЕТОВ ЗА ПРОХОД ---
+
+const size_t MULTI_PARSE_RECORDS = 64 * 1024;     // Столько записей текста разбирается до раскладки по бакетам
+const size_t MULTI_TASK_BYTES = 4 * 1024 * 1024;  // Текст крупнее разбирается задачами пула
+const size_t MULTI_BLOCK_RECORDS = 64 * 1024;     // Блок чтения бакета с диска
+
+// Адрес или префикс с маской подсчетов, к которым он относится
+struct TaggedKey {
+    uint64_t hi;
+    uint64_t lo;
+    uint64_t mask;
+};
+
+uint128_t prefixOf(const uint128_t& key, unsigned length) {
+    if (length >= 128) return key;
+    if (length == 0) return uint128_t{0, 0};
+    if (length <= 64) return uint128_t{length == 64 ? key.hi : key.hi & ~(~0ULL >> length), 0};
+    return uint128_t{key.hi, key.lo & ~(~0ULL >> (length - 64))};
+}
+
+struct KeyHasher {
+    size_t operator()(const uint128_t& key) const { return hashKey(key); }
+};
+
+// "2001:db8::/32" или адрес без длины (/128); биты за длиной должны быть нулевыми
+void parsePrefix(const std::string& text, uint128_t& prefix, unsigned& length) {
+    size_t slash = text.find('/');
+    length = 128;
+    if (slash != std::string::npos) {
+        char* endp;
+        unsigned long value = std::strtoul(text.c_str() + slash + 1, &endp, 10);
+        if (slash + 1 == text.size() || *endp != '\0' || value > 128) {
+            throw std::invalid_argument("Bad prefix length in " + text);
+        }
+        length = unsigned(value);
+    }
+    std::string address = text.substr(0, slash);
+    if (!parseIPv6(address.data(), address.size(), prefix)) throw std::invalid_argument("Bad IPv6 prefix " + text);
+    if (!(prefixOf(prefix, length) == prefix)) throw std::invalid_argument("Prefix " + text + " has bits past its length");
+}
+
+// Списки префиксов всех подсчетов: для каждой встречающейся длины таблица префикс -> маска подсчетов
+class PrefixMasks {
+    struct Level {
+        unsigned length;
+        std::unordered_map<uint128_t, uint64_t, KeyHasher> masks;
+    };
+    std::vector<Level> levels;
+
+public:
+    void add(const std::string& text, uint64_t bit) {
+        uint128_t prefix;
+        unsigned length;
+        parsePrefix(text, prefix, length);
+        auto level = std::find_if(levels.begin(), levels.end(), [&](const Level& l) { return l.length == length; });
+        if (level == levels.end()) {
+            levels.push_back(Level{length, {}});
+            level = levels.end() - 1;
+        }
+        level->masks[prefix] |= bit;
+    }
+
+    uint64_t lookup(const uint128_t& key) const {
+        uint64_t mask = 0;
+        for (const Level& level : levels) {
+            auto found = level.masks.find(prefixOf(key, level.length));
+            if (found != level.masks.end()) mask |= found->second;
+        }
+        return mask;
+    }
+
+    size_t lengths() const { return levels.size(); }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const Level& level : levels) total += level.masks.size();
+        return total;
+    }
+};
+
+// Фильтры подсчетов, сведенные в маски: по ним адрес за один разбор получает маску всех своих подсчетов
+struct AggregationMasks {
+    PrefixMasks include;
+    PrefixMasks exclude;
+    uint64_t unfiltered = 0;    // Подсчеты без списка префиксов
+    uint64_t anySource = 0;     // Подсчеты без фильтра источников
+    std::vector<std::pair<std::string, uint64_t>> sources;
+    std::vector<std::pair<unsigned, uint64_t>> granularities;
+
+    explicit AggregationMasks(const std::vector<Aggregation>& aggregations) {
+        if (aggregations.empty()) throw std::invalid_argument("No aggregations given.");
+        if (aggregations.size() > MultiDistinctCounter::MAX_AGGREGATIONS) {
+            throw std::invalid_argument("At most " + std::to_string(MultiDistinctCounter::MAX_AGGREGATIONS) +
+                                        " aggregations are supported.");
+        }
+        for (size_t a = 0; a < aggregations.size(); ++a) {
+            const Aggregation& agg = aggregations[a];
+            uint64_t bit = 1ULL << a;
+            if (agg.granularity == 0 || agg.granularity > 128) {
+                throw std::invalid_argument("Aggregation " + agg.name + ": granularity must be from 1 to 128.");
+            }
+            if (agg.prefixes.empty()) unfiltered |= bit;
+            for (const std::string& prefix : agg.prefixes) include.add(prefix, bit);
+            for (const std::string& prefix : agg.excluded) exclude.add(prefix, bit);
+            if (agg.sources.empty()) anySource |= bit;
+            for (const std::string& source : agg.sources) {
+                auto found = std::find_if(sources.begin(), sources.end(), [&](const auto& s) { return s.first == source; });
+                if (found == sources.end()) sources.emplace_back(source, bit);
+                else found->second |= bit;
+            }
+            auto found = std::find_if(granularities.begin(), granularities.end(),
+                                      [&](const auto& g) { return g.first == agg.granularity; });
+            if (found == granularities.end()) granularities.emplace_back(agg.granularity, bit);
+            else found->second |= bit;
+        }
+    }
+
+    uint64_t sourceMask(const std::string& source) const {
+        uint64_t mask = anySource;
+        for (const auto& s : sources) {
+            if (s.first == source) mask |= s.second;
+        }
+        return mask;
+    }
+
+    // Записи адреса key: по одной на каждую длину огрубления, которой подходит хотя бы один подсчет
+    template <typename Out>
+    void tag(const uint128_t& key, uint64_t sourceBits, Out& out) const {
+        uint64_t mask = sourceBits & (unfiltered | include.lookup(key)) & ~exclude.lookup(key);
+        if (mask == 0) return;
+        for (const auto& g : granularities) {
+            uint64_t bits = mask & g.second;
+            if (bits == 0) continue;
+            uint128_t prefix = prefixOf(key, g.first);
+            out.push_back(TaggedKey{prefix.hi, prefix.lo, bits});
+        }
+    }
+};
+
+// Бакет записей: в памяти, а при превышении бюджета дописывается в свой временный файл
+struct MultiBucket {
+    std::mutex lock;
+    std::vector<TaggedKey> records;
+    int fd = -1;
+    uint64_t fileRecords = 0;
+};
+
+}  // namespace
+
+// Фаза 1 начинается с первого добавления и длится до finalize: буферы записи живут между вызовами
+// add*, файлы бакетов открыты. finalize сбрасывает буферы и выполняет фазу 2.
+struct DistinctCounter::Impl {
+    // Порядок полей важен: уничтожаются в обратном порядке, и все, что ссылается на пул,
+    // файлы и контекст, должно уйти раньше них
+    DistinctCounterOptions options;
+    CounterContext ctx;
+    NumaTopology topo;
+    size_t nThreads = 0;
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<BucketFiles> files;
+    std::unique_ptr<BucketCompactor> compactor; // Только с бюджетом временного диска
+    std::unique_ptr<IndexBuilder> index;        // Только с options.indexPath, создается в finalize
+#if HAVE_COROUTINES
+    std::unique_ptr<IoService> io;
+    AsyncScope ioScope;
+#endif
+    TaskGroup phase1;
+    TaskGroup compaction; // Сжатие идет в фоне и дожидается только перед фазой 2
+    std::vector<std::unique_ptr<BucketWriter>> writers; // По одному на поток пула, создаются при первой задаче
+    std::unique_ptr<BucketWriter> callerWriter;         // Для мелких добавлений из вызывающего потока
+    std::vector<std::unique_ptr<Phase1Pipeline>> pipelines;
+
+    // Упорядоченный файл, посчитанный потоковым проходом: раскладывается, только если добавится еще что-то
+    bool sortedPending = false;
+    std::string sortedPath;
+    uint64_t sortedCount = 0;
+
+    std::string carry; // Незавершенная строка add_text_buffer
+    bool finalized = false;
+    uint64_t result = 0;
+    std::chrono::steady_clock::time_point phase1Start;
+    double phase1Seconds = 0;
+    double phase2Seconds = 0;
+
+    // Контрольные точки (options.checkpoint)
+    std::unique_ptr<CheckpointManifest> manifest;
+    std::mutex manifestLock;
+    std::chrono::steady_clock::time_point manifestSaved;
+    std::vector<size_t> countedFiles; // Посчитанные бакеты, чьи файлы удаляются после записи манифеста
+    bool resumed = false;
+    uint64_t resumedOffset = 0;
+    size_t resumedCounted = 0;
+    size_t checkpointsSaved = 0;
+
+    explicit Impl(const DistinctCounterOptions& opts) : options(opts), ctx(opts.hugePages) {
+        if (!options.checkpoint.empty() && options.pipeline.enabled) {
+            throw std::invalid_argument("Checkpoints do not support the phase 1 pipeline");
+        }
+        if (!options.checkpoint.empty() && options.checkpointSeconds == 0) {
+            throw std::invalid_argument("Checkpoint interval must be positive");
+        }
+        if (options.maxTempBytes > 0 && !options.checkpoint.empty()) {
+            throw std::invalid_argument("Checkpoints do not support a temp disk budget");
+        }
+        if (options.maxTempBytes > 0 && options.asyncIo) {
+            throw std::invalid_argument("A temp disk budget does not support async I/O");
+        }
+        if (!options.indexPath.empty() && !options.checkpoint.empty()) {
+            throw std::invalid_argument("Checkpoints do not support writing an index");
+        }
+        configureContext(options, ctx);
+        topo = detectNumaTopology();
+        nThreads = threadCount(options, topo);
+        if (options.log) printTopology(*options.log, topo, nThreads);
+        pool.reset(new ThreadPool(topo, nThreads));
+        writers.resize(pool->size());
+    }
+
+    ~Impl() {
+        // Подсчет брошен до finalize: задачи записи еще держат буферы писателей
+        try {
+            pool->wait(phase1);
+        } catch (...) {
+        }
+        try {
+            pool->wait(compaction);
+        } catch (...) {
+        }
+#if HAVE_COROUTINES
+        try {
+            ioScope.wait();
+        } catch (...) {
+        }
+#endif
+    }
+
+    void checkOpen() const {
+        if (finalized) throw std::logic_error("DistinctCounter is already finalized");
+    }
+
+    void checkNotCheckpointed() const {
+        if (!options.checkpoint.empty()) throw std::invalid_argument("Checkpoints cover a single add_file call");
+    }
+
+    // Настройки фиксируются при первом добавлении: дальше файлы бакетов и писатели уже созданы
+    void start() {
+        if (files) return;
+        ctx.partition = partitionFor(options);
+        ctx.prefilterBytes = prefilterBytesFor(options);
+        uint64_t memoryBudget = options.memoryBytes.value_or(defaultMemoryBudget());
+        // Буферы записи берутся из бюджета памяти и делятся на всех писателей, которые могут жить разом:
+        // по одному на поток пула, писатель вызывающего потока, распределители конвейера
+        // и писатели второго уровня, по одному на поток, делящий крупный бакет
+        if (memoryBudget > 0) ctx.writeBudgetBytes = std::min<uint64_t>(WRITE_BUFFERS_BYTES, memoryBudget / 2);
+        ctx.writerSlots = pool->size() + 1;
+        if (options.pipeline.enabled) {
+            PipelineConfig cfg;
+            cfg.partitioners = options.pipeline.partitioners;
+            resolvePipelineConfig(cfg, nThreads);
+            ctx.writerSlots += cfg.partitioners;
+        }
+        if (ctx.partition.subBits > 0) ctx.writerSlots += pool->size();
+        memoryBudget -= std::min<uint64_t>(memoryBudget, ctx.writeBudgetBytes);
+
+        if (options.log) *options.log << "Phase 1: Reading file and partitioning..." << std::endl;
+        phase1Start = std::chrono::steady_clock::now();
+
+        ensureOpenFileLimit(ctx.partition.openFiles(nThreads));
+        files.reset(new BucketFiles(ctx.memory, ctx.partition.buckets(), ctx.partition.bits, ctx.tempPrefix));
+        if (manifest) {
+            // Контрольной точке нужны все бакеты на диске, а файлы - и после ошибки
+            files->keepFilesOnExit();
+            if (resumed) files->openExisting(manifest->bucketBytes);
+            else files->openAll();
+        } else {
+            if (memoryBudget > 0) files->keepInMemory(memoryBudget);
+            files->openAll();
+        }
+        if (options.maxTempBytes > 0) {
+            compactor.reset(new BucketCompactor(ctx, *files, options.maxTempBytes));
+            files->watchDiskUsage(uint64_t(options.maxTempBytes * COMPACT_START), [this](uint64_t total) {
+                if (compactor->onDiskUsage(total)) {
+                    pool->submit(compaction, [this]() { compactor->compactInBackground(); });
+                }
+            });
+        }
+#if HAVE_COROUTINES
+        if (options.asyncIo) io.reset(new IoService(*pool, IO_THREADS));
+#endif
+    }
+
+    std::unique_ptr<BucketWriter> makeWriter() {
+        std::unique_ptr<BucketWriter> writer(new BucketWriter(ctx, *files, *pool, phase1));
+        if (ctx.prefilterBytes > 0) writer->useRecentFilter(ctx.prefilterBytes);
+#if HAVE_COROUTINES
+        if (io) writer->useAsyncIo(*io, ioScope);
+#endif
+        return writer;
+    }
+
+    // Вызывать из задачи пула
+    BucketWriter& workerWriter() {
+        std::unique_ptr<BucketWriter>& writer = writers[ThreadPool::currentWorker()];
+        if (!writer) writer = makeWriter();
+        return *writer;
+    }
+
+    BucketWriter& ownWriter() {
+        if (!callerWriter) callerWriter = makeWriter();
+        return *callerWriter;
+    }
+
+    void addKey(BucketWriter& writer, const uint128_t& key) {
+        writer.add(key.hi >> (64 - ctx.partition.bits), key);
+    }
+
+    bool addLine(BucketWriter& writer, const char* line, size_t length) {
+        if (length > 0 && line[length - 1] == '\r') length--;
+        uint128_t key;
+        if (length == 0 || !parseIPv6(line, length, key)) return false;
+        addKey(writer, key);
+        return true;
+    }
+
+    size_t addLines(BucketWriter& writer, const char* text, const char* end) {
+        size_t accepted = 0;
+        while (text < end) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            if (!eol) eol = end;
+            accepted += addLine(writer, text, eol - text);
+            text = eol + 1;
+        }
+        return accepted;
+    }
+
+    // Файлы нужны только для упорядоченного прохода, а количество - только его; раскладывается отложенный
+    // упорядоченный файл, как только к нему добавляется что-то еще
+    void flushSorted() {
+        if (!sortedPending) return;
+        sortedPending = false;
+        partitionFile(sortedPath, inputFileSize(sortedPath));
+    }
+
+    uint64_t chunksFor(uint64_t fileSize) const {
+        // Файл режется на фрагменты с запасом по числу потоков, чтобы свободные потоки могли украсть работу
+        return std::max<uint64_t>(nThreads, (fileSize + PHASE1_CHUNK_BYTES - 1) / PHASE1_CHUNK_BYTES);
+    }
+
+    void partitionFile(const std::string& path, uint64_t fileSize) {
+        start();
+        if (options.pipeline.enabled) {
+            // Стадии конвейера работают в своих потоках, пул только пишет заполненные буферы
+            PipelineConfig cfg;
+            cfg.enabled = true;
+            cfg.readers = options.pipeline.readers;
+            cfg.parsers = options.pipeline.parsers;
+            cfg.partitioners = options.pipeline.partitioners;
+            resolvePipelineConfig(cfg, nThreads);
+            pipelines.emplace_back(new Phase1Pipeline(ctx, path, topo, [this]() { return makeWriter(); }, cfg));
+            pipelines.back()->run(fileSize);
+            // Буферы распределителей не переживают свой файл: их место займет конвейер следующего
+            pool->wait(phase1);
+            pipelines.back()->releaseWriters();
+            return;
+        }
+        partitionRange(path, 0, fileSize);
+    }
+
+    // Фрагменты [from, to) раскладываются задачами пула
+    void partitionRange(const std::string& path, uint64_t from, uint64_t to) {
+        uint64_t size = to - from;
+        uint64_t nChunks = chunksFor(size);
+        for (uint64_t c = 0; c < nChunks; ++c) {
+            uint64_t begin = from + size * c / nChunks;
+            uint64_t end = from + size * (c + 1) / nChunks;
+            pool->submit(phase1, [this, &path, begin, end]() {
+                BucketWriter& writer = workerWriter();
+                dispatchBucketBits(ctx.partition.bits, [&](auto bits) {
+                    partitionChunk<decltype(bits)::value>(path, begin, end, ctx.progress, writer);
+                });
+            });
+        }
+        pool->wait(phase1);
+    }
+
+    // Все буферы писателей записаны: файлы бакетов имеют зарезервированную длину
+    void flushWriters() {
+        for (auto& writer : writers) {
+            if (writer) writer->flushAll();
+        }
+        if (callerWriter) callerWriter->flushAll();
+        pool->wait(phase1);
+#if HAVE_COROUTINES
+        ioScope.wait();
+#endif
+    }
+
+    // Вызывать под manifestLock или вне фазы 2. Файлы бакетов, посчитанных в записанном манифесте, больше не нужны.
+    void saveCheckpoint() {
+        manifest->save(options.checkpoint);
+        for (size_t b : countedFiles) std::remove(files->fileName(b).c_str());
+        countedFiles.clear();
+        manifestSaved = std::chrono::steady_clock::now();
+        checkpointsSaved++;
+    }
+
+    // add_file с контрольными точками: вход раскладывается отрезками примерно по checkpointSeconds;
+    // после отрезка буферы записываются, файлы бакетов сбрасываются на диск и пишется манифест.
+    // Перезапуск теряет не больше одного отрезка фазы 1 или одного интервала фазы 2.
+    void addFileCheckpointed(const std::string& path) {
+        if (files || sortedPending) {
+            throw std::invalid_argument("Checkpoints cover a single add_file call on an empty counter");
+        }
+        uint64_t fileSize = inputFileSize(path);
+        manifest.reset(new CheckpointManifest());
+        CheckpointManifest previous;
+        bool found = previous.load(options.checkpoint);
+        if (found && options.resume) {
+            if (!previous.matches(path, fileSize)) {
+                throw std::runtime_error("Checkpoint " + options.checkpoint +
+                                         " was made for another input or the input has changed");
+            }
+            *manifest = previous;
+            resumed = true;
+            resumedOffset = manifest->offset;
+            resumedCounted = manifest->countedBuckets();
+            ctx.tempPrefix = manifest->tempPrefix;
+            options.fanout = 1u << manifest->bits;
+            options.subFanout = manifest->subBits ? 1u << manifest->subBits : 0;
+            if (options.log) {
+                *options.log << "Resuming from checkpoint " << options.checkpoint << ": " << manifest->offset << " of "
+                             << fileSize << " byte(s) partitioned, " << resumedCounted << " bucket(s) counted"
+                             << std::endl;
+            }
+        } else {
+            // Прежний прогон без resume уже не продолжится
+            if (found) previous.removeFiles();
+            if (options.resume && options.log) {
+                *options.log << "No checkpoint at " << options.checkpoint << ", starting from the beginning" << std::endl;
+            }
+            if (options.plan) planExecution(sampleInput(path, fileSize), fileSize, ctx.engine, nThreads, options, options.log);
+            manifest->inputPath = path;
+            manifest->inputSize = fileSize;
+            manifest->inputModified = CheckpointManifest::modifiedTime(path);
+            manifest->tempPrefix = ctx.tempPrefix;
+            // Манифест пишется до создания файлов бакетов, чтобы их нашел и следующий запуск
+            PartitionPlan partition = partitionFor(options);
+            manifest->bits = partition.bits;
+            manifest->subBits = partition.subBits;
+            manifest->bucketBytes.assign(partition.buckets(), 0);
+            manifest->counted.assign(partition.buckets(), NOT_COUNTED);
+            saveCheckpoint();
+        }
+        start();
+
+        // Первый отрезок - по фрагменту на поток, следующие - на checkpointSeconds при скорости предыдущего
+        uint64_t segment = PHASE1_CHUNK_BYTES * nThreads;
+        while (manifest->offset < fileSize) {
+            auto segmentStart = std::chrono::steady_clock::now();
+            uint64_t end = std::min(fileSize, manifest->offset + segment);
+            partitionRange(path, manifest->offset, end);
+            flushWriters();
+            files->syncAll();
+            for (size_t b = 0; b < manifest->bucketBytes.size(); ++b) manifest->bucketBytes[b] = files->bytesIn(b);
+            double took = std::max(secondsSince(segmentStart), 1e-3);
+            segment = std::max<uint64_t>(PHASE1_CHUNK_BYTES * nThreads,
+                                         uint64_t((end - manifest->offset) / took * options.checkpointSeconds));
+            manifest->offset = end;
+            saveCheckpoint();
+        }
+    }
+
+    // Бакет посчитан; с контрольными точками его файл удаляется только после записи манифеста с его числом
+    void bucketCounted(size_t b, uint64_t unique) {
+        ctx.uniqueCount += unique;
+        if (!manifest) {
+            std::remove(files->fileName(b).c_str());
+            if (compactor) compactor->removeRun(b);
+            return;
+        }
+        std::lock_guard<std::mutex> guard(manifestLock);
+        manifest->counted[b] = unique;
+        manifest->bucketBytes[b] = 0;
+        countedFiles.push_back(b);
+        if (secondsSince(manifestSaved) >= options.checkpointSeconds) saveCheckpoint();
+    }
+
+    void addFile(const std::string& path) {
+        checkOpen();
+        if (!options.checkpoint.empty()) {
+            addFileCheckpointed(path);
+            return;
+        }
+        uint64_t fileSize = inputFileSize(path);
+        if (!files && !sortedPending) {
+            // Первый файл пустого счетчика задает план; упорядоченный вход считается сразу,
+            // на неупорядоченном проход обрывается на первом нарушении порядка
+            if (options.plan) planExecution(sampleInput(path, fileSize), fileSize, ctx.engine, nThreads, options, options.log);
+            // Индекс собирается из бакетов, поэтому с ним раскладывается и упорядоченный вход
+            if (options.sortedCheck.value_or(true) && options.indexPath.empty()) {
+                auto scanStart = std::chrono::steady_clock::now();
+                uint64_t distinct = 0, brokenAt = 0;
+                if (countSortedInput(path, fileSize, chunksFor(fileSize), *pool, ctx.progress, distinct, brokenAt)) {
+                    if (options.log) {
+                        *options.log << std::fixed << std::setprecision(3)
+                                     << "Input is sorted: counted in one streaming pass of "
+                                     << ctx.progress.lines.load() << " line(s) in " << secondsSince(scanStart)
+                                     << " s, no temporary files" << std::endl;
+                    }
+                    sortedPending = true;
+                    sortedPath = path;
+                    sortedCount = distinct;
+                    return;
+                }
+                if (options.log) {
+                    *options.log << "Input is not sorted (order breaks near byte " << brokenAt << "), partitioning"
+                                 << std::endl;
+                }
+                ctx.progress.lines = 0;
+            }
+        }
+        flushSorted();
+        partitionFile(path, fileSize);
+    }
+
+    size_t addTextBuffer(const char* text, size_t length) {
+        checkOpen();
+        checkNotCheckpointed();
+        flushSorted();
+        start();
+        const char* end = text + length;
+        size_t accepted = 0;
+        if (!carry.empty()) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', length));
+            if (!eol) {
+                carry.append(text, length);
+                return 0;
+            }
+            carry.append(text, eol - text);
+            accepted += addLine(ownWriter(), carry.data(), carry.size());
+            carry.clear();
+            text = eol + 1;
+        }
+        // Хвост без перевода строки ждет следующего вызова
+        const char* last = end;
+        while (last > text && last[-1] != '\n') --last;
+        carry.assign(last, end);
+
+        size_t bytes = last - text;
+        if (bytes < INGEST_TASK_BYTES || pool->size() == 1) return accepted + addLines(ownWriter(), text, last);
+
+        // Куски режутся по переводам строк
+        std::atomic<size_t> total{accepted};
+        size_t nTasks = std::min<size_t>(4 * pool->size(), bytes / (INGEST_TASK_BYTES / 4));
+        const char* begin = text;
+        for (size_t t = 1; t <= nTasks && begin < last; ++t) {
+            const char* cut = t == nTasks ? last : text + bytes * t / nTasks;
+            while (cut < last && cut[-1] != '\n') ++cut;
+            if (cut <= begin) continue;
+            pool->submit(phase1, [this, &total, begin, cut]() {
+                total += addLines(workerWriter(), begin, cut);
+            });
+            begin = cut;
+        }
+        pool->wait(phase1);
+        return total.load();
+    }
+
+    void addBatch(const uint128_t* keys, size_t count) {
+        checkOpen();
+        checkNotCheckpointed();
+        flushSorted();
+        start();
+        if (count * sizeof(uint128_t) < INGEST_TASK_BYTES || pool->size() == 1) {
+            BucketWriter& writer = ownWriter();
+            for (size_t i = 0; i < count; ++i) addKey(writer, keys[i]);
+            return;
+        }
+        size_t nTasks = std::min<size_t>(4 * pool->size(), count * sizeof(uint128_t) / (INGEST_TASK_BYTES / 4));
+        for (size_t t = 0; t < nTasks; ++t) {
+            size_t begin = count * t / nTasks;
+            size_t end = count * (t + 1) / nTasks;
+            pool->submit(phase1, [this, keys, begin, end]() {
+                BucketWriter& writer = workerWriter();
+                for (size_t i = begin; i < end; ++i) addKey(writer, keys[i]);
+            });
+        }
+        pool->wait(phase1);
+    }
+
+    bool add(std::string_view line) {
+        checkOpen();
+        checkNotCheckpointed();
+        flushSorted();
+        start();
+        return addLine(ownWriter(), line.data(), line.size());
+    }
+
+    uint64_t finalize() {
+        if (finalized) return result;
+        if (!carry.empty()) {
+            addLine(ownWriter(), carry.data(), carry.size());
+            carry.clear();
+        }
+        if (!options.indexPath.empty()) {
+            index.reset(new IndexBuilder(ctx.tempPrefix));
+            ctx.index = index.get();
+        }
+        if (!files) {
+            // Ничего не раскладывалось: либо пусто, либо один упорядоченный файл
+            result = sortedPending ? sortedCount : 0;
+            sortedPending = false;
+            if (index) index->write(options.indexPath, *pool);
+            finalized = true;
+            return result;
+        }
+
+        // Остатки буферов тоже пишутся задачами пула
+        flushWriters();
+        pool->wait(compaction);
+        writers.clear();
+        callerWriter.reset();
+        for (auto& pipeline : pipelines) pipeline->releaseWriters();
+        files->closeAll();
+        phase1Seconds = secondsSince(phase1Start);
+
+        // Фаза 2: Параллельная обработка бакетов
+        if (options.log) *options.log << "Phase 2: Counting uniques in buckets..." << std::endl;
+        auto phase2Start = std::chrono::steady_clock::now();
+        countBuckets();
+        phase2Seconds = secondsSince(phase2Start);
+        if (manifest) {
+            // Подсчет завершен, продолжать нечего
+            for (size_t b : countedFiles) std::remove(files->fileName(b).c_str());
+            countedFiles.clear();
+            std::remove(options.checkpoint.c_str());
+        }
+        if (index) {
+            if (options.log) *options.log << "Writing index " << options.indexPath << "..." << std::endl;
+            index->write(options.indexPath, *pool);
+        }
+
+        result = ctx.uniqueCount.load();
+        finalized = true;
+        return result;
+    }
+
+    void countBuckets() {
+        BucketFiles& files = *this->files;
+        ThreadPool& pool = *this->pool;
+
+        // Крупные бакеты запускаются первыми, чтобы в конце фазы не ждать один большой бакет.
+        // Бакеты, посчитанные до перезапуска, берутся из манифеста.
+        std::vector<size_t> order;
+        for (size_t b = 0; b < files.count(); ++b) {
+            if (manifest && manifest->counted[b] != NOT_COUNTED) {
+                ctx.uniqueCount += manifest->counted[b];
+                std::remove(files.fileName(b).c_str());
+                continue;
+            }
+            order.push_back(b);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return files.countIn(a) > files.countIn(b);
+        });
+
+        // Рабочие области выделяются и заполняются потоками пула, поэтому оказываются на их NUMA-узлах
+        ArenaPool arenas(ctx, pool.size());
+        TaskGroup phase2;
+        // Бакеты в памяти уже уместились в бюджет, делить их не нужно
+        auto needsSplit = [&](size_t b) {
+            return ctx.partition.subBits > 0 && !files.inMemory(b) && files.countIn(b) >= SECOND_LEVEL_MIN_KEYS;
+        };
+        auto bucketTask = [&](size_t b) {
+            size_t worker = ThreadPool::currentWorker();
+            std::unique_ptr<BucketArena> arena = arenas.acquire(worker);
+            uint64_t unique;
+            if (compactor && compactor->runKeys(b) > 0) {
+                unique = processCompactedBucket(ctx, files.fileName(b), compactor->runFd(b), compactor->runKeys(b),
+                                                *arena, pool);
+            } else if (files.inMemory(b)) {
+                unique = processMemoryBucket(ctx, files, b, *arena, pool);
+            } else if (needsSplit(b)) {
+                unique = splitAndProcessBucket(ctx, files, b, *arena, arenas, pool);
+            } else {
+                unique = processBucket(ctx, files.fileName(b), files.profile(b), *arena, pool);
+            }
+            arenas.release(worker, std::move(arena));
+            bucketCounted(b, unique);
+        };
+#if HAVE_COROUTINES
+        if (io) {
+            // Загружено одновременно не больше двух бакетов на поток: остальные ждут в семафоре, не занимая потоков.
+            // Бакеты в памяти и бакеты второго уровня обрабатываются синхронно: читать целиком из файла их не нужно.
+            TaskGroup resumptions;
+            AsyncSemaphore inFlight(pool, resumptions, 2 * pool.size());
+            for (size_t b : order) {
+                pool.submitOuter(phase2, [&, b]() {
+                    if (files.inMemory(b) || needsSplit(b)) {
+                        bucketTask(b);
+                    } else {
+                        ioScope.spawn(processBucketAsync(ctx, files.fileName(b), files.profile(b), arenas, pool,
+                                                         *io, inFlight,
+                                                         [this, b](uint64_t unique) { bucketCounted(b, unique); }));
+                    }
+                });
+            }
+            pool.wait(phase2);
+            ioScope.wait();
+            pool.wait(resumptions);
+            return;
+        }
+#endif
+        for (size_t b : order) {
+            pool.submitOuter(phase2, [&, b]() { bucketTask(b); });
+        }
+        pool.wait(phase2);
+    }
+
+    void printStats(std::ostream& out) const {
+        // Упорядоченный вход посчитан без фаз и временных файлов
+        if (!files || !finalized) return;
+        out << std::fixed << std::setprecision(3)
+            << "Timing: phase 1 " << phase1Seconds << " s, phase 2 " << phase2Seconds << " s" << std::endl;
+        out << "Partitioning: " << ctx.partition.buckets() << " bucket(s)";
+        if (ctx.partition.subBits > 0) {
+            out << ", second level " << ctx.partition.subBuckets() << " sub-bucket(s) for buckets over "
+                << SECOND_LEVEL_MIN_KEYS * sizeof(uint128_t) / (1024 * 1024) << " MB, "
+                << ctx.splitBuckets.load() << " split";
+        }
+        out << std::endl;
+        if (ctx.prefilterBytes > 0) {
+            uint64_t checked = ctx.prefilterChecked.load();
+            out << "Prefilter: dropped " << ctx.prefilterDropped.load() << " of " << checked << " key(s) ("
+                << std::setprecision(1) << (checked ? 100.0 * ctx.prefilterDropped.load() / checked : 0.0)
+                << "%), " << RecentKeyFilter(ctx.prefilterBytes).bytes() / 1024 << " KB per writer" << std::endl;
+        }
+        files->printMemoryUse(out);
+        out << std::setprecision(1) << "Write buffers: " << ctx.writerSlots << " writer slot(s) of "
+            << BucketWriter::slabBytes(ctx, ctx.partition.buckets()) / (1024.0 * 1024.0) << " MB within "
+            << ctx.writeBudgetBytes / (1024.0 * 1024.0) << " MB budget" << std::endl;
+        if (compactor) compactor->printStats(out);
+        if (index) index->printStats(out);
+        if (manifest) {
+            out << "Checkpoint: " << checkpointsSaved << " manifest write(s) to " << options.checkpoint;
+            if (resumed) {
+                out << ", resumed at byte " << resumedOffset << " with " << resumedCounted
+                    << " bucket(s) already counted";
+            }
+            out << std::endl;
+        }
+        printEngineStats(out, ctx);
+        ctx.memory.printStats(out);
+        pool->printStats(out);
+        for (const auto& pipeline : pipelines) pipeline->printStats(out);
+#if HAVE_COROUTINES
+        if (io) io->printStats(out);
+#endif
+        out << "Phase 2 arenas: " << std::setprecision(1) << ctx.arenaBytes.load() / (1024.0 * 1024.0)
+            << " MB across " << nThreads << " worker(s)" << std::endl;
+    }
+};
+
+DistinctCounter::DistinctCounter(const DistinctCounterOptions& options) : impl(new Impl(options)) {}
+
+DistinctCounter::~DistinctCounter() = default;
+
+bool DistinctCounter::add(std::string_view line) {
+    return impl->add(line);
+}
+
+void DistinctCounter::add_batch(const uint128_t* keys, size_t count) {
+    impl->addBatch(keys, count);
+}
+
+size_t DistinctCounter::add_text_buffer(const char* text, size_t length) {
+    return impl->addTextBuffer(text, length);
+}
+
+void DistinctCounter::add_file(const std::string& path) {
+    impl->addFile(path);
+}
+
+uint64_t DistinctCounter::finalize() {
+    return impl->finalize();
+}
+
+void DistinctCounter::print_stats(std::ostream& out) const {
+    impl->printStats(out);
+}
+
+// Живой подсчет: добавлять можно из многих потоков сразу, каждый бакет защищен своим мьютексом.
+// Слияние новых ключей с прогоном выполняет добавивший их поток, count() считает бакеты задачами пула.
+struct LiveDistinctCounter::Impl {
+    DistinctCounterOptions options;
+    CounterContext ctx;
+    NumaTopology topo;
+    std::unique_ptr<ThreadPool> pool;
+    uint64_t memoryBudget = 0;
+    size_t bucketCount = 0;
+    std::unique_ptr<LiveBucket[]> buckets;
+
+    std::mutex spillLock;
+    std::atomic<uint64_t> runBytes{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> merges{0};
+    std::atomic<uint64_t> spills{0};
+    std::atomic<uint64_t> queries{0};
+
+    explicit Impl(const DistinctCounterOptions& opts) : options(opts), ctx(opts.hugePages) {
+        configureContext(options, ctx);
+        ctx.partition = partitionFor(options);
+        ctx.partition.subBits = 0; // Бакеты живого подсчета и так сливаются по частям
+        memoryBudget = options.memoryBytes.value_or(defaultMemoryBudget());
+        topo = detectNumaTopology();
+        size_t nThreads = threadCount(options, topo);
+        if (options.log) printTopology(*options.log, topo, nThreads);
+        pool.reset(new ThreadPool(topo, nThreads));
+        bucketCount = ctx.partition.buckets();
+        buckets.reset(new LiveBucket[bucketCount]);
+    }
+
+    ~Impl() {
+        for (size_t b = 0; b < bucketCount; ++b) {
+            LiveBucket& bucket = buckets[b];
+            ctx.memory.release(bucket.run, bucket.runCapacity * sizeof(uint128_t));
+            if (bucket.fd >= 0) {
+                close(bucket.fd);
+                std::remove(runFileName(b).c_str());
+            }
+        }
+    }
+
+    std::string runFileName(size_t b) const {
+        return ctx.tempPrefix + "live_" + std::to_string(b) + ".bin";
+    }
+
+    size_t addText(const char* text, size_t length) {
+        const char* end = text + length;
+        std::vector<uint128_t> keys;
+        keys.reserve(std::min(LIVE_PARSE_KEYS, length / 4 + 1));
+        size_t total = 0;
+        while (text < end) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            if (!eol) eol = end;
+            size_t len = eol - text;
+            if (len > 0 && text[len - 1] == '\r') len--;
+            uint128_t key;
+            if (len > 0 && parseIPv6(text, len, key)) {
+                keys.push_back(key);
+                if (keys.size() == LIVE_PARSE_KEYS) {
+                    addKeys(keys.data(), keys.size());
+                    total += keys.size();
+                    keys.clear();
+                }
+            }
+            text = eol + 1;
+        }
+        addKeys(keys.data(), keys.size());
+        return total + keys.size();
+    }
+
+    // Раскладка подсчетом: каждый бакет захватывается один раз на вызов
+    void addKeys(const uint128_t* keys, size_t count) {
+        if (count == 0) return;
+        const unsigned shift = 64 - ctx.partition.bits;
+        std::vector<size_t> starts(bucketCount + 1, 0);
+        for (size_t i = 0; i < count; ++i) starts[(keys[i].hi >> shift) + 1]++;
+        for (size_t b = 0; b < bucketCount; ++b) starts[b + 1] += starts[b];
+        std::vector<uint128_t> grouped(count);
+        std::vector<size_t> cursor(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < count; ++i) grouped[cursor[keys[i].hi >> shift]++] = keys[i];
+
+        for (size_t b = 0; b < bucketCount; ++b) {
+            if (starts[b + 1] > starts[b]) append(b, grouped.data() + starts[b], starts[b + 1] - starts[b]);
+        }
+        accepted += count;
+    }
+
+    void append(size_t b, const uint128_t* keys, size_t count) {
+        LiveBucket& bucket = buckets[b];
+        bool merged = false;
+        {
+            std::lock_guard<std::mutex> guard(bucket.lock);
+            bucket.delta.insert(bucket.delta.end(), keys, keys + count);
+            if (bucket.delta.size() >= bucket.mergeThreshold()) {
+                merge(bucket, b);
+                merged = true;
+            }
+        }
+        // Сброс захватывает мьютекс другого бакета, поэтому только после освобождения своего
+        if (merged && runBytes.load() > memoryBudget) spillLargest();
+    }
+
+    // Вызывать под мьютексом бакета
+    void merge(LiveBucket& bucket, size_t b) {
+        sortUnique(ctx.sortKernel, bucket.delta);
+        size_t runKeys = bucket.runKeys.load();
+        if (!bucket.spilled) {
+            size_t capacity = runKeys + bucket.delta.size();
+            uint128_t* merged = static_cast<uint128_t*>(ctx.memory.allocate(capacity * sizeof(uint128_t)));
+            uint128_t* end = std::set_union(bucket.run, bucket.run + runKeys,
+                                            bucket.delta.begin(), bucket.delta.end(), merged);
+            ctx.memory.release(bucket.run, bucket.runCapacity * sizeof(uint128_t));
+            runBytes += capacity * sizeof(uint128_t);
+            runBytes -= bucket.runCapacity * sizeof(uint128_t);
+            bucket.run = merged;
+            bucket.runCapacity = capacity;
+            bucket.runKeys = end - merged;
+        } else {
+            mergeSpilled(bucket, b);
+        }
+        bucket.delta.clear();
+        if (bucket.delta.capacity() > 2 * LIVE_DELTA_MAX_KEYS) std::vector<uint128_t>().swap(bucket.delta);
+        bucket.checkedDelta = SIZE_MAX;
+        merges++;
+    }
+
+    // Потоковое слияние прогона из файла с новыми ключами в новый файл, который затем занимает его место
+    void mergeSpilled(LiveBucket& bucket, size_t b) {
+        std::string name = runFileName(b);
+        std::string tmpName = name + ".tmp";
+        int out = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) throw std::runtime_error("Could not create temp file " + tmpName);
+
+        RunReader run(bucket.fd, bucket.runKeys.load());
+        size_t written;
+        try {
+            written = writeMergedRun(run, bucket.delta.data(), bucket.delta.size(), out);
+        } catch (...) {
+            close(out);
+            std::remove(tmpName.c_str());
+            throw;
+        }
+
+        close(bucket.fd);
+        if (std::rename(tmpName.c_str(), name.c_str()) != 0) {
+            bucket.fd = -1;
+            close(out);
+            throw std::runtime_error("Could not replace temp file " + name);
+        }
+        bucket.fd = out;
+        bucket.runKeys = written;
+    }
+
+    // Прогоны сверх бюджета уходят на диск, начиная с самого большого
+    void spillLargest() {
+        std::lock_guard<std::mutex> spillGuard(spillLock);
+        while (runBytes.load() > memoryBudget) {
+            size_t victim = SIZE_MAX, largest = 0;
+            for (size_t b = 0; b < bucketCount; ++b) {
+                size_t keys = buckets[b].runKeys.load();
+                if (!buckets[b].spilled.load() && keys > largest) {
+                    largest = keys;
+                    victim = b;
+                }
+            }
+            if (victim == SIZE_MAX) return;
+
+            LiveBucket& bucket = buckets[victim];
+            std::lock_guard<std::mutex> guard(bucket.lock);
+            if (bucket.spilled || !bucket.run) continue;
+            std::string name = runFileName(victim);
+            int fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) throw std::runtime_error("Could not create temp file " + name);
+            writeFully(fd, bucket.run, bucket.runKeys.load() * sizeof(uint128_t), 0);
+            ctx.memory.release(bucket.run, bucket.runCapacity * sizeof(uint128_t));
+            runBytes -= bucket.runCapacity * sizeof(uint128_t);
+            bucket.run = nullptr;
+            bucket.runCapacity = 0;
+            bucket.fd = fd;
+            bucket.spilled = true;
+            spills++;
+        }
+    }
+
+    // Новые ключи при подсчете сортируются на месте; пока их не прибавилось, бакет не пересчитывается
+    size_t countBucket(LiveBucket& bucket) {
+        std::lock_guard<std::mutex> guard(bucket.lock);
+        size_t distinct = bucket.runKeys.load();
+        if (bucket.delta.empty()) return distinct;
+        if (bucket.checkedDelta != bucket.delta.size()) {
+            sortUnique(ctx.sortKernel, bucket.delta);
+            if (bucket.spilled) {
+                RunReader run(bucket.fd, distinct);
+                bucket.checkedNew = countMissing(run, bucket.delta.data(), bucket.delta.size());
+            } else {
+                bucket.checkedNew = countMissing(bucket.run, distinct, bucket.delta);
+            }
+            bucket.checkedDelta = bucket.delta.size();
+        }
+        return distinct + bucket.checkedNew;
+    }
+
+    uint64_t count() {
+        queries++;
+        std::atomic<uint64_t> total{0};
+        TaskGroup group;
+        size_t nTasks = std::min(bucketCount, 4 * pool->size());
+        for (size_t t = 0; t < nTasks; ++t) {
+            size_t begin = bucketCount * t / nTasks;
+            size_t end = bucketCount * (t + 1) / nTasks;
+            pool->submit(group, [this, &total, begin, end]() {
+                uint64_t sum = 0;
+                for (size_t b = begin; b < end; ++b) sum += countBucket(buckets[b]);
+                total += sum;
+            });
+        }
+        pool->wait(group);
+        return total.load();
+    }
+
+    void printStats(std::ostream& out) const {
+        size_t onDisk = 0;
+        for (size_t b = 0; b < bucketCount; ++b) onDisk += buckets[b].spilled.load();
+        const double MB = 1024.0 * 1024.0;
+        out << std::fixed << std::setprecision(1) << "Live: " << bucketCount << " bucket(s), "
+            << accepted.load() << " address(es) added, " << merges.load() << " merge(s), "
+            << onDisk << " run(s) on disk, " << runBytes.load() / MB << " MB of runs in memory of "
+            << memoryBudget / MB << " MB budget, " << queries.load() << " count quer(ies)" << std::endl;
+        ctx.memory.printStats(out);
+        pool->printStats(out);
+    }
+};
+
+LiveDistinctCounter::LiveDistinctCounter(const DistinctCounterOptions& options) : impl(new Impl(options)) {}
+
+LiveDistinctCounter::~LiveDistinctCounter() = default;
+
+size_t LiveDistinctCounter::add_text_buffer(const char* text, size_t length) {
+    return impl->addText(text, length);
+}
+
+void LiveDistinctCounter::add_batch(const uint128_t* keys, size_t count) {
+    impl->addKeys(keys, count);
+}
+
+uint64_t LiveDistinctCounter::count() {
+    return impl->count();
+}
+
+void LiveDistinctCounter::print_stats(std::ostream& out) const {
+    impl->printStats(out);
+}
+
+struct WindowedDistinctCounter::Impl {
+    DistinctCounterOptions options;
+    WindowOptions format;
+    std::function<void(const WindowCount&)> emit;
+    NumaTopology topo;
+    std::unique_ptr<ThreadPool> pool;
+    bool sliding = false;
+    int64_t slotSeconds = 0;
+    int64_t lateness = 0;
+    size_t slotsPerWindow = 1;
+
+    std::map<int64_t, WindowSlot> open;       // Открытые слоты по номеру
+    std::deque<HyperLogLog> history;          // Последние закрытые слоты скользящего окна
+    int64_t nextSlot = 0;                     // Первый незакрытый слот (после закрытия первого)
+    bool started = false;
+    int64_t maxTime = INT64_MIN;
+    int64_t recentSlot = INT64_MIN;           // Слот последней строки: строки журнала идут подряд по времени
+    WindowSlot* recent = nullptr;
+    std::string carry;
+    LineProgress progress;
+
+    uint64_t lines = 0;
+    uint64_t accepted = 0;
+    uint64_t late = 0;
+    uint64_t windows = 0;
+    uint64_t gaps = 0;
+
+    Impl(const DistinctCounterOptions& opts, const WindowOptions& windowOptions,
+         std::function<void(const WindowCount&)> emitWindow)
+        : options(opts), format(windowOptions), emit(std::move(emitWindow)) {
+        if (format.windowSeconds == 0) throw std::invalid_argument("Window length must be positive.");
+        if (format.stepSeconds > 0 && format.windowSeconds % format.stepSeconds != 0) {
+            throw std::invalid_argument("Window step must divide the window length.");
+        }
+        if (format.addressField == 0 || format.timeField == 0 || format.addressField == format.timeField) {
+            throw std::invalid_argument("Address and time fields must be different and numbered from 1.");
+        }
+        sliding = format.stepSeconds > 0 && format.stepSeconds < format.windowSeconds;
+        slotSeconds = sliding ? format.stepSeconds : format.windowSeconds;
+        slotsPerWindow = format.windowSeconds / slotSeconds;
+        lateness = format.latenessSeconds.value_or(slotSeconds);
+        progress.log = options.log;
+        topo = detectNumaTopology();
+        size_t nThreads = threadCount(options, topo);
+        if (options.log) printTopology(*options.log, topo, nThreads);
+        pool.reset(new ThreadPool(topo, nThreads));
+    }
+
+    void parseLines(const char* text, const char* end, std::vector<WindowEvent>& events, uint64_t& count) const {
+        while (text < end) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            if (!eol) eol = end;
+            const char* lineEnd = eol > text && eol[-1] == '\r' ? eol - 1 : eol;
+            WindowEvent event;
+            if (lineEnd > text && parseWindowLine(text, lineEnd, format, event)) events.push_back(event);
+            count++;
+            text = eol + 1;
+        }
+    }
+
+    void apply(const WindowEvent& event) {
+        int64_t slot = floorDiv(event.time, slotSeconds);
+        if (slot != recentSlot) {
+            if (started && slot < nextSlot) {
+                late++;
+                return;
+            }
+            recent = &open[slot];
+            recentSlot = slot;
+        }
+        uint64_t hash = hashKey(event.key);
+        if (sliding) {
+            if (!recent->sketch) recent->sketch.reset(new HyperLogLog());
+            recent->sketch->add(hash);
+        } else {
+            recent->keys.insert(event.key, hash);
+        }
+        accepted++;
+        if (event.time > maxTime) {
+            maxTime = event.time;
+            // Слот k закрыт, когда (k + 1) * slotSeconds + lateness <= maxTime
+            closeThrough(floorDiv(maxTime - lateness, slotSeconds) - 1);
+        }
+    }
+
+    void closeThrough(int64_t last) {
+        if (!started) {
+            if (open.empty() || open.begin()->first > last) return;
+            nextSlot = open.begin()->first;
+            started = true;
+        }
+        while (nextSlot <= last) {
+            if (!open.empty() && open.begin()->first == nextSlot) {
+                if (recentSlot == nextSlot) {
+                    recent = nullptr;
+                    recentSlot = INT64_MIN;
+                }
+                closeSlot(nextSlot++, &open.begin()->second);
+                open.erase(open.begin());
+                continue;
+            }
+            int64_t nextData = open.empty() ? last + 1 : std::min(open.begin()->first, last + 1);
+            if (nextData - nextSlot > WINDOW_MAX_EMPTY_SLOTS) {
+                // Долгий перерыв в данных: выводятся окна с остатком прежних данных, дальше пустые пропускаются
+                int64_t flushed = nextSlot + int64_t(slotsPerWindow) - 1;
+                while (nextSlot < flushed) closeSlot(nextSlot++, nullptr);
+                history.clear();
+                nextSlot = nextData;
+                gaps++;
+                continue;
+            }
+            closeSlot(nextSlot++, nullptr);
+        }
+    }
+
+    void closeSlot(int64_t slot, WindowSlot* data) {
+        WindowCount window;
+        window.end = (slot + 1) * slotSeconds;
+        window.start = window.end - int64_t(format.windowSeconds);
+        window.exact = !sliding;
+        if (sliding) {
+            history.push_back(data && data->sketch ? std::move(*data->sketch) : HyperLogLog());
+            if (history.size() > slotsPerWindow) history.pop_front();
+            HyperLogLog merged = history.back();
+            for (size_t i = 0; i + 1 < history.size(); ++i) merged.merge(history[i]);
+            window.distinct = merged.estimate();
+        } else {
+            window.distinct = data ? data->keys.size() : 0;
+        }
+        windows++;
+        emit(window);
+    }
+
+    size_t addText(const char* text, size_t length) {
+        const char* end = text + length;
+        std::vector<WindowEvent> events;
+        uint64_t count = 0;
+        if (!carry.empty()) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', length));
+            if (!eol) {
+                carry.append(text, length);
+                return 0;
+            }
+            carry.append(text, eol - text);
+            parseLines(carry.data(), carry.data() + carry.size(), events, count);
+            carry.clear();
+            text = eol + 1;
+        }
+        // Хвост без перевода строки ждет следующего вызова
+        const char* last = end;
+        while (last > text && last[-1] != '\n') --last;
+        carry.assign(last, end);
+
+        // Разбор параллельно кусками, события применяются по порядку строк
+        size_t bytes = last - text;
+        size_t nTasks = bytes < WINDOW_TASK_BYTES || pool->size() == 1
+            ? 1 : std::min<size_t>(4 * pool->size(), bytes / (WINDOW_TASK_BYTES / 4));
+        std::vector<std::vector<WindowEvent>> parts(nTasks);
+        std::vector<uint64_t> counts(nTasks, 0);
+        if (nTasks == 1) {
+            parseLines(text, last, parts[0], counts[0]);
+        } else {
+            TaskGroup group;
+            const char* begin = text;
+            for (size_t t = 0; t < nTasks && begin < last; ++t) {
+                const char* cut = t + 1 == nTasks ? last : text + bytes * (t + 1) / nTasks;
+                while (cut < last && cut[-1] != '\n') ++cut;
+                if (cut <= begin) continue;
+                pool->submit(group, [this, &parts, &counts, t, begin, cut]() {
+                    parseLines(begin, cut, parts[t], counts[t]);
+                });
+                begin = cut;
+            }
+            pool->wait(group);
+        }
+
+        size_t before = accepted;
+        for (const WindowEvent& event : events) apply(event);
+        for (size_t t = 0; t < nTasks; ++t) {
+            for (const WindowEvent& event : parts[t]) apply(event);
+            count += counts[t];
+        }
+        lines += count;
+        progress.add(count);
+        return accepted - before;
+    }
+
+    void addFile(const std::string& path) {
+        std::ifstream inFile(path, std::ios::binary);
+        if (!inFile.is_open()) throw std::runtime_error("Could not open input file " + path);
+        std::vector<char> block(std::max<size_t>(1, pool->size()) * WINDOW_TASK_BYTES);
+        while (inFile) {
+            inFile.read(block.data(), block.size());
+            size_t got = inFile.gcount();
+            if (got == 0) break;
+            addText(block.data(), got);
+        }
+        if (inFile.bad()) throw std::runtime_error("Error reading input file " + path);
+    }
+
+    void finish() {
+        if (!carry.empty()) {
+            std::string tail;
+            tail.swap(carry);
+            tail.push_back('\n');
+            addText(tail.data(), tail.size());
+        }
+        if (!open.empty()) closeThrough(open.rbegin()->first);
+    }
+
+    void printStats(std::ostream& out) const {
+        out << "Windows: " << windows << " window(s) of " << format.windowSeconds << " s";
+        if (sliding) out << " sliding by " << slotSeconds << " s (HyperLogLog)";
+        else out << " (exact)";
+        out << ", " << lines << " line(s), " << accepted << " counted, " << lines - accepted - late
+            << " without IPv6 address or time, " << late << " late by over " << lateness << " s";
+        if (gaps > 0) out << ", " << gaps << " long gap(s) skipped";
+        out << std::endl;
+        pool->printStats(out);
+    }
+};
+
+WindowedDistinctCounter::WindowedDistinctCounter(const DistinctCounterOptions& options, const WindowOptions& windows,
+                                                 std::function<void(const WindowCount&)> emit)
+    : impl(new Impl(options, windows, std::move(emit))) {}
+
+WindowedDistinctCounter::~WindowedDistinctCounter() = default;
+
+size_t WindowedDistinctCounter::add_text_buffer(const char* text, size_t length) {
+    return impl->addText(text, length);
+}
+
+void WindowedDistinctCounter::add_file(const std::string& path) {
+    impl->addFile(path);
+}
+
+void WindowedDistinctCounter::finish() {
+    impl->finish();
+}
+
+void WindowedDistinctCounter::print_stats(std::ostream& out) const {
+    impl->printStats(out);
+}
+
+struct MultiDistinctCounter::Impl {
+    DistinctCounterOptions options;
+    std::vector<Aggregation> aggregations;
+    AggregationMasks masks;
+    CounterContext ctx;
+    NumaTopology topo;
+    std::unique_ptr<ThreadPool> pool;
+    uint64_t memoryBudget = 0;
+    size_t bucketCount = 0;
+    std::unique_ptr<MultiBucket[]> buckets;
+    std::unique_ptr<std::atomic<uint64_t>[]> bucketBytes; // Записи бакета в памяти, для выбора сбрасываемого
+
+    std::mutex spillLock;
+    std::atomic<uint64_t> memoryTotal{0};
+    std::atomic<uint64_t> memoryPeak{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> records{0};
+    std::atomic<uint64_t> spills{0};
+    std::chrono::steady_clock::time_point started;
+    double phase1Seconds = 0;
+    double phase2Seconds = 0;
+    bool finalized = false;
+    std::vector<uint64_t> counts;
+
+    Impl(const DistinctCounterOptions& opts, const std::vector<Aggregation>& aggs)
+        : options(opts), aggregations(aggs), masks(aggs), ctx(false) {
+        for (size_t a = 0; a < aggregations.size(); ++a) {
+            if (aggregations[a].name.empty()) throw std::invalid_argument("Aggregation names must not be empty.");
+            for (size_t b = 0; b < a; ++b) {
+                if (aggregations[b].name == aggregations[a].name) {
+                    throw std::invalid_argument("Duplicate aggregation name " + aggregations[a].name);
+                }
+            }
+        }
+        configureContext(options, ctx);
+        ctx.partition = partitionFor(options);
+        ctx.partition.subBits = 0; // Записи раскладываются по хэшу, перекоса префиксов у бакетов нет
+        memoryBudget = options.memoryBytes.value_or(defaultMemoryBudget());
+        topo = detectNumaTopology();
+        size_t nThreads = threadCount(options, topo);
+        if (options.log) printTopology(*options.log, topo, nThreads);
+        pool.reset(new ThreadPool(topo, nThreads));
+        bucketCount = ctx.partition.buckets();
+        buckets.reset(new MultiBucket[bucketCount]);
+        bucketBytes.reset(new std::atomic<uint64_t>[bucketCount]);
+        for (size_t b = 0; b < bucketCount; ++b) bucketBytes[b] = 0;
+        started = std::chrono::steady_clock::now();
+    }
+
+    ~Impl() {
+        for (size_t b = 0; b < bucketCount; ++b) {
+            if (buckets[b].fd < 0) continue;
+            close(buckets[b].fd);
+            std::remove(bucketFileName(b).c_str());
+        }
+    }
+
+    std::string bucketFileName(size_t b) const {
+        return ctx.tempPrefix + "multi_" + std::to_string(b) + ".bin";
+    }
+
+    void checkOpen() const {
+        if (finalized) throw std::logic_error("MultiDistinctCounter is already finalized");
+    }
+
+    uint64_t sourceBits(const std::string& source) const {
+        return masks.sourceMask(source);
+    }
+
+    // Записи раскладываются по бакетам по хэшу адреса (префикса), а не по старшим битам:
+    // огрубленные префиксы и адреса из одного списка клиента иначе собрались бы в немногих бакетах
+    void scatter(std::vector<TaggedKey>& tagged) {
+        if (tagged.empty()) return;
+        const unsigned shift = 64 - ctx.partition.bits;
+        std::vector<size_t> starts(bucketCount + 1, 0);
+        std::vector<uint32_t> bucketOf(tagged.size());
+        for (size_t i = 0; i < tagged.size(); ++i) {
+            bucketOf[i] = uint32_t(hashKey(uint128_t{tagged[i].hi, tagged[i].lo}) >> shift);
+            starts[bucketOf[i] + 1]++;
+        }
+        for (size_t b = 0; b < bucketCount; ++b) starts[b + 1] += starts[b];
+        std::vector<TaggedKey> grouped(tagged.size());
+        std::vector<size_t> cursor(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < tagged.size(); ++i) grouped[cursor[bucketOf[i]]++] = tagged[i];
+
+        for (size_t b = 0; b < bucketCount; ++b) {
+            if (starts[b + 1] > starts[b]) append(b, grouped.data() + starts[b], starts[b + 1] - starts[b]);
+        }
+        records += tagged.size();
+        tagged.clear();
+    }
+
+    void append(size_t b, const TaggedKey* data, size_t count) {
+        MultiBucket& bucket = buckets[b];
+        uint64_t bytes = count * sizeof(TaggedKey);
+        uint64_t total;
+        {
+            std::lock_guard<std::mutex> guard(bucket.lock);
+            bucket.records.insert(bucket.records.end(), data, data + count);
+            bucketBytes[b] += bytes;
+            total = memoryTotal += bytes;
+        }
+        uint64_t peak = memoryPeak.load();
+        while (total > peak && !memoryPeak.compare_exchange_weak(peak, total)) {}
+        if (total > memoryBudget) spillLargest();
+    }
+
+    // Самые большие бакеты дописываются в свои файлы, пока записи в памяти не уложатся в бюджет
+    void spillLargest() {
+        std::lock_guard<std::mutex> spillGuard(spillLock);
+        while (memoryTotal.load() > memoryBudget) {
+            size_t victim = 0;
+            for (size_t b = 1; b < bucketCount; ++b) {
+                if (bucketBytes[b].load() > bucketBytes[victim].load()) victim = b;
+            }
+            if (bucketBytes[victim].load() == 0) return;
+
+            MultiBucket& bucket = buckets[victim];
+            std::lock_guard<std::mutex> guard(bucket.lock);
+            if (bucket.fd < 0) {
+                std::string name = bucketFileName(victim);
+                bucket.fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (bucket.fd < 0) throw std::runtime_error("Could not create temp file " + name);
+            }
+            writeFully(bucket.fd, bucket.records.data(), bucket.records.size() * sizeof(TaggedKey),
+                       bucket.fileRecords * sizeof(TaggedKey));
+            bucket.fileRecords += bucket.records.size();
+            memoryTotal -= bucket.records.size() * sizeof(TaggedKey);
+            bucketBytes[victim] = 0;
+            std::vector<TaggedKey>().swap(bucket.records);
+            spills++;
+        }
+    }
+
+    size_t addLines(const char* text, const char* end, uint64_t sourceMask) {
+        std::vector<TaggedKey> tagged;
+        tagged.reserve(MULTI_PARSE_RECORDS + masks.granularities.size());
+        size_t total = 0;
+        while (text < end) {
+            const char* eol = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            if (!eol) eol = end;
+            size_t len = eol - text;
+            if (len > 0 && text[len - 1] == '\r') len--;
+            uint128_t key;
+            if (len > 0 && parseIPv6(text, len, key)) {
+                masks.tag(key, sourceMask, tagged);
+                total++;
+                if (tagged.size() >= MULTI_PARSE_RECORDS) scatter(tagged);
+            }
+            text = eol + 1;
+        }
+        scatter(tagged);
+        ctx.progress.add(total);
+        return total;
+    }
+
+    size_t addText(const char* text, size_t length, uint64_t sourceMask) {
+        checkOpen();
+        const char* end = text + length;
+        size_t total;
+        if (length < MULTI_TASK_BYTES || pool->size() == 1) {
+            total = addLines(text, end, sourceMask);
+        } else {
+            // Куски режутся по переводам строк
+            std::atomic<size_t> sum{0};
+            TaskGroup group;
+            size_t nTasks = std::min<size_t>(4 * pool->size(), length / (MULTI_TASK_BYTES / 4));
+            const char* begin = text;
+            for (size_t t = 1; t <= nTasks && begin < end; ++t) {
+                const char* cut = t == nTasks ? end : text + length * t / nTasks;
+                while (cut < end && cut[-1] != '\n') ++cut;
+                if (cut <= begin) continue;
+                pool->submit(group, [this, &sum, begin, cut, sourceMask]() {
+                    sum += addLines(begin, cut, sourceMask);
+                });
+                begin = cut;
+            }
+            pool->wait(group);
+            total = sum.load();
+        }
+        accepted += total;
+        return total;
+    }
+
+    void addBatch(const uint128_t* keys, size_t count, uint64_t sourceMask) {
+        checkOpen();
+        std::vector<TaggedKey> tagged;
+        tagged.reserve(MULTI_PARSE_RECORDS + masks.granularities.size());
+        for (size_t i = 0; i < count; ++i) {
+            masks.tag(keys[i], sourceMask, tagged);
+            if (tagged.size() >= MULTI_PARSE_RECORDS) scatter(tagged);
+        }
+        scatter(tagged);
+        accepted += count;
+    }
+
+    // Файл читается блоками на все потоки; незавершенная строка блока переносится в следующий
+    void addFile(const std::string& path, uint64_t sourceMask) {
+        checkOpen();
+        std::ifstream inFile(path, std::ios::binary);
+        if (!inFile.is_open()) throw std::runtime_error("Could not open input file " + path);
+        std::vector<char> block(std::max<size_t>(1, pool->size()) * MULTI_TASK_BYTES);
+        size_t kept = 0;
+        while (true) {
+            inFile.read(block.data() + kept, block.size() - kept);
+            size_t filled = kept + inFile.gcount();
+            if (filled == kept) break;
+            size_t cut = filled;
+            while (cut > 0 && block[cut - 1] != '\n') --cut;
+            if (cut == 0) {
+                if (filled == block.size()) block.resize(block.size() * 2); // Строка длиннее блока
+                kept = filled;
+                continue;
+            }
+            addText(block.data(), cut, sourceMask);
+            kept = filled - cut;
+            std::memmove(block.data(), block.data() + cut, kept);
+        }
+        if (inFile.bad()) throw std::runtime_error("Error reading input file " + path);
+        if (kept > 0) addText(block.data(), kept, sourceMask);
+    }
+
+    // Бакет целиком: сортировка по адресу, маски одинаковых адресов объединяются,
+    // и адрес прибавляется к каждому подсчету своей маски
+    void countBucket(size_t b, uint64_t* local) {
+        MultiBucket& bucket = buckets[b];
+        std::vector<TaggedKey> all;
+        all.swap(bucket.records);
+        memoryTotal -= all.size() * sizeof(TaggedKey);
+        if (bucket.fileRecords > 0) {
+            size_t inMemory = all.size();
+            all.resize(inMemory + bucket.fileRecords);
+            std::memmove(all.data() + bucket.fileRecords, all.data(), inMemory * sizeof(TaggedKey));
+            for (uint64_t done = 0; done < bucket.fileRecords; done += MULTI_BLOCK_RECORDS) {
+                size_t n = std::min<uint64_t>(MULTI_BLOCK_RECORDS, bucket.fileRecords - done);
+                readFully(bucket.fd, all.data() + done, n * sizeof(TaggedKey), done * sizeof(TaggedKey));
+            }
+        }
+        std::sort(all.begin(), all.end(), [](const TaggedKey& a, const TaggedKey& b) {
+            return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo;
+        });
+        for (size_t i = 0; i < all.size();) {
+            uint64_t mask = 0;
+            size_t j = i;
+            for (; j < all.size() && all[j].hi == all[i].hi && all[j].lo == all[i].lo; ++j) mask |= all[j].mask;
+            for (; mask; mask &= mask - 1) local[__builtin_ctzll(mask)]++;
+            i = j;
+        }
+    }
+
+    std::vector<uint64_t> finalize() {
+        if (finalized) return counts;
+        finalized = true;
+        phase1Seconds = secondsSince(started);
+        auto phase2Start = std::chrono::steady_clock::now();
+        if (options.log) *options.log << "Phase 2: Counting " << aggregations.size() << " aggregation(s)..." << std::endl;
+
+        counts.assign(aggregations.size(), 0);
+        std::mutex countsLock;
+        TaskGroup group;
+        for (size_t b = 0; b < bucketCount; ++b) {
+            pool->submitOuter(group, [this, b, &countsLock]() {
+                uint64_t local[MAX_AGGREGATIONS] = {};
+                countBucket(b, local);
+                std::lock_guard<std::mutex> guard(countsLock);
+                for (size_t a = 0; a < counts.size(); ++a) counts[a] += local[a];
+            });
+        }
+        pool->wait(group);
+        phase2Seconds = secondsSince(phase2Start);
+        return counts;
+    }
+
+    void printStats(std::ostream& out) const {
+        size_t onDisk = 0;
+        for (size_t b = 0; b < bucketCount; ++b) onDisk += buckets[b].fd >= 0;
+        const double MB = 1024.0 * 1024.0;
+        out << std::fixed << std::setprecision(3) << "Timing: phase 1 " << phase1Seconds << " s, phase 2 "
+            << phase2Seconds << " s" << std::endl;
+        out << std::setprecision(1) << "Aggregations: " << aggregations.size() << " from one pass, "
+            << accepted.load() << " address(es), " << records.load() << " tagged record(s) in " << bucketCount
+            << " bucket(s), " << onDisk << " bucket(s) spilled to disk, peak " << memoryPeak.load() / MB
+            << " MB of " << memoryBudget / MB << " MB budget" << std::endl;
+        out << "Filters: " << masks.include.size() + masks.exclude.size() << " prefix(es) in "
+            << masks.include.lengths() + masks.exclude.lengths() << " length table(s), "
+            << masks.granularities.size() << " granularit(ies), " << masks.sources.size() << " source tag(s)"
+            << std::endl;
+        pool->printStats(out);
+    }
+};
+
+MultiDistinctCounter::MultiDistinctCounter(const DistinctCounterOptions& options,
+                                           const std::vector<Aggregation>& aggregations)
+    : impl(new Impl(options, aggregations)) {}
+
+MultiDistinctCounter::~MultiDistinctCounter() = default;
+
+size_t MultiDistinctCounter::add_text_buffer(const char* text, size_t length, const std::string& source) {
+    return impl->addText(text, length, impl->sourceBits(source));
+}
+
+void MultiDistinctCounter::add_batch(const uint128_t* keys, size_t count, const std::string& source) {
+    impl->addBatch(keys, count, impl->sourceBits(source));
+}
+
+void MultiDistinctCounter::add_file(const std::string& path, const std::string& source) {
+    impl->addFile(path, impl->sourceBits(source));
+}
+
+std::vector<uint64_t> MultiDistinctCounter::finalize() {
+    return impl->finalize();
+}
+
+void MultiDistinctCounter::print_stats(std::ostream& out) const {
+    impl->printStats(out);
+}
+
+// --- ПОИСК ПО ИНДЕКСУ ---
+
+// Индекс только читается: поиск не меняет состояния, поэтому методы можно звать из многих потоков
+struct DistinctIndex::Impl {
+    std::string path;
+    std::unique_ptr<MappedFile> file;
+    IndexHeader header;
+    IndexView view;
+    const IndexSearchKernel& kernel = indexSearchKernel();
+
+    // Проверяются только заголовок и границы частей, чтобы открытие не зависело от размера индекса
+    explicit Impl(const std::string& path) : path(path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Could not open index " + path);
+        }
+        uint64_t size = st.st_size;
+        try {
+            if (size < sizeof(IndexHeader)) throw std::runtime_error(path + " is not an address index");
+            file.reset(new MappedFile(fd, size, false));
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        std::memcpy(&header, file->data(), sizeof(header));
+        uint64_t slots = uint64_t(1) << std::min(header.directoryBits, INDEX_MAX_DIRECTORY_BITS);
+        bool valid = std::memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                     header.version == INDEX_VERSION && header.directoryBits >= 1 &&
+                     header.directoryBits <= INDEX_MAX_DIRECTORY_BITS &&
+                     header.directoryOffset % sizeof(uint64_t) == 0 &&
+                     header.directoryOffset + (slots + 1) * sizeof(uint64_t) <= header.keysOffset &&
+                     header.keysOffset % INDEX_ALIGN == 0 && header.keysOffset <= header.containersOffset &&
+                     (header.containersOffset - header.keysOffset) / sizeof(uint128_t) >= header.keys &&
+                     header.containersOffset % INDEX_ALIGN == 0 && header.containersOffset <= header.dataOffset &&
+                     (header.dataOffset - header.containersOffset) / (sizeof(uint128_t) + sizeof(IndexContainer)) >=
+                         header.containers &&
+                     header.dataOffset % sizeof(uint64_t) == 0 && header.dataOffset <= size;
+        if (!valid) throw std::runtime_error(path + " is not an address index or is damaged");
+        view.directory = reinterpret_cast<const uint64_t*>(file->data() + header.directoryOffset);
+        view.keys = reinterpret_cast<const uint128_t*>(file->data() + header.keysOffset);
+        view.shift = 64 - header.directoryBits;
+        view.prefixes = reinterpret_cast<const uint128_t*>(file->data() + header.containersOffset);
+        view.containers = reinterpret_cast<const IndexContainer*>(view.prefixes + header.containers);
+        view.containerCount = header.containers;
+        view.data = file->data() + header.dataOffset;
+        view.dataBytes = size - header.dataOffset;
+        if (view.directory[0] != 0 || view.directory[slots] != header.keys) {
+            throw std::runtime_error(path + " is not an address index or is damaged");
+        }
+        // Поиск читает по строке кэша из случайных мест: упреждающее чтение страниц только мешает
+        madvise(file->data(), file->size(), MADV_RANDOM);
+    }
+
+    size_t containsBatch(const uint128_t* keys, size_t count, uint8_t* found) const {
+        size_t hits = 0;
+        for (size_t i = 0; i < count; i += LOOKUP_GROUP) {
+            hits += kernel.searchGroup(view, keys + i, std::min(LOOKUP_GROUP, count - i), found + i);
+        }
+        if (view.containerCount == 0) return hits;
+        for (size_t i = 0; i < count; ++i) {
+            if (found[i]) continue;
+            found[i] = containerSearch(view, keys[i]);
+            hits += found[i];
+        }
+        return hits;
+    }
+
+    void printStats(std::ostream& out) const {
+        uint64_t slots = uint64_t(1) << header.directoryBits;
+        out << "Index: " << header.keys + header.containerKeys << " address(es), " << header.keys << " in " << slots
+            << " directory slot(s) and " << header.containerKeys << " in " << header.containers
+            << " container(s) for dense /112 prefixes; " << std::fixed << std::setprecision(1) << file->size() / (1024.0 * 1024.0) << " MB mapped from " << path
+            << "; search kernel: " << kernel.name << std::endl;
+    }
+};
+
+DistinctIndex::DistinctIndex(const std::string& path) : impl(new Impl(path)) {}
+
+DistinctIndex::~DistinctIndex() = default;
+
+uint64_t DistinctIndex::size() const {
+    return impl->header.keys + impl->header.containerKeys;
+}
+
+bool DistinctIndex::contains(const uint128_t& key) const {
+    uint8_t found;
+    return impl->containsBatch(&key, 1, &found) > 0;
+}
+
+size_t DistinctIndex::contains_batch(const uint128_t* keys, size_t count, uint8_t* found) const {
+    return impl->containsBatch(keys, count, found);
+}
+
+void DistinctIndex::print_stats(std::ostream& out) const {
+    impl->printStats(out);
+}
+
+bool parse_ipv6(std::string_view text, uint128_t& key) {
+    return !text.empty() && parseIPv6(text.data(), text.size(), key);
+}
+
+// --- ИНТЕРФЕЙС ДЛЯ C ---
+
+struct dc_counter {
+    DistinctCounter counter;
+
+    explicit dc_counter(const DistinctCounterOptions& options) : counter(options) {}
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+// Исключения не должны пересекать границу C: текст сохраняется для dc_last_error
+template <typename F>
+int guarded(F f) {
+    try {
+        return f();
+    } catch (const std::exception& e) {
+        last_error = e.what();
+    } catch (...) {
+        last_error = "Unknown error";
+    }
+    return -1;
+}
+
+// Пары (старшие, младшие) из dc_add_batch лежат в памяти так же, как uint128_t
+static_assert(sizeof(uint128_t) == 2 * sizeof(uint64_t), "uint128_t must be two packed 64-bit halves");
+
+}  // namespace
+
+extern "C" {
+
+void dc_options_init(dc_options* options) {
+    options->threads = 0;
+    options->memory_bytes = -1;
+    options->temp_dir = NULL;
+}
+
+dc_counter* dc_create(const dc_options* options) {
+    dc_counter* counter = NULL;
+    guarded([&]() {
+        DistinctCounterOptions opts;
+        if (options) {
+            opts.threads = options->threads;
+            if (options->memory_bytes >= 0) opts.memoryBytes = uint64_t(options->memory_bytes);
+            if (options->temp_dir) opts.tempDir = options->temp_dir;
+        }
+        counter = new dc_counter(opts);
+        return 0;
+    });
+    return counter;
+}
+
+void dc_destroy(dc_counter* counter) {
+    delete counter;
+}
+
+int dc_add(dc_counter* counter, const char* line, size_t length) {
+    return guarded([&]() { return counter->counter.add(std::string_view(line, length)) ? 1 : 0; });
+}
+
+int dc_add_batch(dc_counter* counter, const uint64_t* keys, size_t count) {
+    return guarded([&]() {
+        counter->counter.add_batch(reinterpret_cast<const uint128_t*>(keys), count);
+        return 0;
+    });
+}
+
+int dc_add_text_buffer(dc_counter* counter, const char* text, size_t length) {
+    return guarded([&]() {
+        counter->counter.add_text_buffer(text, length);
+        return 0;
+    });
+}
+
+int dc_add_file(dc_counter* counter, const char* path) {
+    return guarded([&]() {
+        counter->counter.add_file(path);
+        return 0;
+    });
+}
+
+int dc_finalize(dc_counter* counter, uint64_t* unique) {
+    return guarded([&]() {
+        *unique = counter->counter.finalize();
+        return 0;
+    });
+}
+
+const char* dc_last_error(void) {
+    return last_error.c_str();
+}
+
+}  // extern "C"
@@ -0,0 +1,260 @@
+// Подсчет различных IPv6 адресов как встраиваемая библиотека (libdistinct_counter.a / .so).
+// Вся работа идет внутри объекта DistinctCounter: у каждого счетчика свои пул потоков,
+// временные файлы, настройки и статистика, поэтому независимые счетчики можно держать
+// в одном процессе одновременно. Интерфейс для C - в distinct_counter_c.h.
+#ifndef DISTINCT_COUNTER_H
+#define DISTINCT_COUNTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#define DISTINCT_COUNTER_API __attribute__((visibility("default")))
+
+// Структура для хранения IPv6 как 128-битного числа (2 x 64 бита). Имя с префиксом dc_,
+// как у функций C-интерфейса, чтобы не спорить с распространенным typedef uint128_t встраивающего кода
+struct dc_key {
+    uint64_t hi;
+    uint64_t lo;
+
+    // Операторы сравнения для сортировки и уникальности
+    bool operator<(const dc_key& other) const {
+        if (hi != other.hi) return hi < other.hi;
+        return lo < other.lo;
+    }
+
+    bool operator==(const dc_key& other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+// Настройки счетчика. Незаданные optional-поля выбираются автоматически: для add_file на пустом
+// счетчике - планом по выборке файла (если plan), иначе значениями по умолчанию.
+struct DistinctCounterOptions {
+    // Половина L2 на поток для prefilterBytes
+    static constexpr size_t PREFILTER_DEFAULT = SIZE_MAX;
+
+    size_t threads = 0;                    // Потоков пула; 0 - все процессоры, доступные процессу
+    std::string tempDir = ".";             // Каталог временных файлов бакетов
+    std::optional<uint64_t> memoryBytes;   // Бюджет бакетов в памяти; по умолчанию четверть RAM, 0 - все на диске
+    std::optional<unsigned> fanout;        // Бакетов первого уровня: степень двойки от 16 до 65536 (по умолчанию 256)
+    std::optional<unsigned> subFanout;     // Подбакетов второго уровня для крупных бакетов; 0 - без второго уровня
+    std::optional<size_t> prefilterBytes;  // Фильтр недавних адресов на поток; 0 - выключен
+    uint64_t maxTempBytes = 0;             // Бюджет временных файлов фазы 1: крупные бакеты сжимаются на ходу; 0 - без него
+    std::optional<bool> sortedCheck;       // add_file: считать упорядоченный файл одним потоковым проходом
+    bool plan = true;                      // add_file на пустом счетчике строит план по выборке файла
+    std::string engine = "auto";           // auto, sort, radix, hash, partitioned-hash, roaring, columnar или network
+    std::string sortKernel = "std";        // std или vector
+    bool hugePages = false;
+    bool asyncIo = false;                  // Только в сборке C++20
+
+    // add_file конвейером чтение -> разбор -> раскладка; 0 потоков - выбрать автоматически
+    struct Pipeline {
+        bool enabled = false;
+        size_t readers = 0;
+        size_t parsers = 0;
+        size_t partitioners = 0;
+    } pipeline;
+
+    // Контрольные точки add_file: не реже чем раз в checkpointSeconds в файл checkpoint пишется манифест
+    // (разложенная часть входа, длины файлов бакетов, посчитанные бакеты), и resume продолжает по нему
+    // прерванный подсчет того же файла. Бакеты при этом всегда пишутся на диск, конвейер не используется.
+    std::string checkpoint;                // Путь манифеста; пусто - без контрольных точек
+    unsigned checkpointSeconds = 60;
+    bool resume = false;
+
+    std::string indexPath;                 // finalize записывает сюда индекс различных адресов для DistinctIndex
+
+    std::ostream* log = nullptr;           // Ход работы и план; nullptr - молча
+};
+
+// Счетчик различных адресов. Методы add* одного счетчика нельзя вызывать из нескольких потоков
+// одновременно; параллельность у счетчика своя. Ошибки ввода-вывода и неверные настройки
+// сообщаются исключениями std::runtime_error и std::invalid_argument.
+class DISTINCT_COUNTER_API DistinctCounter {
+public:
+    explicit DistinctCounter(const DistinctCounterOptions& options = DistinctCounterOptions());
+    ~DistinctCounter(); // Удаляет оставшиеся временные файлы
+
+    DistinctCounter(const DistinctCounter&) = delete;
+    DistinctCounter& operator=(const DistinctCounter&) = delete;
+
+    // Одна строка с адресом; false, если это не IPv6 адрес (строка пропускается)
+    bool add(std::string_view line);
+
+    void add_batch(const dc_key* keys, size_t count);
+#if __cplusplus >= 202002L && __has_include(<span>)
+    void add_batch(std::span<const dc_key> keys) { add_batch(keys.data(), keys.size()); }
+#endif
+
+    // Текст из строк через '\n'. Незавершенная последняя строка ждет продолжения
+    // в следующем вызове или в finalize. Возвращает число принятых адресов.
+    size_t add_text_buffer(const char* text, size_t length);
+
+    // Файл целиком, параллельно фрагментами (или конвейером, если он включен)
+    void add_file(const std::string& path);
+
+    // Подсчет по всему добавленному; после него add* недоступны, повторный вызов возвращает то же число
+    uint64_t finalize();
+
+    // Время фаз и статистика движков, памяти и потоков (после finalize)
+    void print_stats(std::ostream& out) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Счетчик для долгоживущего процесса: адреса можно добавлять из нескольких потоков одновременно,
+// а count() в любой момент дает точное число различных среди всего добавленного, не останавливая
+// добавление. Бакеты держат отсортированные прогоны различных адресов и сливают с ними новые адреса
+// по мере накопления; прогоны сверх memoryBytes уходят во временные файлы, начиная с самого большого.
+// Из настроек используются threads, tempDir, memoryBytes, fanout, sortKernel, hugePages и log.
+class DISTINCT_COUNTER_API LiveDistinctCounter {
+public:
+    explicit LiveDistinctCounter(const DistinctCounterOptions& options = DistinctCounterOptions());
+    ~LiveDistinctCounter(); // Удаляет временные файлы прогонов
+
+    LiveDistinctCounter(const LiveDistinctCounter&) = delete;
+    LiveDistinctCounter& operator=(const LiveDistinctCounter&) = delete;
+
+    // Целые строки через '\n' (последняя может быть без него); возвращает число принятых адресов
+    size_t add_text_buffer(const char* text, size_t length);
+    void add_batch(const dc_key* keys, size_t count);
+
+    // Учтено все, что было добавлено до вызова
+    uint64_t count();
+
+    void print_stats(std::ostream& out) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Окна времени для WindowedDistinctCounter. Строки журнала делятся на поля пробелами; по умолчанию
+// формат access log nginx и Apache: адрес первым полем, "[10/Oct/2000:13:55:36 -0700]" - четвертым.
+// Метка времени может быть и в ISO 8601 или Unix-временем в секундах. Окна выровнены от 1970-01-01 UTC.
+struct WindowOptions {
+    uint64_t windowSeconds = 300;
+    uint64_t stepSeconds = 0;      // 0 - окна встык; иначе скользящее окно со сдвигом на шаг (делитель окна)
+    unsigned addressField = 1;     // Номера полей с 1
+    unsigned timeField = 4;
+    std::optional<uint64_t> latenessSeconds; // Насколько строки могут опаздывать; по умолчанию шаг окна
+};
+
+struct WindowCount {
+    int64_t start;     // Unix-время, начало включительно
+    int64_t end;       // Конец не включительно
+    uint64_t distinct;
+    bool exact;        // Окна встык считаются точно, скользящие - оценкой HyperLogLog (ошибка около 0.8%)
+};
+
+// Ряд числа различных адресов по окнам времени за один проход. Окно закрывается и передается
+// в emit по порядку, когда самая поздняя метка времени ушла за его конец больше чем на
+// latenessSeconds; строки, пришедшие в уже закрытое окно, считаются опоздавшими и отбрасываются.
+// Из настроек счетчика используются threads и log.
+class DISTINCT_COUNTER_API WindowedDistinctCounter {
+public:
+    WindowedDistinctCounter(const DistinctCounterOptions& options, const WindowOptions& windows,
+                            std::function<void(const WindowCount&)> emit);
+    ~WindowedDistinctCounter();
+
+    WindowedDistinctCounter(const WindowedDistinctCounter&) = delete;
+    WindowedDistinctCounter& operator=(const WindowedDistinctCounter&) = delete;
+
+    // Строки через '\n', незавершенная последняя ждет продолжения; возвращает число принятых строк
+    size_t add_text_buffer(const char* text, size_t length);
+    void add_file(const std::string& path);
+
+    // Закрывает все оставшиеся окна
+    void finish();
+
+    void print_stats(std::ostream& out) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Один из подсчетов MultiDistinctCounter: адреса, прошедшие фильтры, огрубленные до префиксов длины granularity
+struct Aggregation {
+    std::string name;
+    std::vector<std::string> prefixes;  // "2001:db8::/32" или адрес; пусто - все адреса
+    std::vector<std::string> excluded;  // Префиксы, адреса из которых не считаются (например, боты)
+    std::vector<std::string> sources;   // Теги источников из add_*; пусто - все источники
+    unsigned granularity = 128;         // Считать различные префиксы /granularity, от 1 до 128
+};
+
+// Несколько подсчетов различных адресов за одно чтение и один проход раскладки и подсчета.
+// Каждый адрес еще при разборе получает маску подсчетов, которым он подходит; записи (адрес, маска)
+// раскладываются по бакетам, а в фазе 2 маски одинаковых адресов объединяются, и адрес прибавляется
+// к каждому подсчету из маски. Подсчетов не больше 64. Из настроек используются threads, tempDir,
+// memoryBytes, fanout и log.
+class DISTINCT_COUNTER_API MultiDistinctCounter {
+public:
+    static constexpr size_t MAX_AGGREGATIONS = 64;
+
+    MultiDistinctCounter(const DistinctCounterOptions& options, const std::vector<Aggregation>& aggregations);
+    ~MultiDistinctCounter(); // Удаляет временные файлы
+
+    MultiDistinctCounter(const MultiDistinctCounter&) = delete;
+    MultiDistinctCounter& operator=(const MultiDistinctCounter&) = delete;
+
+    // Целые строки через '\n' (последняя может быть без него) из источника source; возвращает число адресов
+    size_t add_text_buffer(const char* text, size_t length, const std::string& source = std::string());
+    void add_batch(const dc_key* keys, size_t count, const std::string& source = std::string());
+    void add_file(const std::string& path, const std::string& source);
+
+    // Числа различных адресов (префиксов) в порядке подсчетов; после него add* недоступны
+    std::vector<uint64_t> finalize();
+
+    void print_stats(std::ostream& out) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Индекс различных адресов, записанный DistinctCounter::finalize по DistinctCounterOptions::indexPath.
+// Файл отображается в память только для чтения и не копируется: открытие проверяет лишь заголовок,
+// страницы подгружаются по мере поиска. Каталог в начале файла делит адреса на участки по старшим битам,
+// а внутри участка адреса лежат в порядке Эйтцингера (отсортированный массив как дерево поиска по уровням).
+// Плотные префиксы /112 хранятся контейнерами Roaring: массивом, битовой картой или отрезками младших 16 бит.
+// Методы можно вызывать из нескольких потоков одновременно.
+class DISTINCT_COUNTER_API DistinctIndex {
+public:
+    explicit DistinctIndex(const std::string& path);
+    ~DistinctIndex();
+
+    DistinctIndex(const DistinctIndex&) = delete;
+    DistinctIndex& operator=(const DistinctIndex&) = delete;
+
+    uint64_t size() const; // Число адресов в индексе
+
+    bool contains(const dc_key& key) const;
+
+    // found[i] = 1, если keys[i] есть в индексе, иначе 0; возвращает число найденных. Поиски пачки идут
+    // вперемешку (на AVX2 - векторными выборками), чтобы промахи кэша разных поисков перекрывались.
+    size_t contains_batch(const dc_key* keys, size_t count, uint8_t* found) const;
+
+    void print_stats(std::ostream& out) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Разбор строки с IPv6 адресом тем же разборщиком, что у счетчиков; false, если это не адрес
+DISTINCT_COUNTER_API bool parse_ipv6(std::string_view text, dc_key& key);
+
+#endif // DISTINCT_COUNTER_H
@@ -0,0 +1,45 @@
+/* Интерфейс libdistinct_counter для C: тонкая обертка над DistinctCounter из distinct_counter.h.
+ * Функции, возвращающие int, дают 0 при успехе и -1 при ошибке; текст последней ошибки
+ * вызывающего потока возвращает dc_last_error(). */
+#ifndef DISTINCT_COUNTER_C_H
+#define DISTINCT_COUNTER_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DC_API __attribute__((visibility("default")))
+
+typedef struct dc_counter dc_counter;
+
+typedef struct dc_options {
+    size_t threads;         /* 0 - все процессоры */
+    int64_t memory_bytes;   /* Бюджет бакетов в памяти; < 0 - по умолчанию, 0 - все на диске */
+    const char* temp_dir;   /* NULL - текущий каталог */
+} dc_options;
+
+/* Значения по умолчанию; поля, добавленные позже, тоже получат их */
+DC_API void dc_options_init(dc_options* options);
+
+/* NULL при ошибке; options == NULL - все по умолчанию */
+DC_API dc_counter* dc_create(const dc_options* options);
+DC_API void dc_destroy(dc_counter* counter);
+
+/* 1 - адрес принят, 0 - строка не адрес, -1 - ошибка */
+DC_API int dc_add(dc_counter* counter, const char* line, size_t length);
+/* keys - пары (старшие, младшие) 64 бита адреса, count - число адресов */
+DC_API int dc_add_batch(dc_counter* counter, const uint64_t* keys, size_t count);
+DC_API int dc_add_text_buffer(dc_counter* counter, const char* text, size_t length);
+DC_API int dc_add_file(dc_counter* counter, const char* path);
+DC_API int dc_finalize(dc_counter* counter, uint64_t* unique);
+
+DC_API const char* dc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DISTINCT_COUNTER_C_H */